@@ -0,0 +1,313 @@
+#include "budget_reservoir.h"
+#include "reservoir_core.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <limits>
+#include <random>
+
+
+
+// Move to the front the longest prefix, in decreasing order of key,
+// of 'c[0 .. n)' whose bytes add up to at most 'budget', and return
+// its length. If that is less than 'n', the entry right after the
+// prefix has the largest key of the rest.
+//
+// Quickselect on the cumulative size: each round places the median of
+// the open range by 'nth_element' and keeps the half in which the
+// budget runs out. Expected O(n).
+template<typename C>
+static size_t select_prefix(C * c, size_t n, size_t budget)
+{
+    auto by_key = [](C const & x, C const & y) { return x.key > y.key; };
+
+    size_t lo = 0;
+    size_t hi = n;
+        // 'c[0 .. lo)' fits and has the largest keys;
+        // 'c[hi]' does not fit after 'c[0 .. hi)', and has the largest
+        // key of 'c[hi .. n)'.
+    size_t used = 0;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        std::nth_element(c + lo, c + mid, c + hi, by_key);
+        size_t b = 0;
+        for (size_t i = lo; i <= mid; ++i)
+        {
+            b += c[i].bytes;
+        }
+        if (used + b <= budget)
+        {
+            used += b;
+            lo = mid + 1;
+        } else
+        {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+
+
+
+budget_weighted_reservoir::budget_weighted_reservoir(
+        const size_t budget_bytes,
+        const double alph)
+{
+    assert(alph >= 0.);
+    assert(budget_bytes > 0);
+    _alpha = alph;
+    _budget = budget_bytes;
+}
+
+
+
+void budget_weighted_reservoir::clear()
+{
+    _bytes = 0;
+    _grand_total = 0;
+    _ref_L = 0;
+    _threshold = 0.;
+    _chosen_times.clear();
+    _chosen_u.clear();
+    _chosen_bytes.clear();
+    _idx_kept.clear();
+    _idx_appended.clear();
+    _moves.clear();
+    _n_relocations = 0;
+}
+
+
+
+bool budget_weighted_reservoir::empty() const
+{
+    return _chosen_times.empty() && _grand_total == 0;
+}
+
+
+double budget_weighted_reservoir::alpha() const
+{
+    return _alpha;
+}
+
+
+size_t budget_weighted_reservoir::budget() const
+{
+    return _budget;
+}
+
+
+size_t budget_weighted_reservoir::bytes() const
+{
+    return _bytes;
+}
+
+
+max_size_t budget_weighted_reservoir::grand_total() const
+{
+    return _grand_total;
+}
+
+
+size_t budget_weighted_reservoir::size() const
+{
+    return _chosen_times.size();
+}
+
+
+max_size_t const * budget_weighted_reservoir::idx_current() const
+{
+    return _chosen_times.empty() ? nullptr : _chosen_times.data();
+}
+
+
+size_t const * budget_weighted_reservoir::item_bytes() const
+{
+    return _chosen_bytes.empty() ? nullptr : _chosen_bytes.data();
+}
+
+
+double budget_weighted_reservoir::threshold() const
+{
+    return _threshold;
+}
+
+
+
+
+void budget_weighted_reservoir::keep_n_append(
+        const size_t n_provided,
+        size_t const * item_bytes)
+{
+    assert(n_provided > 0);
+    assert(item_bytes != nullptr);
+    assert(_grand_total + n_provided > _grand_total);
+        // Guard against overfow of 'max_size_t'.
+
+    std::uniform_real_distribution<double> urd{0.0, 1.0};
+    auto & urng = global_urng();
+
+    const size_t old_size = _chosen_times.size();
+    const max_size_t old_ref_L = _ref_L;
+    if (old_size > 0)
+    {
+        _ref_L = *std::min_element(_chosen_times.begin(), _chosen_times.end());
+    }
+    const double factor = 1.0 / (_grand_total - _ref_L + n_provided);
+
+    double threshold = rescale_threshold(_threshold,
+            _grand_total, old_ref_L, _grand_total + n_provided, _ref_L, _alpha);
+
+    _workspace.clear();
+    double floor = threshold;
+    for (size_t i = 0; i < old_size; ++i)
+    {
+        double key = std::pow((_chosen_times[i] - _ref_L) * factor, _alpha) / _chosen_u[i];
+        _workspace.push_back(candidate{i, _chosen_times[i], _chosen_u[i], key, _chosen_bytes[i]});
+        floor = std::min(floor, key);
+    }
+        // Normally every pre-existing key is above 'threshold'; not
+        // necessarily if '_ref_L' has moved, in which case the
+        // rescaled threshold is approximate, and a new data point that
+        // outranks a pre-existing one must not be rejected outright.
+
+    // Candidates collect in a window; when it fills, the prefix is
+    // selected and the rest dropped. More candidates only add bytes
+    // above any key, so the first key cut off stays cut off, and no
+    // later key not above it can be chosen: it becomes the bound. The
+    // window is at least twice the prefix, so that the rounds cost
+    // O(1) per candidate and the workspace stays within a few times
+    // the sample, however long the batch.
+    size_t window = std::max<size_t>(2 * old_size, 1024);
+    double bound = floor;
+    size_t n_chosen = 0;
+    auto select = [&]()
+    {
+        const size_t n_candidates = _workspace.size();
+        n_chosen = select_prefix(_workspace.data(), n_candidates, _budget);
+        if (n_chosen < n_candidates)
+        {
+            threshold = std::max(threshold, _workspace[n_chosen].key);
+            bound = std::max(bound, _workspace[n_chosen].key);
+            _workspace.resize(n_chosen);
+        }
+    };
+
+    for (size_t j = 0; j < n_provided; ++j)
+    {
+        auto u = urd(urng);
+        if (item_bytes[j] > _budget)
+            continue;
+            // Never kept; ranked, it would end the prefix and raise
+            // the threshold over the whole sample.
+        double key = std::pow((_grand_total + j - _ref_L) * factor, _alpha) / u;
+        if (bound == 0. || key > bound)
+        {
+            _workspace.push_back(candidate{j, _grand_total + j, u, key, item_bytes[j]});
+            if (_workspace.size() == window)
+            {
+                select();
+                window = std::max(window, 2 * n_chosen);
+            }
+        }
+    }
+
+    select();
+    _threshold = threshold;
+
+
+    // Kept pre-existing data points are flagged by restoring their
+    // times, as in 'weighted_reservoir'; chosen new ones go to the
+    // back of the chosen block, in increasing order of index.
+    auto new_begin = std::partition(
+            _workspace.begin(), _workspace.begin() + n_chosen,
+            [this](candidate const & c) { return c.time < _grand_total; });
+    std::sort(new_begin, _workspace.begin() + n_chosen,
+            [](candidate const & x, candidate const & y) { return x.index < y.index; });
+
+    std::fill(_chosen_times.begin(), _chosen_times.end(), _grand_total);
+    for (auto it = _workspace.begin(); it != new_begin; ++it)
+    {
+        _chosen_times[it->index] = it->time;
+    }
+
+    _idx_kept.clear();
+    _idx_appended.clear();
+    _moves.clear();
+    _bytes = 0;
+
+    size_t nn = 0;
+    for (size_t i = 0; i < old_size; ++i)
+    {
+        if (_chosen_times[i] < _grand_total)
+        {
+            if (nn != i)
+            {
+                _chosen_times[nn] = _chosen_times[i];
+                _chosen_u[nn] = _chosen_u[i];
+                _chosen_bytes[nn] = _chosen_bytes[i];
+                _moves.push_back(reservoir_move{i, nn});
+            }
+            _idx_kept.push_back(i);
+            _bytes += _chosen_bytes[nn];
+            ++nn;
+        }
+    }
+    _n_relocations = _moves.size();
+
+    const size_t new_size = nn + (_workspace.begin() + n_chosen - new_begin);
+    _chosen_times.resize(new_size);
+    _chosen_u.resize(new_size);
+    _chosen_bytes.resize(new_size);
+    for (auto it = new_begin; it != _workspace.begin() + n_chosen; ++it)
+    {
+        _chosen_times[nn] = it->time;
+        _chosen_u[nn] = it->u;
+        _chosen_bytes[nn] = it->bytes;
+        _idx_appended.push_back(it->index);
+        _moves.push_back(reservoir_move{it->index, nn});
+        _bytes += it->bytes;
+        ++nn;
+    }
+
+    assert(_bytes <= _budget);
+    _grand_total += n_provided;
+}
+
+
+
+
+size_t budget_weighted_reservoir::n_kept() const
+{
+    return _idx_kept.size();
+}
+
+
+size_t const * budget_weighted_reservoir::idx_kept() const
+{
+    return _idx_kept.data();
+}
+
+
+size_t budget_weighted_reservoir::n_appended() const
+{
+    return _idx_appended.size();
+}
+
+
+size_t const * budget_weighted_reservoir::idx_appended() const
+{
+    return _idx_appended.data();
+}
+
+
+reservoir_move_plan budget_weighted_reservoir::move_plan() const
+{
+    reservoir_move_plan plan;
+    plan.moves = _moves.data();
+    plan.n_relocations = _n_relocations;
+    plan.n_insertions = _moves.size() - _n_relocations;
+    return plan;
+}
@@ -0,0 +1,146 @@
+#ifndef BUDGET_RESERVOIR_H
+#define BUDGET_RESERVOIR_H
+
+
+#include "reservoir.h"
+
+#include <cstddef>    // size_t
+#include <vector>
+
+
+
+/*
+ * Weighted reservoir bounded by the total size of the payloads of its
+ * data points, rather than by their number.
+ *
+ * With payloads from a hundred bytes to a megabyte, a count bound
+ * ('weighted_reservoir::capacity') gives memory use that varies by four
+ * orders of magnitude and must be sized for the worst case. Here the
+ * caller provides the size of each new data point, and the reservoir
+ * holds data points of at most 'budget()' bytes in total.
+ *
+ * Priorities are those of 'weighted_reservoir', with the same forward
+ * decay (Cormode et al. 2009): key '((t - ref_L) / (grand_total -
+ * ref_L))^alpha / u', with 'ref_L' the oldest data point in the
+ * reservoir at the start of each call. In each call, the pre-existing
+ * and the new data points are ranked by key, and the longest prefix
+ * of that ranking whose sizes add up to at most the budget stays; that
+ * is, the lowest-priority data points are evicted until the rest fits.
+ * The prefix is found by a selection in expected linear time, not by
+ * sorting.
+ *
+ * Data points cut off in earlier calls are gone, so later calls cannot
+ * rank against them; a new data point whose key is not above the
+ * largest key cut off so far ('threshold()', carried over calls as in
+ * 'weighted_reservoir') is rejected even if it would fit. The sample is
+ * thus always made of data points with keys above the threshold. With
+ * all sizes equal to 's' and a budget of 'k * s', this chooses the
+ * same data points as a 'weighted_reservoir' of capacity 'k' given the
+ * same random stream.
+ *
+ * A data point larger than the budget is never kept. It is dropped
+ * before ranking, so it neither evicts the data points ranked below it
+ * nor raises the threshold.
+ *
+ * The reservoir reports its rearrangements as 'keep_n_append' of
+ * 'weighted_reservoir' does, by 'idx_kept'/'idx_appended' and by
+ * 'move_plan'; in-place hole filling ('remove_n_inject') does not
+ * apply to data points of different sizes.
+ */
+class budget_weighted_reservoir
+{
+    public:
+        budget_weighted_reservoir(
+                size_t budget_bytes,
+                double alph);
+
+        void clear();
+
+        bool empty() const;
+
+        double alpha() const;
+
+        size_t budget() const;
+
+        size_t bytes() const;
+            // Total size of the data points in the reservoir;
+            // always <= budget().
+
+
+        void keep_n_append(
+                size_t n_provided,
+                size_t const * item_bytes
+                    // Sizes of the 'n_provided' new data points.
+                );
+
+        // Use the following functions after 'keep_n_append', as with
+        // 'weighted_reservoir'.
+        size_t n_kept() const;
+        size_t const * idx_kept() const;
+            // Locations before the call of the pre-existing data points
+            // kept, in increasing order; they form the first block of
+            // the reservoir, in this order.
+        size_t n_appended() const;
+        size_t const * idx_appended() const;
+            // Indices among the new data points of those added, in
+            // increasing order; they follow the kept block, in this
+            // order.
+
+        reservoir_move_plan move_plan() const;
+            // The same rearrangement as a list of moves; see
+            // 'reservoir_move_plan'.
+
+
+        max_size_t grand_total() const;
+
+        size_t size() const;
+            // Number of data points in the reservoir.
+
+        max_size_t const * idx_current() const;
+            // Grand indices of the 'size()' data points in the
+            // reservoir.
+        size_t const * item_bytes() const;
+            // Sizes of the 'size()' data points in the reservoir.
+
+        double threshold() const;
+            // Largest key cut off so far, on the scale of the keys of
+            // the last call; 0 if nothing has been cut off.
+
+    private:
+        struct candidate
+        {
+            size_t index;
+                // Location in the reservoir, or index among the new
+                // data points.
+            max_size_t time;
+            double u;
+            double key;
+            size_t bytes;
+        };
+
+        double _alpha = 0.;
+        size_t _budget = 0;
+
+        size_t _bytes = 0;
+        max_size_t _grand_total = 0;
+        max_size_t _ref_L = 0;
+        double _threshold = 0.;
+
+        std::vector<max_size_t> _chosen_times;
+        std::vector<double> _chosen_u;
+        std::vector<size_t> _chosen_bytes;
+
+        // Not part of the state; describe the last call.
+        std::vector<size_t> _idx_kept;
+        std::vector<size_t> _idx_appended;
+        std::vector<reservoir_move> _moves;
+        size_t _n_relocations = 0;
+
+        std::vector<candidate> _workspace;
+            // Reused across calls, hence no allocation per call once
+            // it has grown.
+};
+
+
+
+#endif  // BUDGET_RESERVOIR_H
@@ -0,0 +1,656 @@
+#ifndef FIXED_RESERVOIR_H
+#define FIXED_RESERVOIR_H
+
+
+#include "reservoir.h"
+#include "reservoir_core.h"
+
+#include "hdf5_hl.h"
+#include "hdf5util.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstddef>    // size_t
+#include <limits>
+#include <random>
+
+
+
+/*
+ * A weighted reservoir of capacity 'N' fixed at compile time, for tiny
+ * samples.
+ *
+ * For a capacity of tens, 'weighted_reservoir' spends more on its heap
+ * arrays, the indirection through them, and the workspace it allocates
+ * per sampled call than on sampling. Here the whole state, and the
+ * views of the last call, are arrays inside the object: no allocation
+ * ever, and an object may be copied or moved by 'memcpy'.
+ *
+ * Keys, thresholds, the landmark and the draws of uniforms are exactly
+ * those of 'weighted_reservoir': from the same random stream, the two
+ * choose the same data points and reach the same threshold. Selection
+ * differs only in where candidates are ranked: in a window of '2 N' on
+ * the stack instead of a workspace from the heap. Once the reservoir is
+ * full, most new data points are settled by comparing '1 / u' against
+ * a key known to be beaten 'N' times, as in 'weighted_reservoir'.
+ *
+ * The views and the move plan have the meaning they have in
+ * 'weighted_reservoir'. New data points taken are placed in increasing
+ * order of their indices in the call.
+ *
+ * 'export_to_file' writes the datasets 'weighted_reservoir' writes,
+ * so either class can import a file written by the other, provided the
+ * capacities agree.
+ */
+template<size_t N>
+class fixed_reservoir
+{
+    static_assert(N > 0, "fixed_reservoir needs a positive capacity");
+
+    public:
+        explicit fixed_reservoir(double alph);
+
+        fixed_reservoir();
+            // Use this form only when the reservoir is to be imported
+            // from a disk file; otherwise use the first form.
+
+        void clear();
+
+        bool empty() const;
+
+        double alpha() const;
+
+        static constexpr size_t capacity() { return N; }
+
+
+        void keep_n_append(size_t n_provided, double const * u = nullptr);
+            // As 'weighted_reservoir::keep_n_append'.
+
+        size_t n_kept() const;
+        size_t const * idx_kept() const;
+        size_t n_appended() const;
+        size_t const * idx_appended() const;
+
+        void remove_n_inject(size_t n_provided, double const * u = nullptr);
+            // As 'weighted_reservoir::remove_n_inject'.
+
+        size_t n_removed() const;
+        size_t const * idx_removed() const;
+        size_t n_injected() const;
+        size_t const * idx_injected() const;
+
+        reservoir_move_plan move_plan() const;
+
+
+        max_size_t grand_total() const;
+
+        size_t size() const;
+
+        max_size_t const * idx_current() const;
+
+        double threshold() const;
+            // As 'weighted_reservoir::threshold'.
+
+
+        herr_t export_to_file(char const * file_name) const;
+        herr_t export_to_file(hid_t loc_id, char const * obj_name) const;
+            // As in 'weighted_reservoir'.
+
+        herr_t import_from_file(char const * file_name);
+        herr_t import_from_file(hid_t loc_id, char const * obj_name);
+            // As in 'weighted_reservoir'; fails if the capacity in the
+            // file is not 'N'.
+
+    private:
+        struct candidate
+        {
+            double key;
+            double u;
+            size_t src;
+                // Slot of a pre-existing data point, or index of a new
+                // one among those provided.
+            bool is_new;
+        };
+
+        void direct(size_t n_provided, double const * u, bool keep);
+        void sample(size_t n_provided, double const * u, bool keep);
+
+        herr_t export_to_file(hid_t) const;
+        herr_t import_from_file(hid_t);
+
+        double _alpha = 0.;
+        size_t _size = 0;
+        max_size_t _grand_total = 0;
+        max_size_t _ref_L = 0;
+        double _threshold = 0.;
+
+        max_size_t _times[N];
+        double _u[N];
+
+        // Not part of the state; describe the last call.
+        int _kept_or_removed = 0;
+            // 1 after 'keep_n_append', 2 after 'remove_n_inject'.
+        size_t _n_kept_or_removed = 0;
+        size_t _n_appended_or_injected = 0;
+        size_t _n_relocations = 0;
+        size_t _idx_kept_or_removed[N];
+        size_t _idx_appended_or_injected[N];
+        reservoir_move _moves[N];
+};
+
+
+
+
+template<size_t N>
+fixed_reservoir<N>::fixed_reservoir(const double alph)
+{
+    assert(alph >= 0.);
+    _alpha = alph;
+}
+
+
+template<size_t N>
+fixed_reservoir<N>::fixed_reservoir()
+{
+}
+
+
+
+template<size_t N>
+void fixed_reservoir<N>::clear()
+{
+    _size = 0;
+    _grand_total = 0;
+    _ref_L = 0;
+    _threshold = 0.;
+    _kept_or_removed = 0;
+    _n_kept_or_removed = 0;
+    _n_appended_or_injected = 0;
+    _n_relocations = 0;
+}
+
+
+template<size_t N>
+bool fixed_reservoir<N>::empty() const
+{
+    return _size == 0 && _grand_total == 0;
+}
+
+
+template<size_t N>
+double fixed_reservoir<N>::alpha() const
+{
+    return _alpha;
+}
+
+
+template<size_t N>
+max_size_t fixed_reservoir<N>::grand_total() const
+{
+    return _grand_total;
+}
+
+
+template<size_t N>
+size_t fixed_reservoir<N>::size() const
+{
+    return _size;
+}
+
+
+template<size_t N>
+max_size_t const * fixed_reservoir<N>::idx_current() const
+{
+    return _times;
+}
+
+
+template<size_t N>
+double fixed_reservoir<N>::threshold() const
+{
+    return _threshold;
+}
+
+
+
+template<size_t N>
+size_t fixed_reservoir<N>::n_kept() const
+{
+    return (_kept_or_removed == 1) ? _n_kept_or_removed : 0;
+}
+
+
+template<size_t N>
+size_t const * fixed_reservoir<N>::idx_kept() const
+{
+    return (_kept_or_removed == 1) ? _idx_kept_or_removed : nullptr;
+}
+
+
+template<size_t N>
+size_t fixed_reservoir<N>::n_appended() const
+{
+    return (_kept_or_removed == 1) ? _n_appended_or_injected : 0;
+}
+
+
+template<size_t N>
+size_t const * fixed_reservoir<N>::idx_appended() const
+{
+    return (_kept_or_removed == 1) ? _idx_appended_or_injected : nullptr;
+}
+
+
+template<size_t N>
+size_t fixed_reservoir<N>::n_removed() const
+{
+    return (_kept_or_removed == 2) ? _n_kept_or_removed : 0;
+}
+
+
+template<size_t N>
+size_t const * fixed_reservoir<N>::idx_removed() const
+{
+    return (_kept_or_removed == 2) ? _idx_kept_or_removed : nullptr;
+}
+
+
+template<size_t N>
+size_t fixed_reservoir<N>::n_injected() const
+{
+    return (_kept_or_removed == 2) ? _n_appended_or_injected : 0;
+}
+
+
+template<size_t N>
+size_t const * fixed_reservoir<N>::idx_injected() const
+{
+    return (_kept_or_removed == 2) ? _idx_appended_or_injected : nullptr;
+}
+
+
+template<size_t N>
+reservoir_move_plan fixed_reservoir<N>::move_plan() const
+{
+    reservoir_move_plan plan;
+    plan.moves = _moves;
+    plan.n_relocations = _n_relocations;
+    plan.n_insertions = _n_appended_or_injected;
+    return plan;
+}
+
+
+
+
+template<size_t N>
+void fixed_reservoir<N>::keep_n_append(const size_t n_provided, double const * const u)
+{
+    assert(n_provided > 0);
+    assert(_grand_total + n_provided > _grand_total);
+        // Guard against overfow of 'max_size_t'.
+
+    if (_size + n_provided <= N)
+        this->direct(n_provided, u, true);
+    else
+        this->sample(n_provided, u, true);
+}
+
+
+template<size_t N>
+void fixed_reservoir<N>::remove_n_inject(const size_t n_provided, double const * const u)
+{
+    assert(n_provided > 0);
+    assert(_grand_total + n_provided > _grand_total);
+
+    if (_size + n_provided <= N)
+        this->direct(n_provided, u, false);
+    else
+        this->sample(n_provided, u, false);
+}
+
+
+
+// As 'direct_inject' in reservoir.cpp: all fit; if a threshold is in
+// force (after 'grow_to' on an imported 'weighted_reservoir'), only the
+// data points with keys above it are admitted.
+template<size_t N>
+void fixed_reservoir<N>::direct(const size_t n_provided, double const * const u, const bool keep)
+{
+    std::uniform_real_distribution<double> urd{0.0, 1.0};
+    auto & urng = global_urng();
+
+    _threshold = rescale_threshold(_threshold,
+            _grand_total, _ref_L, _grand_total + n_provided, _ref_L, _alpha);
+    const double factor = 1.0 / (_grand_total - _ref_L + n_provided);
+
+    size_t n = 0;
+    for (size_t i = 0; i < n_provided; ++i)
+    {
+        auto ui = u ? u[i] : urd(urng);
+        if (_threshold == 0.
+                || std::pow((_grand_total + i - _ref_L) * factor, _alpha) / ui > _threshold)
+        {
+            _times[_size + n] = _grand_total + i;
+            _u[_size + n] = ui;
+            _idx_appended_or_injected[n] = i;
+            _moves[n] = reservoir_move{i, _size + n};
+            ++n;
+        }
+    }
+
+    if (keep)
+    {
+        for (size_t i = 0; i < _size; ++i)
+            _idx_kept_or_removed[i] = i;
+        _n_kept_or_removed = _size;
+    } else
+    {
+        _n_kept_or_removed = 0;
+    }
+    _kept_or_removed = keep ? 1 : 2;
+    _n_appended_or_injected = n;
+    _n_relocations = 0;
+
+    _size += n;
+    _grand_total += n_provided;
+}
+
+
+
+// As 'sample_inject' in reservoir.cpp, followed by the bookkeeping of
+// 'keep_n_append' or 'remove_n_inject'.
+template<size_t N>
+void fixed_reservoir<N>::sample(const size_t n_provided, double const * const u, const bool keep)
+{
+    std::uniform_real_distribution<double> urd{0.0, 1.0};
+    auto & urng = global_urng();
+
+    const max_size_t old_ref_L = _ref_L;
+    if (_size > 0)
+        _ref_L = *std::min_element(_times, _times + _size);
+    const double factor = 1.0 / (_grand_total - _ref_L + n_provided);
+
+    double threshold = rescale_threshold(_threshold,
+            _grand_total, old_ref_L, _grand_total + n_provided, _ref_L, _alpha);
+    const double floor = (_size < N) ? threshold : 0.;
+        // As in 'sample_inject': positive only after 'grow_to', while
+        // the reservoir is not yet full; it holds for the whole call.
+
+    // Candidates collect in a window of '2 N'; when it fills, the 'N'
+    // with the largest keys are moved to the front and the rest
+    // rejected, as 'sample_inject' does with its workspace.
+    candidate c[2 * N];
+    size_t m = _size;
+    double cutoff = 0.;
+        // Once 'm >= N', a key not above it loses to 'N' candidates.
+    auto by_key = [](candidate const & x, candidate const & y) { return x.key > y.key; };
+    auto select = [&]()
+    {
+        std::nth_element(c, c + N, c + m, by_key);
+        threshold = std::max(threshold, c[N].key);
+        cutoff = c[N].key;
+        m = N;
+    };
+
+    for (size_t i = 0; i < _size; ++i)
+    {
+        c[i] = candidate{std::pow((_times[i] - _ref_L) * factor, _alpha) / _u[i], _u[i], i, false};
+    }
+    if (m == N)
+    {
+        cutoff = c[0].key;
+        for (size_t i = 1; i < N; ++i)
+            cutoff = std::min(cutoff, c[i].key);
+    }
+
+    for (size_t j = 0; j < n_provided; ++j)
+    {
+        auto uj = u ? u[j] : urd(urng);
+        const double bound = (m < N) ? threshold
+            : std::max(floor, std::min(threshold, cutoff));
+            // As in 'sample_inject': a key not above it is neither
+            // chosen nor raises the threshold.
+        if (bound != 0. && 1. / uj <= bound)
+            continue;
+        double key = std::pow((_grand_total + j - _ref_L) * factor, _alpha) / uj;
+        if (bound != 0. && key <= bound)
+            continue;
+
+        c[m++] = candidate{key, uj, j, true};
+        if (m == N)
+        {
+            cutoff = c[0].key;
+            for (size_t i = 1; i < N; ++i)
+                cutoff = std::min(cutoff, c[i].key);
+        } else if (m == 2 * N)
+        {
+            select();
+        }
+    }
+    if (m > N)
+        select();
+    _threshold = threshold;
+
+
+    // Pre-existing data points kept are flagged in 'survives'; new ones
+    // taken go to the front of 'c', in increasing order of index.
+    bool survives[N] = {};
+    size_t n_new = 0;
+    for (size_t i = 0; i < m; ++i)
+    {
+        if (c[i].is_new)
+            c[n_new++] = c[i];
+        else
+            survives[c[i].src] = true;
+    }
+    for (size_t i = 1; i < n_new; ++i)
+    {
+        candidate x = c[i];
+        size_t k = i;
+        for (; k > 0 && c[k - 1].src > x.src; --k)
+            c[k] = c[k - 1];
+        c[k] = x;
+    }
+
+    if (keep)
+    {
+        // Kept data points are compacted to the front in increasing
+        // order of their old slots; new ones follow.
+        size_t nn = 0;
+        _n_relocations = 0;
+        for (size_t i = 0; i < _size; ++i)
+        {
+            if (survives[i])
+            {
+                if (nn != i)
+                {
+                    _times[nn] = _times[i];
+                    _u[nn] = _u[i];
+                    _moves[_n_relocations++] = reservoir_move{i, nn};
+                }
+                _idx_kept_or_removed[nn] = i;
+                ++nn;
+            }
+        }
+        _n_kept_or_removed = nn;
+        for (size_t k = 0; k < n_new; ++k, ++nn)
+        {
+            _times[nn] = _grand_total + c[k].src;
+            _u[nn] = c[k].u;
+            _idx_appended_or_injected[k] = c[k].src;
+            _moves[_n_relocations + k] = reservoir_move{c[k].src, nn};
+        }
+        _kept_or_removed = 1;
+        _size = nn;
+    } else
+    {
+        // New data points fill the slots of those removed, in
+        // increasing order, then are appended.
+        size_t n_removed = 0;
+        for (size_t i = 0; i < _size; ++i)
+        {
+            if (!survives[i])
+                _idx_kept_or_removed[n_removed++] = i;
+        }
+        _n_kept_or_removed = n_removed;
+        assert(n_new >= n_removed);
+        size_t slot = _size;
+        for (size_t k = 0; k < n_new; ++k)
+        {
+            size_t dst = (k < n_removed) ? _idx_kept_or_removed[k] : slot++;
+            _times[dst] = _grand_total + c[k].src;
+            _u[dst] = c[k].u;
+            _idx_appended_or_injected[k] = c[k].src;
+            _moves[k] = reservoir_move{c[k].src, dst};
+        }
+        _n_relocations = 0;
+        _kept_or_removed = 2;
+        _size = slot;
+    }
+    _n_appended_or_injected = n_new;
+
+    _grand_total += n_provided;
+}
+
+
+
+
+template<size_t N>
+herr_t fixed_reservoir<N>::export_to_file(hid_t loc_id) const
+{
+    hsize_t dims[1] = {1};
+    herr_t status;
+    const size_t capacity = N;
+
+    status = h5make_dataset_number(loc_id, "alpha", 1, dims, &_alpha);
+    if (status < 0)
+        return status;
+    status = h5make_dataset_number(loc_id, "capacity", 1, dims, &capacity);
+    if (status < 0)
+        return status;
+    status = h5make_dataset_number(loc_id, "current_size", 1, dims, &_size);
+    if (status < 0)
+        return status;
+    status = h5make_dataset_number(loc_id, "grand_total", 1, dims, &_grand_total);
+    if (status < 0)
+        return status;
+    status = h5make_dataset_number(loc_id, "ref_L", 1, dims, &_ref_L);
+    if (status < 0)
+        return status;
+    status = h5make_dataset_number(loc_id, "threshold", 1, dims, &_threshold);
+    if (status < 0)
+        return status;
+
+    dims[0] = N;
+    status = h5make_dataset_number(loc_id, "chosen_times", 1, dims, _times);
+    if (status < 0)
+        return status;
+    return h5make_dataset_number(loc_id, "chosen_u", 1, dims, _u);
+}
+
+
+template<size_t N>
+herr_t fixed_reservoir<N>::export_to_file(hid_t loc_id, char const * name) const
+{
+    if (name[0] == '.' && name[1] == '\0')
+        return this->export_to_file(loc_id);
+    hid_t group_id = H5Gcreate(loc_id, name, H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+    if (group_id < 0)
+        return group_id;
+    auto status = this->export_to_file(group_id);
+    H5Gclose(group_id);
+    return status;
+}
+
+
+template<size_t N>
+herr_t fixed_reservoir<N>::export_to_file(char const * file) const
+{
+    hid_t file_id = H5Fcreate(file, H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT);
+    if (file_id < 0)
+        return file_id;
+    herr_t status = this->export_to_file(file_id);
+    H5Fclose(file_id);
+    return status;
+}
+
+
+
+template<size_t N>
+herr_t fixed_reservoir<N>::import_from_file(hid_t loc_id)
+{
+    assert(this->empty());
+
+    herr_t status;
+    size_t capacity = 0;
+
+    status = h5read_dataset_number(loc_id, "capacity", &capacity);
+    if (status < 0)
+        return status;
+    if (capacity != N)
+        return -1;
+
+    status = h5read_dataset_number(loc_id, "alpha", &_alpha);
+    if (status < 0)
+        return status;
+    status = h5read_dataset_number(loc_id, "current_size", &_size);
+    if (status < 0)
+        return status;
+    status = h5read_dataset_number(loc_id, "grand_total", &_grand_total);
+    if (status < 0)
+        return status;
+    status = h5read_dataset_number(loc_id, "ref_L", &_ref_L);
+    if (status < 0)
+        return status;
+    _threshold = 0.;
+    if (H5LTfind_dataset(loc_id, "threshold") > 0)
+    {
+        status = h5read_dataset_number(loc_id, "threshold", &_threshold);
+        if (status < 0)
+            return status;
+    }
+    status = h5read_dataset_number(loc_id, "chosen_times", _times);
+    if (status < 0)
+        return status;
+    status = h5read_dataset_number(loc_id, "chosen_u", _u);
+    if (status < 0)
+        return status;
+
+    _kept_or_removed = 0;
+    _n_kept_or_removed = 0;
+    _n_appended_or_injected = 0;
+    _n_relocations = 0;
+    return 0;
+}
+
+
+template<size_t N>
+herr_t fixed_reservoir<N>::import_from_file(hid_t loc_id, char const * name)
+{
+    if (name[0] == '.' && name[1] == '\0')
+        return this->import_from_file(loc_id);
+    hid_t group_id = H5Gopen(loc_id, name, H5P_DEFAULT);
+    if (group_id < 0)
+        return group_id;
+    auto status = this->import_from_file(group_id);
+    H5Gclose(group_id);
+    return status;
+}
+
+
+template<size_t N>
+herr_t fixed_reservoir<N>::import_from_file(char const * file)
+{
+    assert(this->empty());
+    hid_t file_id = H5Fopen(file, H5F_ACC_RDONLY, H5P_DEFAULT);
+    if (file_id < 0)
+        return file_id;
+    herr_t status = this->import_from_file(file_id);
+    H5Fclose(file_id);
+    return status;
+}
+
+
+
+#endif  // FIXED_RESERVOIR_H
@@ -4,102 +4,167 @@
 
 
 
-template<typename T>
-hid_t h5get_mem_type()
+hsize_t h5get_array_npoints(hid_t loc_id, const char * name)
 {
-    assert(false);
-        // Only use the specialized types.
+    h5dataset_handle d{H5Dopen(loc_id, name, H5P_DEFAULT)};
+    if (!d.valid())
+    {
+        return d.get();
+    }
+
+    h5dataspace_handle s{H5Dget_space(d.get())};
+    if (!s.valid())
+    {
+        return s.get();
+    }
+
+    return H5Sget_simple_extent_npoints(s.get());
+        // size < 0 if unsuccessful.
 }
 
 
 
-template<>
-hid_t h5get_mem_type<char>()
-{
-    return H5T_NATIVE_CHAR;
-}
 
-template<>
-hid_t h5get_mem_type<unsigned char>()
+herr_t h5dataset::open(hid_t loc_id, char const * name)
 {
-    return H5T_NATIVE_UCHAR;
-}
+    this->close();
 
+    _dset.reset(H5Dopen(loc_id, name, H5P_DEFAULT));
+    if (!_dset.valid())
+    {
+        return _dset.release();
+    }
 
-template<>
-hid_t h5get_mem_type<short>()
-{
-    return H5T_NATIVE_SHORT;
-}
+    h5datatype_handle disk_type{H5Dget_type(_dset.get())};
+    if (!disk_type.valid())
+    {
+        this->close();
+        return disk_type.get();
+    }
+    _native_type.reset(H5Tget_native_type(disk_type.get(), H5T_DIR_ASCEND));
+    if (!_native_type.valid())
+    {
+        this->close();
+        return _native_type.release();
+    }
 
-template<>
-hid_t h5get_mem_type<unsigned short>()
-{
-    return H5T_NATIVE_USHORT;
+    herr_t status = this->refresh();
+    if (status < 0)
+    {
+        this->close();
+    }
+    return status;
 }
 
 
-template<>
-hid_t h5get_mem_type<int>()
-{
-    return H5T_NATIVE_INT;
-}
 
-template<>
-hid_t h5get_mem_type<unsigned int>()
+
+void h5dataset::close()
 {
-    return H5T_NATIVE_UINT;
+    _memspace.reset();
+    _memspace_rows = 0;
+    _filespace.reset();
+    _native_type.reset();
+    _dset.reset();
+    _rank = 0;
+    _npoints = 0;
+    _row_len = 0;
 }
 
 
-template<>
-hid_t h5get_mem_type<long>()
-{
-    return H5T_NATIVE_LONG;
-}
 
-template<>
-hid_t h5get_mem_type<unsigned long>()
+
+herr_t h5dataset::refresh()
 {
-    return H5T_NATIVE_ULONG;
-}
+    assert(_dset.valid());
 
+    _filespace.reset(H5Dget_space(_dset.get()));
+    if (!_filespace.valid())
+    {
+        return _filespace.release();
+    }
 
-template<>
-hid_t h5get_mem_type<float>()
-{
-    return H5T_NATIVE_FLOAT;
-}
+    _rank = H5Sget_simple_extent_ndims(_filespace.get());
+    if (_rank < 0)
+    {
+        return _rank;
+    }
+    H5Sget_simple_extent_dims(_filespace.get(), _dims, nullptr);
 
+    _npoints = H5Sget_simple_extent_npoints(_filespace.get());
+    _row_len = 1;
+    for (int i = 1; i < _rank; ++i)
+    {
+        _row_len *= _dims[i];
+    }
 
-template<>
-hid_t h5get_mem_type<double>()
-{
-    return H5T_NATIVE_DOUBLE;
+    _memspace.reset();
+    _memspace_rows = 0;
+    return 0;
 }
 
 
-hsize_t h5get_array_npoints(hid_t loc_id, const char * name)
+
+
+herr_t h5dataset::select_rows(hsize_t start, hsize_t n_rows)
 {
-    hid_t d = H5Dopen(loc_id, name, H5P_DEFAULT);
-    if (d < 0)
+    assert(_rank > 0);
+    assert(start + n_rows <= _dims[0]);
+
+    hsize_t offset[H5S_MAX_RANK];
+    hsize_t count[H5S_MAX_RANK];
+    offset[0] = start;
+    count[0] = n_rows;
+    for (int i = 1; i < _rank; ++i)
     {
-        return d;
+        offset[i] = 0;
+        count[i] = _dims[i];
     }
 
-    hid_t s = H5Dget_space(d);
-    if (s < 0)
+    herr_t status = H5Sselect_hyperslab(_filespace.get(), H5S_SELECT_SET,
+            offset, nullptr, count, nullptr);
+    if (status < 0)
     {
-        H5Dclose(d);
-        return s;
+        return status;
     }
 
-    hsize_t size = H5Sget_simple_extent_npoints(s);
-        // size < 0 if unsuccessful.
+    if (n_rows != _memspace_rows || !_memspace.valid())
+    {
+        _memspace.reset(H5Screate_simple(_rank, count, nullptr));
+        if (!_memspace.valid())
+        {
+            _memspace_rows = 0;
+            return _memspace.release();
+        }
+        _memspace_rows = n_rows;
+    }
+    return 0;
+}
+
+
 
-    H5Sclose(s);
-    H5Dclose(d);
-    return size;
+
+herr_t h5dataset::read_rows(hsize_t start, hsize_t n_rows, void * buffer, hid_t mem_type)
+{
+    herr_t status = this->select_rows(start, n_rows);
+    if (status < 0)
+    {
+        return status;
+    }
+    return H5Dread(_dset.get(), mem_type, _memspace.get(), _filespace.get(),
+            H5P_DEFAULT, buffer);
 }
 
 
+
+
+herr_t h5dataset::write_rows(hsize_t start, hsize_t n_rows, void const * buffer, hid_t mem_type)
+{
+    herr_t status = this->select_rows(start, n_rows);
+    if (status < 0)
+    {
+        return status;
+    }
+    return H5Dwrite(_dset.get(), mem_type, _memspace.get(), _filespace.get(),
+            H5P_DEFAULT, buffer);
+}
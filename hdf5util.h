@@ -18,64 +18,195 @@
 #include "hdf5.h"
 #include "hdf5_hl.h"
 
+#include <algorithm>
 #include <cassert>
+#include <memory>
 #include <type_traits>
 
 
 
 
+/// Mapping of C++ arithmetic types to HDF5 types, resolved at compile
+/// time. Unsupported types fail to compile instead of hitting an
+/// 'assert' at run time.
+///
+/// The HDF5 predefined type macros (e.g. 'H5T_NATIVE_INT') call
+/// 'H5open' on every use; the ids are looked up once and cached.
+/// They stay valid as long as the HDF5 library is not closed by an
+/// explicit call to 'H5close'.
+
+
+// Native (in-memory) types.
 template<typename T>
-hid_t h5get_mem_type();
+struct h5native_type;
+
+#define HDF5UTIL_NATIVE_TYPE(T, H5TYPE) \
+    template<> \
+    struct h5native_type<T> \
+    { \
+        static hid_t get() \
+        { \
+            static const hid_t id = H5TYPE; \
+            return id; \
+        } \
+    };
+
+HDF5UTIL_NATIVE_TYPE(char, H5T_NATIVE_CHAR)
+HDF5UTIL_NATIVE_TYPE(signed char, H5T_NATIVE_SCHAR)
+HDF5UTIL_NATIVE_TYPE(unsigned char, H5T_NATIVE_UCHAR)
+HDF5UTIL_NATIVE_TYPE(short, H5T_NATIVE_SHORT)
+HDF5UTIL_NATIVE_TYPE(unsigned short, H5T_NATIVE_USHORT)
+HDF5UTIL_NATIVE_TYPE(int, H5T_NATIVE_INT)
+HDF5UTIL_NATIVE_TYPE(unsigned int, H5T_NATIVE_UINT)
+HDF5UTIL_NATIVE_TYPE(long, H5T_NATIVE_LONG)
+HDF5UTIL_NATIVE_TYPE(unsigned long, H5T_NATIVE_ULONG)
+HDF5UTIL_NATIVE_TYPE(long long, H5T_NATIVE_LLONG)
+HDF5UTIL_NATIVE_TYPE(unsigned long long, H5T_NATIVE_ULLONG)
+HDF5UTIL_NATIVE_TYPE(float, H5T_NATIVE_FLOAT)
+HDF5UTIL_NATIVE_TYPE(double, H5T_NATIVE_DOUBLE)
+
+#undef HDF5UTIL_NATIVE_TYPE
+
+
+
+// Standard little-endian (on-disk) types by size and kind.
+template<size_t size, bool is_float, bool is_signed>
+struct h5std_type;
+
+#define HDF5UTIL_STD_TYPE(SIZE, IS_FLOAT, IS_SIGNED, H5TYPE) \
+    template<> \
+    struct h5std_type<SIZE, IS_FLOAT, IS_SIGNED> \
+    { \
+        static hid_t get() \
+        { \
+            static const hid_t id = H5TYPE; \
+            return id; \
+        } \
+    };
+
+HDF5UTIL_STD_TYPE(1, false, true, H5T_STD_I8LE)
+HDF5UTIL_STD_TYPE(2, false, true, H5T_STD_I16LE)
+HDF5UTIL_STD_TYPE(4, false, true, H5T_STD_I32LE)
+HDF5UTIL_STD_TYPE(8, false, true, H5T_STD_I64LE)
+HDF5UTIL_STD_TYPE(1, false, false, H5T_STD_U8LE)
+HDF5UTIL_STD_TYPE(2, false, false, H5T_STD_U16LE)
+HDF5UTIL_STD_TYPE(4, false, false, H5T_STD_U32LE)
+HDF5UTIL_STD_TYPE(8, false, false, H5T_STD_U64LE)
+HDF5UTIL_STD_TYPE(4, true, true, H5T_IEEE_F32LE)
+HDF5UTIL_STD_TYPE(8, true, true, H5T_IEEE_F64LE)
+
+#undef HDF5UTIL_STD_TYPE
 
 
 
 template<typename T>
-hid_t h5get_disk_type()
+struct h5type_traits
 {
-    auto size = sizeof(T);
-    if (std::is_floating_point<T>::value)
-    {
-        if (size == 4)
-            return H5T_IEEE_F32LE;
-        else if (size == 8)
-            return H5T_IEEE_F64LE;
-        else
-            assert(false);
-    } else if (std::is_integral<T>::value)
+    static_assert(std::is_arithmetic<T>::value,
+            "h5type_traits: only arithmetic types are supported");
+
+    static hid_t mem_type()
     {
-        if (std::is_signed<T>::value)
-        {
-            if (size == 1)
-                return H5T_STD_I8LE;
-            else if (size == 2)
-                return H5T_STD_I16LE;
-            else if (size == 4)
-                return H5T_STD_I32LE;
-            else if (size == 8)
-                return H5T_STD_I64LE;
-            else
-                assert(false);
-        } else
-        {
-            if (size == 1)
-                return H5T_STD_U8LE;
-            else if (size == 2)
-                return H5T_STD_U16LE;
-            else if (size == 4)
-                return H5T_STD_U32LE;
-            else if (size == 8)
-                return H5T_STD_U64LE;
-            else
-                assert(false);
-        }
-    } else
+        return h5native_type<typename std::remove_cv<T>::type>::get();
+    }
+
+    static hid_t disk_type()
     {
-        assert(false);
+        return h5std_type<
+            sizeof(T),
+            std::is_floating_point<T>::value,
+            std::is_signed<T>::value
+            >::get();
     }
+};
+
+
+
+template<typename T>
+inline hid_t h5get_mem_type()
+{
+    return h5type_traits<T>::mem_type();
 }
 
 
 
+template<typename T>
+inline hid_t h5get_disk_type()
+{
+    return h5type_traits<T>::disk_type();
+}
+
+
+
+
+/// RAII owners of HDF5 ids.
+/// Each closes its id with the matching 'H5?close' upon destruction.
+
+template<herr_t (*close_fn)(hid_t)>
+class h5handle
+{
+    public:
+        h5handle() {}
+
+        explicit h5handle(hid_t id) : _id(id) {}
+
+        ~h5handle()
+        {
+            this->reset();
+        }
+
+        h5handle(h5handle const &) = delete;
+        h5handle & operator=(h5handle const &) = delete;
+
+        h5handle(h5handle && other) : _id(other.release()) {}
+
+        h5handle & operator=(h5handle && other)
+        {
+            this->reset(other.release());
+            return *this;
+        }
+
+        hid_t get() const
+        {
+            return _id;
+        }
+
+        bool valid() const
+        {
+            return _id >= 0;
+        }
+
+        // Give up ownership without closing.
+        hid_t release()
+        {
+            hid_t id = _id;
+            _id = -1;
+            return id;
+        }
+
+        // Close the owned id, if any, and take ownership of 'id'.
+        void reset(hid_t id = -1)
+        {
+            if (_id >= 0)
+            {
+                close_fn(_id);
+            }
+            _id = id;
+        }
+
+    private:
+        hid_t _id = -1;
+};
+
+typedef h5handle<H5Fclose> h5file_handle;
+typedef h5handle<H5Gclose> h5group_handle;
+typedef h5handle<H5Dclose> h5dataset_handle;
+typedef h5handle<H5Sclose> h5dataspace_handle;
+typedef h5handle<H5Tclose> h5datatype_handle;
+typedef h5handle<H5Pclose> h5plist_handle;
+
+
+
 
 template<typename T>
 herr_t h5make_dataset_number(hid_t loc_id, const char * dset_name, int rank, const hsize_t *dims, const T * buffer)
@@ -100,5 +231,374 @@ herr_t h5read_dataset_number(hid_t loc_id, const char * dset_name, T * buffer)
 // be a 1D array.
 hsize_t h5get_array_npoints(hid_t loc_id, const char * name);
 
+
+
+
+// An open dataset whose handle and file dataspace stay open across
+// repeated reads and writes, with its extent cached.
+//
+// Use this instead of the name-based functions above when the same
+// dataset is accessed many times, e.g. when reading a large dataset
+// in blocks of rows.
+class h5dataset
+{
+    public:
+        h5dataset() {}
+
+        herr_t open(hid_t loc_id, char const * name);
+
+        void close();
+
+        bool is_open() const
+        {
+            return _dset.valid();
+        }
+
+        hid_t id() const
+        {
+            return _dset.get();
+        }
+
+        // Re-read the extent, e.g. after the dataset has been extended.
+        herr_t refresh();
+
+        int rank() const
+        {
+            return _rank;
+        }
+
+        hsize_t const * dims() const
+        {
+            return _dims;
+        }
+
+        // Total number of data entries.
+        hsize_t npoints() const
+        {
+            return _npoints;
+        }
+
+        // Number of data entries per index of the first dimension.
+        hsize_t row_len() const
+        {
+            return _row_len;
+        }
+
+        // Native memory type matching the type stored on disk.
+        // Owned by this object.
+        hid_t native_type() const
+        {
+            return _native_type.get();
+        }
+
+
+        template<typename T>
+        herr_t read(T * buffer) const
+        {
+            return H5Dread(_dset.get(), h5get_mem_type<T>(),
+                    H5S_ALL, H5S_ALL, H5P_DEFAULT, buffer);
+        }
+
+
+        template<typename T>
+        herr_t write(T const * buffer)
+        {
+            return H5Dwrite(_dset.get(), h5get_mem_type<T>(),
+                    H5S_ALL, H5S_ALL, H5P_DEFAULT, buffer);
+        }
+
+
+        // Read rows 'start' thru 'start + n_rows - 1' along the first
+        // dimension, i.e. 'n_rows * row_len()' entries, into 'buffer'.
+        template<typename T>
+        herr_t read_rows(hsize_t start, hsize_t n_rows, T * buffer)
+        {
+            return this->read_rows(start, n_rows, buffer, h5get_mem_type<T>());
+        }
+
+        herr_t read_rows(hsize_t start, hsize_t n_rows, void * buffer, hid_t mem_type);
+
+        template<typename T>
+        herr_t write_rows(hsize_t start, hsize_t n_rows, T const * buffer)
+        {
+            return this->write_rows(start, n_rows, buffer, h5get_mem_type<T>());
+        }
+
+        herr_t write_rows(hsize_t start, hsize_t n_rows, void const * buffer, hid_t mem_type);
+
+    private:
+        h5dataset_handle _dset;
+        h5dataspace_handle _filespace;
+        h5datatype_handle _native_type;
+        int _rank = 0;
+        hsize_t _dims[H5S_MAX_RANK];
+        hsize_t _npoints = 0;
+        hsize_t _row_len = 0;
+
+        // Memory dataspace of the last row-block access, reused while
+        // the block size does not change.
+        h5dataspace_handle _memspace;
+        hsize_t _memspace_rows = 0;
+
+        herr_t select_rows(hsize_t start, hsize_t n_rows);
+};
+
+
+inline hsize_t h5get_array_npoints(h5dataset const & dset)
+{
+    return dset.npoints();
+}
+
+
+
+
+// Writer for a dataset that grows along its first dimension, e.g. a
+// log of the data points chosen by a reservoir over time.
+//
+// The dataset is 1D if 'row_len' is 1; otherwise it is 2D with
+// 'row_len' columns, and each appended record is one row of
+// 'row_len' values.
+// The dataset is created chunked with unlimited max size along the
+// first dimension. Appended rows are collected in an internal buffer
+// and written out, and the dataset extended, only when the buffer is
+// full, upon 'flush' or 'close', or when a single 'append' provides
+// more rows than the buffer holds (those are written straight from
+// the caller's memory).
+template<typename T>
+class h5dataset_appender
+{
+    public:
+        h5dataset_appender() {}
+
+        ~h5dataset_appender()
+        {
+            this->close();
+        }
+
+        h5dataset_appender(h5dataset_appender const &) = delete;
+        h5dataset_appender & operator=(h5dataset_appender const &) = delete;
+
+
+        // Create a new dataset 'name' under 'loc_id'.
+        // 'chunk_rows' is the number of rows per HDF5 chunk; if 0,
+        // a chunk of about 1 MB is used.
+        // 'buffer_rows' is the number of rows buffered in memory
+        // between writes; if 0, four chunks are buffered.
+        herr_t create(
+                hid_t loc_id, char const * name,
+                hsize_t row_len = 1,
+                hsize_t chunk_rows = 0,
+                size_t buffer_rows = 0)
+        {
+            assert(row_len > 0);
+            this->close();
+
+            if (chunk_rows == 0)
+            {
+                chunk_rows = std::max<hsize_t>(1, (1 << 20) / (sizeof(T) * row_len));
+            }
+
+            int rank = (row_len == 1) ? 1 : 2;
+            hsize_t dims[2] = {0, row_len};
+            hsize_t maxdims[2] = {H5S_UNLIMITED, row_len};
+            hsize_t chunk[2] = {chunk_rows, row_len};
+
+            h5dataspace_handle space{H5Screate_simple(rank, dims, maxdims)};
+            if (!space.valid())
+                return space.get();
+
+            h5plist_handle plist{H5Pcreate(H5P_DATASET_CREATE)};
+            if (!plist.valid())
+                return plist.get();
+            herr_t status = H5Pset_chunk(plist.get(), rank, chunk);
+            if (status < 0)
+                return status;
+
+            _dset.reset(H5Dcreate(loc_id, name, h5get_disk_type<T>(), space.get(),
+                    H5P_DEFAULT, plist.get(), H5P_DEFAULT));
+            if (!_dset.valid())
+                return _dset.release();
+
+            _rank = rank;
+            _row_len = row_len;
+            _n_written = 0;
+            return this->make_buffer(buffer_rows ? buffer_rows : 4 * chunk_rows);
+        }
+
+
+        // Open an existing extendable dataset created by 'create'
+        // and append to its end.
+        herr_t open(
+                hid_t loc_id, char const * name,
+                size_t buffer_rows = 0)
+        {
+            this->close();
+
+            _dset.reset(H5Dopen(loc_id, name, H5P_DEFAULT));
+            if (!_dset.valid())
+                return _dset.release();
+
+            h5dataspace_handle space{H5Dget_space(_dset.get())};
+            if (!space.valid())
+            {
+                this->close();
+                return space.get();
+            }
+            hsize_t dims[2] = {0, 1};
+            _rank = H5Sget_simple_extent_ndims(space.get());
+            if (_rank == 1 || _rank == 2)
+            {
+                H5Sget_simple_extent_dims(space.get(), dims, nullptr);
+            } else
+            {
+                this->close();
+                return -1;
+            }
+            _row_len = (_rank == 1) ? 1 : dims[1];
+            _n_written = dims[0];
+
+            if (buffer_rows == 0)
+            {
+                h5plist_handle plist{H5Dget_create_plist(_dset.get())};
+                hsize_t chunk[2] = {0, 0};
+                if (plist.valid())
+                {
+                    H5Pget_chunk(plist.get(), 2, chunk);
+                }
+                buffer_rows = 4 * std::max<hsize_t>(chunk[0], 1);
+            }
+            return this->make_buffer(buffer_rows);
+        }
+
+
+        // Append 'n_rows' rows, i.e. 'n_rows * row_len' values.
+        herr_t append(T const * data, size_t n_rows)
+        {
+            assert(_dset.valid());
+            herr_t status;
+
+            if (_n_buffered + n_rows > _buffer_rows)
+            {
+                status = this->flush();
+                if (status < 0)
+                    return status;
+                if (n_rows >= _buffer_rows)
+                {
+                    return this->write(data, n_rows);
+                }
+            }
+
+            std::copy_n(data, n_rows * _row_len, _buffer.get() + _n_buffered * _row_len);
+            _n_buffered += n_rows;
+            return 0;
+        }
+
+
+        herr_t append(T const & value)
+        {
+            assert(_row_len == 1);
+            return this->append(&value, 1);
+        }
+
+
+        // Write out buffered rows.
+        herr_t flush()
+        {
+            if (_n_buffered == 0)
+                return 0;
+            herr_t status = this->write(_buffer.get(), _n_buffered);
+            if (status < 0)
+                return status;
+            _n_buffered = 0;
+            return 0;
+        }
+
+
+        // Flush and release the dataset. Also called by the destructor.
+        herr_t close()
+        {
+            herr_t status = 0;
+            if (_dset.valid())
+            {
+                status = this->flush();
+                _dset.reset();
+            }
+            _n_buffered = 0;
+            return status;
+        }
+
+
+        // Number of rows appended so far, including buffered ones.
+        hsize_t size() const
+        {
+            return _n_written + _n_buffered;
+        }
+
+
+        hsize_t row_len() const
+        {
+            return _row_len;
+        }
+
+    private:
+        h5dataset_handle _dset;
+        int _rank = 1;
+        hsize_t _row_len = 1;
+        hsize_t _n_written = 0;
+
+        std::unique_ptr<T[]> _buffer;
+        size_t _buffer_len = 0;
+            // Elements allocated; at least '_buffer_rows * _row_len'.
+        size_t _buffer_rows = 0;
+        size_t _n_buffered = 0;
+
+
+        herr_t make_buffer(size_t buffer_rows)
+        {
+            const size_t len = buffer_rows * _row_len;
+            if (len > _buffer_len || _buffer == nullptr)
+            {
+                _buffer.reset(new T[len]);
+                _buffer_len = len;
+            }
+            _buffer_rows = buffer_rows;
+            _n_buffered = 0;
+            return 0;
+        }
+
+
+        // Extend the dataset and write 'n_rows' rows at its end.
+        herr_t write(T const * data, hsize_t n_rows)
+        {
+            hsize_t dims[2] = {_n_written + n_rows, _row_len};
+            herr_t status = H5Dset_extent(_dset.get(), dims);
+            if (status < 0)
+                return status;
+
+            h5dataspace_handle filespace{H5Dget_space(_dset.get())};
+            if (!filespace.valid())
+                return filespace.get();
+
+            hsize_t start[2] = {_n_written, 0};
+            hsize_t count[2] = {n_rows, _row_len};
+            status = H5Sselect_hyperslab(filespace.get(), H5S_SELECT_SET,
+                    start, nullptr, count, nullptr);
+            if (status < 0)
+                return status;
+
+            h5dataspace_handle memspace{H5Screate_simple(_rank, count, nullptr)};
+            if (!memspace.valid())
+                return memspace.get();
+
+            status = H5Dwrite(_dset.get(), h5get_mem_type<T>(), memspace.get(),
+                    filespace.get(), H5P_DEFAULT, data);
+            if (status < 0)
+                return status;
+
+            _n_written += n_rows;
+            return 0;
+        }
+};
+
 #endif   // HDF5UTIL_H
 
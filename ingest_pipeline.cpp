@@ -0,0 +1,243 @@
+#include "ingest_pipeline.h"
+
+#include <algorithm>
+#include <cassert>
+#include <memory>
+
+
+
+ingest_pipeline::ingest_pipeline(
+        weighted_reservoir & reservoir,
+        ingest_policy const & policy,
+        batch_callback on_batch)
+    : _reservoir(reservoir), _policy(policy), _on_batch(std::move(on_batch))
+{
+    assert(_policy.max_delay >= 0.);
+    if (_policy.batch_target == 0)
+    {
+        _policy.batch_target = 2 * _reservoir.capacity();
+    }
+    _sampler = std::thread(&ingest_pipeline::run, this);
+}
+
+
+
+ingest_pipeline::~ingest_pipeline()
+{
+    stop();
+}
+
+
+
+void ingest_pipeline::push(const size_t n, burst_callback on_done)
+{
+    assert(n > 0);
+    assert(!_stopping.load());
+
+    burst * b = new burst{nullptr, n, std::move(on_done)};
+    _n_pushed.fetch_add(n);
+        // Counted before it is linked, so that 'flush' waits for
+        // every burst linked before it is called.
+    burst * next = _head.load(std::memory_order_relaxed);
+    do
+    {
+        b->next = next;
+    } while (!_head.compare_exchange_weak(next, b,
+                std::memory_order_release, std::memory_order_relaxed));
+        // Once linked, 'b' may be sampled and deleted at any time.
+    if (next == nullptr)
+    {
+        // The queue was empty, so the sampler may be asleep. The wake
+        // mutex is free but for the sampler testing the queue before
+        // it sleeps; taking it orders this push before or after that.
+        {
+            std::lock_guard<std::mutex> lock(_wake_mutex);
+        }
+        _wake.notify_one();
+    }
+}
+
+
+
+std::future<ingest_result> ingest_pipeline::submit(const size_t n)
+{
+    auto promise = std::make_shared<std::promise<ingest_result>>();
+    auto future = promise->get_future();
+    push(n, [promise](ingest_result const & r) { promise->set_value(r); });
+    return future;
+}
+
+
+
+void ingest_pipeline::flush()
+{
+    const max_size_t target = _n_pushed.load();
+    _n_flushing.fetch_add(1);
+    {
+        std::unique_lock<std::mutex> lock(_wake_mutex);
+        _wake.notify_one();
+            // Pending bursts are sampled without waiting out
+            // 'max_delay'.
+        _sampled.wait(lock, [&]() { return _n_sampled.load() >= target; });
+    }
+    _n_flushing.fetch_sub(1);
+}
+
+
+
+void ingest_pipeline::stop()
+{
+    if (!_sampler.joinable())
+        return;
+    _stopping.store(true);
+    {
+        std::lock_guard<std::mutex> lock(_wake_mutex);
+    }
+    _wake.notify_one();
+    _sampler.join();
+}
+
+
+
+void ingest_pipeline::inspect(std::function<void(weighted_reservoir const &)> f)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    f(_reservoir);
+}
+
+
+
+size_t ingest_pipeline::n_batches() const
+{
+    return _n_batches.load();
+}
+
+
+max_size_t ingest_pipeline::n_sampled() const
+{
+    return _n_sampled.load();
+}
+
+
+
+
+void ingest_pipeline::run()
+{
+    using clock = std::chrono::steady_clock;
+    const auto max_delay = std::chrono::duration_cast<clock::duration>(
+            std::chrono::duration<double>(_policy.max_delay));
+
+    std::vector<burst *> pending;
+    std::vector<burst *> taken;
+    size_t n_pending = 0;
+    clock::time_point oldest;
+
+    while (true)
+    {
+        const bool stopping = _stopping.load();
+            // Read before the queue, so that a burst pushed before
+            // 'stop' is seen in this round.
+
+        burst * b = _head.exchange(nullptr, std::memory_order_acquire);
+        taken.clear();
+        for (; b != nullptr; b = b->next)
+        {
+            taken.push_back(b);
+        }
+            // The queue is a stack; oldest last.
+        if (!taken.empty() && n_pending == 0)
+        {
+            oldest = clock::now();
+        }
+        for (auto it = taken.rbegin(); it != taken.rend(); ++it)
+        {
+            pending.push_back(*it);
+            n_pending += (*it)->n;
+        }
+
+        if (n_pending > 0 && (n_pending >= _policy.batch_target
+                    || clock::now() - oldest >= max_delay
+                    || _n_flushing.load() > 0 || stopping))
+        {
+            sample(pending, n_pending);
+            pending.clear();
+            n_pending = 0;
+            if (_n_flushing.load() > 0)
+            {
+                {
+                    std::lock_guard<std::mutex> lock(_wake_mutex);
+                }
+                _sampled.notify_all();
+            }
+        } else if (stopping && n_pending == 0)
+        {
+            break;
+        } else
+        {
+            // Sleep until a push finds the queue empty, a flush or a
+            // stop, or, with bursts pending, until the oldest has
+            // waited 'max_delay'.
+            // A flush with nothing pending waits for a push, which
+            // wakes the sampler anyway.
+            std::unique_lock<std::mutex> lock(_wake_mutex);
+            auto woken = [this, n_pending]()
+            {
+                return _head.load(std::memory_order_relaxed) != nullptr
+                    || (n_pending > 0 && _n_flushing.load() > 0)
+                    || _stopping.load();
+            };
+            if (n_pending == 0)
+                _wake.wait(lock, woken);
+            else
+                _wake.wait_until(lock, oldest + max_delay, woken);
+        }
+    }
+}
+
+
+
+void ingest_pipeline::sample(std::vector<burst *> & pending, const size_t n_pending)
+{
+    std::vector<ingest_result> results(pending.size());
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+
+        const max_size_t first = _reservoir.grand_total();
+        _reservoir.keep_n_append(n_pending);
+        if (_on_batch)
+        {
+            _on_batch(_reservoir, first);
+        }
+
+        // Split the new data points taken among the bursts.
+        _appended.assign(_reservoir.idx_appended(),
+                _reservoir.idx_appended() + _reservoir.n_appended());
+        std::sort(_appended.begin(), _appended.end());
+        size_t const * idx = _appended.data();
+        const size_t n_appended = _appended.size();
+        size_t j = 0;
+        size_t offset = 0;
+        for (size_t i = 0; i < pending.size(); ++i)
+        {
+            auto & r = results[i];
+            r.first = first + offset;
+            r.n = pending[i]->n;
+            for (; j < n_appended && idx[j] < offset + r.n; ++j)
+            {
+                r.accepted.push_back(idx[j] - offset);
+            }
+            offset += r.n;
+        }
+    }
+    _n_batches.fetch_add(1);
+
+    for (size_t i = 0; i < pending.size(); ++i)
+    {
+        if (pending[i]->on_done)
+        {
+            pending[i]->on_done(results[i]);
+        }
+        delete pending[i];
+    }
+    _n_sampled.fetch_add(n_pending);
+}
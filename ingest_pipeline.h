@@ -0,0 +1,159 @@
+#ifndef INGEST_PIPELINE_H
+#define INGEST_PIPELINE_H
+
+
+#include "reservoir.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>    // size_t
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+
+/*
+ * An asynchronous stage in front of 'weighted_reservoir::keep_n_append'
+ * for producers that emit small bursts.
+ *
+ * Once the reservoir is full, a call costs O(capacity) however few
+ * data points it brings, so a call per burst of tens of data points
+ * spends most of its time re-ranking the reservoir. Here producers
+ * push bursts into a lock-free multi-producer queue, and a sampler
+ * thread of the pipeline coalesces them into one 'keep_n_append' per
+ * batch. A batch is cut once it holds 'batch_target' data points, or
+ * once the oldest burst in it has waited 'max_delay' seconds.
+ *
+ * A push never waits on the sampler: it links a node onto the queue
+ * with one compare-and-swap (the node is allocated by 'new'), and only
+ * if the queue was empty wakes the sampler. The sampler takes the
+ * whole queue with one exchange, and sleeps while it has nothing to
+ * do. Bursts enter the stream in the order the sampler takes them,
+ * which among producers is the order of their pushes.
+ *
+ * The outcome of a burst, the grand indices its data points were given
+ * and which of them entered the reservoir, is delivered to a callback
+ * on the sampler thread, or through a future. Before those, the
+ * 'on_batch' callback of the pipeline, if any, is called on the
+ * sampler thread right after the engine call, with the reservoir and
+ * the grand index of the first data point of the batch, so that a
+ * user array may follow 'move_plan()'; the new data points of the
+ * batch are the bursts in the order of their 'first'.
+ *
+ * The reservoir is owned by the caller and must outlive the pipeline.
+ * While the pipeline runs, it is accessed only through 'inspect'.
+ */
+
+
+struct ingest_policy
+{
+    size_t batch_target = 0;
+        // Data points at which a batch is cut; 0 for twice the
+        // capacity of the reservoir, where the O(capacity) cost of a
+        // call is well amortized.
+    double max_delay = 1e-3;
+        // Seconds a burst may wait for its batch to fill.
+};
+
+
+
+struct ingest_result
+{
+    max_size_t first = 0;
+        // Grand index of the first data point of the burst; the burst
+        // has grand indices 'first .. first + n'.
+    size_t n = 0;
+    std::vector<size_t> accepted;
+        // 0 based offsets, within the burst, of the data points that
+        // entered the reservoir, in increasing order.
+};
+
+
+
+class ingest_pipeline
+{
+    public:
+        typedef std::function<void(ingest_result const &)> burst_callback;
+        typedef std::function<void(weighted_reservoir const &, max_size_t)> batch_callback;
+
+        ingest_pipeline(
+                weighted_reservoir & reservoir,
+                ingest_policy const & policy = ingest_policy(),
+                batch_callback on_batch = nullptr);
+
+        ~ingest_pipeline();
+            // As 'stop'.
+
+        ingest_pipeline(ingest_pipeline const &) = delete;
+        ingest_pipeline & operator=(ingest_pipeline const &) = delete;
+
+        void push(size_t n, burst_callback on_done = nullptr);
+            // Offer a burst of 'n > 0' data points. Thread safe and
+            // lock free, but for waking an idle sampler; 'on_done' is
+            // called on the sampler thread.
+
+        std::future<ingest_result> submit(size_t n);
+            // As 'push', with the outcome delivered through a future.
+
+        void flush();
+            // Return once every burst pushed before the call has been
+            // sampled and its callbacks have returned; pending bursts
+            // are sampled without waiting for 'max_delay'.
+
+        void stop();
+            // Sample what is pending and join the sampler thread.
+            // Pushes after 'stop' are not allowed.
+
+        void inspect(std::function<void(weighted_reservoir const &)> f);
+            // Call 'f' with the reservoir, between batches.
+
+        size_t n_batches() const;
+            // Engine calls so far.
+
+        max_size_t n_sampled() const;
+            // Data points taken into the stream so far.
+
+    private:
+        struct burst
+        {
+            burst * next;
+            size_t n;
+            burst_callback on_done;
+        };
+
+        void run();
+        void sample(std::vector<burst *> & pending, size_t n_pending);
+
+        weighted_reservoir & _reservoir;
+        ingest_policy _policy;
+        batch_callback _on_batch;
+
+        std::atomic<burst *> _head{nullptr};
+        std::atomic<max_size_t> _n_pushed{0};
+        std::atomic<max_size_t> _n_sampled{0};
+        std::atomic<size_t> _n_batches{0};
+        std::atomic<int> _n_flushing{0};
+        std::atomic<bool> _stopping{false};
+
+        std::vector<size_t> _appended;
+            // Workspace of the sampler.
+
+        std::mutex _mutex;
+            // Held by the sampler around an engine call, and by
+            // 'inspect'.
+
+        std::mutex _wake_mutex;
+        std::condition_variable _wake;
+            // The sampler sleeps on this while it has nothing to do.
+        std::condition_variable _sampled;
+            // 'flush' sleeps on this until its bursts are sampled.
+        std::thread _sampler;
+};
+
+
+
+#endif  // INGEST_PIPELINE_H
@@ -0,0 +1,99 @@
+#include "multi_reservoir.h"
+
+#include <cassert>
+#include <random>
+
+
+
+multi_reservoir::multi_reservoir(
+        std::vector<reservoir_config> const & configs,
+        reservoir_memory_resource * resource,
+        reservoir_memory_resource * workspace_resource)
+{
+    assert(!configs.empty());
+    for (auto const & c : configs)
+    {
+        _reservoirs.emplace_back(new weighted_reservoir(
+                    c.capacity, c.alpha, resource, workspace_resource));
+    }
+}
+
+
+
+void multi_reservoir::clear()
+{
+    for (auto & r : _reservoirs)
+    {
+        r->clear();
+    }
+}
+
+
+
+size_t multi_reservoir::n_configs() const
+{
+    return _reservoirs.size();
+}
+
+
+weighted_reservoir & multi_reservoir::reservoir(const size_t i)
+{
+    return *_reservoirs[i];
+}
+
+
+weighted_reservoir const & multi_reservoir::reservoir(const size_t i) const
+{
+    return *_reservoirs[i];
+}
+
+
+max_size_t multi_reservoir::grand_total() const
+{
+    return _reservoirs.front()->grand_total();
+}
+
+
+double const * multi_reservoir::uniforms() const
+{
+    return _u.data();
+}
+
+
+
+// One uniform per new data point, in the order a single reservoir
+// would draw them, so that a single configuration reproduces a plain
+// 'weighted_reservoir' under the same seed.
+void multi_reservoir::draw(const size_t n_provided)
+{
+    std::uniform_real_distribution<double> urd{0.0, 1.0};
+    auto & urng = global_urng();
+
+    _u.resize(n_provided);
+    for (size_t i = 0; i < n_provided; ++i)
+    {
+        _u[i] = urd(urng);
+    }
+}
+
+
+
+void multi_reservoir::keep_n_append(const size_t n_provided)
+{
+    this->draw(n_provided);
+    for (auto & r : _reservoirs)
+    {
+        r->keep_n_append(n_provided, _u.data());
+    }
+}
+
+
+
+void multi_reservoir::remove_n_inject(const size_t n_provided)
+{
+    this->draw(n_provided);
+    for (auto & r : _reservoirs)
+    {
+        r->remove_n_inject(n_provided, _u.data());
+    }
+}
@@ -0,0 +1,80 @@
+#ifndef MULTI_RESERVOIR_H
+#define MULTI_RESERVOIR_H
+
+
+#include "reservoir.h"
+
+#include <cstddef>    // size_t
+#include <memory>
+#include <vector>
+
+
+
+/*
+ * Several 'weighted_reservoir's, differing in capacity and 'alpha',
+ * fed the same stream in one pass.
+ *
+ * Run separately, each reservoir draws its own uniform per data point
+ * and computes its own key. Here one uniform per data point is drawn
+ * per call and handed to every reservoir ('keep_n_append(n, u)'); each
+ * derives its key from it, on its own decay. Within a reservoir, a new
+ * key is bounded by '1 / u', so once a reservoir is full most new data
+ * points are settled by comparing that bound with its current cutoff,
+ * without computing the key. The marginal cost of a configuration is
+ * then a comparison per data point rather than a uniform and a 'pow'.
+ *
+ * Sharing uniforms makes the samples of the configurations dependent
+ * on one another (with 'alpha = 0', the sample of a smaller capacity
+ * is a subset of that of a larger one); each of them on its own is
+ * distributed as if it had been run alone.
+ *
+ * The views and the move plan of each call are those of the
+ * individual reservoirs, 'reservoir(i)'.
+ */
+
+
+struct reservoir_config
+{
+    size_t capacity;
+    double alpha;
+};
+
+
+
+class multi_reservoir
+{
+    public:
+        explicit multi_reservoir(
+                std::vector<reservoir_config> const & configs,
+                reservoir_memory_resource * resource = nullptr,
+                reservoir_memory_resource * workspace_resource = nullptr
+                    // As in 'weighted_reservoir', for every
+                    // configuration.
+                );
+
+        void clear();
+
+        size_t n_configs() const;
+
+        weighted_reservoir & reservoir(size_t i);
+        weighted_reservoir const & reservoir(size_t i) const;
+
+        max_size_t grand_total() const;
+
+        void keep_n_append(size_t n_provided);
+        void remove_n_inject(size_t n_provided);
+            // Call the same on every reservoir, with shared uniforms.
+
+        double const * uniforms() const;
+            // The 'n_provided' uniforms of the last call.
+
+    private:
+        void draw(size_t n_provided);
+
+        std::vector<std::unique_ptr<weighted_reservoir>> _reservoirs;
+        std::vector<double> _u;
+};
+
+
+
+#endif  // MULTI_RESERVOIR_H
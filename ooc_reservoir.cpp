@@ -0,0 +1,438 @@
+#include "ooc_reservoir.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <random>
+#include <tuple>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+
+// Layout of the store file:
+//
+//   header_t                         (64 bytes)
+//   chosen_times[capacity]           (max_size_t)
+//   chosen_u[capacity]               (double)
+//   payload[capacity * payload_bytes]
+struct ooc_weighted_reservoir::header_t
+{
+    char magic[8];
+    uint64_t capacity;
+    uint64_t payload_bytes;
+    double alpha;
+    uint64_t current_size;
+    uint64_t grand_total;
+    char unused[16];
+};
+
+static_assert(sizeof(max_size_t) == 8, "store layout assumes 8-byte max_size_t");
+
+static const size_t ooc_header_bytes = 64;
+static const char ooc_magic[8] = {'R', 'E', 'S', 'V', 'O', 'O', 'C', '1'};
+
+
+
+static size_t ooc_file_bytes(size_t cap, size_t payload_bytes)
+{
+    return ooc_header_bytes + cap * (sizeof(max_size_t) + sizeof(double) + payload_bytes);
+}
+
+
+
+static inline float ooc_key(double alpha, max_size_t t, double u)
+{
+    return static_cast<float>(alpha * std::log(double(t) + 1.) - std::log(u));
+}
+
+
+
+ooc_weighted_reservoir::ooc_weighted_reservoir()
+{
+}
+
+
+
+ooc_weighted_reservoir::~ooc_weighted_reservoir()
+{
+    this->close();
+}
+
+
+
+
+int ooc_weighted_reservoir::map_file(char const * file, int flags, size_t bytes)
+{
+    _fd = ::open(file, flags, 0644);
+    if (_fd < 0)
+        return -1;
+
+    if (bytes == 0)
+    {
+        // Existing file; take its size from the header.
+        header_t h;
+        if (::pread(_fd, &h, sizeof(h), 0) != sizeof(h)
+                || std::memcmp(h.magic, ooc_magic, sizeof(ooc_magic)) != 0)
+        {
+            ::close(_fd);
+            _fd = -1;
+            errno = EINVAL;
+            return -1;
+        }
+        // The slots of the in-memory heap are 32-bit, and a corrupt or
+        // foreign header must not map less than it claims.
+        const uint64_t per_slot_max =
+            (UINT64_MAX - ooc_header_bytes) / std::max<uint64_t>(h.capacity, 1);
+        if (h.capacity == 0 || h.capacity > UINT32_MAX
+                || h.current_size > h.capacity
+                || h.payload_bytes > per_slot_max - sizeof(max_size_t) - sizeof(double))
+        {
+            ::close(_fd);
+            _fd = -1;
+            errno = EINVAL;
+            return -1;
+        }
+        bytes = ooc_file_bytes(h.capacity, h.payload_bytes);
+
+        struct stat st;
+        if (::fstat(_fd, &st) < 0 || uint64_t(st.st_size) != bytes)
+        {
+            ::close(_fd);
+            _fd = -1;
+            errno = EINVAL;
+            return -1;
+        }
+    } else
+    {
+        if (::ftruncate(_fd, bytes) < 0)
+        {
+            ::close(_fd);
+            _fd = -1;
+            return -1;
+        }
+    }
+
+    _map = ::mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+    if (_map == MAP_FAILED)
+    {
+        _map = nullptr;
+        ::close(_fd);
+        _fd = -1;
+        return -1;
+    }
+    _map_bytes = bytes;
+
+    _header = static_cast<header_t *>(_map);
+    return 0;
+}
+
+
+
+
+void ooc_weighted_reservoir::locate_arrays()
+{
+    static_assert(sizeof(header_t) == ooc_header_bytes, "store header size");
+
+    size_t cap = _header->capacity;
+    char * base = static_cast<char *>(_map);
+    _chosen_times = reinterpret_cast<max_size_t *>(base + ooc_header_bytes);
+    _chosen_u = reinterpret_cast<double *>(_chosen_times + cap);
+    _payload = reinterpret_cast<char *>(_chosen_u + cap);
+}
+
+
+
+
+int ooc_weighted_reservoir::create(
+        char const * file,
+        const size_t cap,
+        const double alph,
+        const size_t payload_bytes)
+{
+    assert(alph >= 0.);
+    assert(cap > 0);
+    assert(cap <= size_t(UINT32_MAX));
+
+    this->close();
+
+    if (this->map_file(file, O_RDWR | O_CREAT | O_TRUNC, ooc_file_bytes(cap, payload_bytes)) < 0)
+        return -1;
+
+    std::memcpy(_header->magic, ooc_magic, sizeof(ooc_magic));
+    _header->capacity = cap;
+    _header->payload_bytes = payload_bytes;
+    _header->alpha = alph;
+    _header->current_size = 0;
+    _header->grand_total = 0;
+    this->locate_arrays();
+
+    _heap.clear();
+    _heap.reserve(cap);
+    return 0;
+}
+
+
+
+
+int ooc_weighted_reservoir::open(char const * file)
+{
+    this->close();
+
+    if (this->map_file(file, O_RDWR, 0) < 0)
+        return -1;
+    this->locate_arrays();
+
+    size_t n = _header->current_size;
+    double alph = _header->alpha;
+
+    _heap.clear();
+    _heap.reserve(_header->capacity);
+    for (size_t i = 0; i < n; ++i)
+    {
+        heap_entry e;
+        e.key = ooc_key(alph, _chosen_times[i], _chosen_u[i]);
+        e.slot = static_cast<uint32_t>(i);
+        _heap.push_back(e);
+    }
+    std::make_heap(_heap.begin(), _heap.end(),
+            [](heap_entry const & x, heap_entry const & y) { return x.key > y.key; });
+
+    return 0;
+}
+
+
+
+
+int ooc_weighted_reservoir::flush()
+{
+    if (_map == nullptr)
+        return 0;
+    return ::msync(_map, _map_bytes, MS_SYNC);
+}
+
+
+
+
+int ooc_weighted_reservoir::close()
+{
+    int status = 0;
+    if (_map != nullptr)
+    {
+        status = this->flush();
+        ::munmap(_map, _map_bytes);
+        _map = nullptr;
+        _map_bytes = 0;
+    }
+    if (_fd >= 0)
+    {
+        if (::close(_fd) < 0)
+            status = -1;
+        _fd = -1;
+    }
+    _header = nullptr;
+    _chosen_times = nullptr;
+    _chosen_u = nullptr;
+    _payload = nullptr;
+    std::vector<heap_entry>().swap(_heap);
+    _idx_written.clear();
+    _slot_written.clear();
+    return status;
+}
+
+
+
+
+bool ooc_weighted_reservoir::is_open() const
+{
+    return _map != nullptr;
+}
+
+
+double ooc_weighted_reservoir::alpha() const
+{
+    return _header->alpha;
+}
+
+
+size_t ooc_weighted_reservoir::capacity() const
+{
+    return _header->capacity;
+}
+
+
+size_t ooc_weighted_reservoir::payload_bytes() const
+{
+    return _header->payload_bytes;
+}
+
+
+size_t ooc_weighted_reservoir::size() const
+{
+    return _header->current_size;
+}
+
+
+max_size_t ooc_weighted_reservoir::grand_total() const
+{
+    return _header->grand_total;
+}
+
+
+
+
+void ooc_weighted_reservoir::sift_down(size_t i)
+{
+    const size_t n = _heap.size();
+    heap_entry e = _heap[i];
+    while (true)
+    {
+        size_t c = 2 * i + 1;
+        if (c >= n)
+            break;
+        if (c + 1 < n && _heap[c + 1].key < _heap[c].key)
+            ++c;
+        if (!(_heap[c].key < e.key))
+            break;
+        _heap[i] = _heap[c];
+        i = c;
+    }
+    _heap[i] = e;
+}
+
+
+
+
+void ooc_weighted_reservoir::keep_n_write(
+        const size_t n_provided,
+        void const * payload)
+{
+    assert(this->is_open());
+    assert(n_provided > 0);
+    assert(payload != nullptr || _header->payload_bytes == 0);
+
+    const size_t cap = _header->capacity;
+    const double alph = _header->alpha;
+    const max_size_t grand_total = _header->grand_total;
+    assert(grand_total + n_provided > grand_total);
+
+    std::uniform_real_distribution<double> urd{0.0, 1.0};
+    auto & urng = global_urng();
+
+    // Decide on all new data points with the in-memory index only.
+    // A slot may be written more than once within a batch; only the
+    // last write survives. Superseded writes are dropped whenever
+    // 'pending' fills, which keeps it within twice the slots written
+    // rather than growing with every data point accepted.
+    std::vector<std::tuple<uint32_t, size_t, double>> pending;
+        // < slot, index in new data, u >
+    size_t pending_len = std::min(n_provided, cap);
+    pending.reserve(pending_len);
+    auto drop_superseded = [&pending]()
+    {
+        // Sorted by slot, then by index in new data: the last entry of
+        // each slot is its last write.
+        std::sort(pending.begin(), pending.end());
+        size_t m = 0;
+        for (size_t j = 0; j < pending.size(); ++j)
+        {
+            if (j + 1 == pending.size()
+                    || std::get<0>(pending[j + 1]) != std::get<0>(pending[j]))
+                pending[m++] = pending[j];
+        }
+        pending.resize(m);
+    };
+
+    size_t size = _header->current_size;
+    auto heap_less = [](heap_entry const & x, heap_entry const & y) { return x.key > y.key; };
+
+    for (size_t i = 0; i < n_provided; ++i)
+    {
+        double u = urd(urng);
+        float key = ooc_key(alph, grand_total + i, u);
+        if (size < cap)
+        {
+            heap_entry e;
+            e.key = key;
+            e.slot = static_cast<uint32_t>(size);
+            _heap.push_back(e);
+            std::push_heap(_heap.begin(), _heap.end(), heap_less);
+            pending.emplace_back(e.slot, i, u);
+            ++size;
+        } else if (key > _heap[0].key)
+        {
+            uint32_t slot = _heap[0].slot;
+            _heap[0].key = key;
+            this->sift_down(0);
+            pending.emplace_back(slot, i, u);
+        }
+        if (pending.size() == pending_len)
+        {
+            drop_superseded();
+            pending_len = std::max(pending_len, 2 * pending.size());
+            pending.reserve(pending_len);
+        }
+    }
+
+    drop_superseded();
+
+    // Write in one sweep in increasing slot order.
+    const size_t pb = _header->payload_bytes;
+    char const * src = static_cast<char const *>(payload);
+    _idx_written.clear();
+    _slot_written.clear();
+    for (size_t j = 0; j < pending.size(); ++j)
+    {
+        uint32_t slot = std::get<0>(pending[j]);
+        size_t i = std::get<1>(pending[j]);
+        _chosen_times[slot] = grand_total + i;
+        _chosen_u[slot] = std::get<2>(pending[j]);
+        if (pb > 0)
+        {
+            std::memcpy(_payload + slot * pb, src + i * pb, pb);
+        }
+        _idx_written.push_back(i);
+        _slot_written.push_back(slot);
+    }
+
+    _header->current_size = size;
+    _header->grand_total = grand_total + n_provided;
+}
+
+
+
+
+size_t ooc_weighted_reservoir::n_written() const
+{
+    return _idx_written.size();
+}
+
+
+size_t const * ooc_weighted_reservoir::idx_written() const
+{
+    return _idx_written.data();
+}
+
+
+uint32_t const * ooc_weighted_reservoir::slot_written() const
+{
+    return _slot_written.data();
+}
+
+
+max_size_t const * ooc_weighted_reservoir::idx_current() const
+{
+    return _chosen_times;
+}
+
+
+void const * ooc_weighted_reservoir::payload(size_t slot) const
+{
+    assert(slot < _header->current_size);
+    return _payload + slot * _header->payload_bytes;
+}
@@ -0,0 +1,152 @@
+#ifndef OOC_RESERVOIR_H
+#define OOC_RESERVOIR_H
+
+
+#include "reservoir.h"
+
+#include <cstddef>    // size_t
+#include <cstdint>    // uint32_t
+#include <vector>
+
+
+
+/*
+ * Out-of-core weighted reservoir, for capacities beyond what fits in
+ * RAM with 'weighted_reservoir'.
+ *
+ * Only a compact priority index is kept in memory: a min-heap of
+ * (float key, uint32 slot) pairs, 8 bytes per slot, so that a
+ * reservoir of 10^9 slots needs about 8 GB of RAM.
+ * The slot data---'chosen_times', 'chosen_u', and a fixed-size
+ * payload per data point---live in a file that is memory-mapped, so
+ * the OS pages them in and out as needed.
+ *
+ * Within each call to 'keep_n_write', all evictions and injections are
+ * decided first, using the in-memory index only; the resulting writes
+ * are then sorted by slot and applied in one sequential sweep over the
+ * file.
+ *
+ * Priorities follow forward decay (Cormode et al. 2009, see
+ * 'weighted_reservoir') with the landmark fixed at the start of the
+ * stream: the data point with grand index 't' has weight
+ * '(t + 1)^alpha' and priority 'weight / u', with 'u' uniform in
+ * (0, 1). Unlike 'weighted_reservoir', which moves the landmark to
+ * the oldest data point in the reservoir on every call, the priority
+ * of a data point never changes once it is drawn, hence it can be
+ * kept in memory as a single float, 'alpha * log(t + 1) - log(u)',
+ * and existing slots never need to be revisited.
+ *
+ * Capacity is limited to 2^32 - 1.
+ */
+class ooc_weighted_reservoir
+{
+    public:
+        ooc_weighted_reservoir();
+
+        ~ooc_weighted_reservoir();
+
+        ooc_weighted_reservoir(ooc_weighted_reservoir const &) = delete;
+        ooc_weighted_reservoir & operator=(ooc_weighted_reservoir const &) = delete;
+
+
+        // Create a new store file 'file_name' (truncating an existing
+        // one) for a reservoir of the specified capacity and alpha,
+        // with 'payload_bytes' bytes of user data per data point
+        // ('payload_bytes' may be 0).
+        // Return 0 on success, -1 on failure ('errno' is set).
+        int create(
+                char const * file_name,
+                size_t cap,
+                double alph,
+                size_t payload_bytes);
+
+        // Open a store file previously created by 'create', and
+        // rebuild the in-memory index from it.
+        // Return 0 on success, -1 on failure; a header that does not
+        // fit the file's length, or a capacity beyond 32-bit slots,
+        // fails with 'errno' set to 'EINVAL'.
+        int open(char const * file_name);
+
+        // Write everything to disk and release the file.
+        // Also called by the destructor.
+        int close();
+
+        // Write modified pages to disk.
+        int flush();
+
+        bool is_open() const;
+
+        double alpha() const;
+
+        size_t capacity() const;
+
+        size_t payload_bytes() const;
+
+        size_t size() const;
+
+        max_size_t grand_total() const;
+
+
+        void keep_n_write(
+                size_t n_provided,
+                void const * payload
+                    // 'n_provided * payload_bytes()' bytes of payload
+                    // for the new data points, consecutively;
+                    // may be 'nullptr' if 'payload_bytes()' is 0.
+                );
+
+        // Use the following functions after 'keep_n_write'.
+        size_t n_written() const;
+        size_t const * idx_written() const;
+            // The first 'n_written()' entries are indices of the
+            // provided new data points, 0 based, that have been
+            // written into the reservoir; they appear in increasing
+            // order of the slots they were written to.
+        uint32_t const * slot_written() const;
+            // The first 'n_written()' entries are the slots that were
+            // written, in increasing order, corresponding to the
+            // entries of 'idx_written()'.
+            // A slot that is smaller than the size of the reservoir
+            // before the call has had its previous data point evicted.
+
+
+        max_size_t const * idx_current() const;
+            // The first 'size()' entries are the grand indices of the
+            // data points in the reservoir. This array is in the
+            // mapped file.
+
+        void const * payload(size_t slot) const;
+            // Payload of the data point in 'slot'; in the mapped file.
+
+    private:
+        struct header_t;
+
+        struct heap_entry
+        {
+            float key;
+            uint32_t slot;
+        };
+
+        int _fd = -1;
+        void * _map = nullptr;
+        size_t _map_bytes = 0;
+
+        header_t * _header = nullptr;
+        max_size_t * _chosen_times = nullptr;
+        double * _chosen_u = nullptr;
+        char * _payload = nullptr;
+
+        std::vector<heap_entry> _heap;
+            // Min-heap by 'key' over all occupied slots.
+
+        std::vector<size_t> _idx_written;
+        std::vector<uint32_t> _slot_written;
+
+        int map_file(char const * file_name, int flags, size_t bytes);
+        void locate_arrays();
+        void sift_down(size_t i);
+};
+
+
+
+#endif  // OOC_RESERVOIR_H
@@ -1,22 +1,117 @@
 #include "reservoir.h"
+#include "reservoir_core.h"
 
 #include "hdf5.h"
 #include "hdf5_hl.h"
 #include "hdf5util.h"
 
 #include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <chrono>
+#include <limits>
 #include <memory>
+#include <mutex>
+#include <new>
+#include <numeric>
 #include <random>
+#include <thread>
 #include <tuple>
 
+#include <sys/mman.h>
+#include <unistd.h>
+
+
+
+// Instrumentation for 'reservoir_stats'.
+// Without 'RESERVOIR_STATS' the macros expand to nothing, including
+// their arguments, so the hot path carries no trace of them.
+
+#ifdef RESERVOIR_STATS
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+static inline max_size_t stats_ticks()
+{
+    return __rdtsc();
+}
+#else
+#include <chrono>
+static inline max_size_t stats_ticks()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+#endif
+
+#define STATS_TICK(t) const max_size_t t = stats_ticks()
+#define STATS_ADD(stats, field, v) ((stats).field += (v))
+
+#else
+
+#define STATS_TICK(t)
+#define STATS_ADD(stats, field, v)
+
+#endif  // RESERVOIR_STATS
+
 
 
 /// Simple functions
 
+static inline uint64_t splitmix64(uint64_t x)
+{
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+
+
+// The last global seed, and a count of 'global_seed' calls by which a
+// thread notices that its engine is stale.
+static std::atomic<unsigned int> global_seed_value{
+        unsigned(std::default_random_engine::default_seed)};
+static std::atomic<unsigned int> global_seed_generation{0};
+static std::atomic<unsigned int> global_next_thread_index{0};
+
+struct thread_urng
+{
+    std::default_random_engine engine{};
+    unsigned int index = global_next_thread_index.fetch_add(1);
+    unsigned int generation = 0;
+    bool seeded = false;
+};
+
+static thread_urng & this_thread_urng()
+{
+    static thread_local thread_urng t{};
+    return t;
+}
+
+
+
+unsigned int thread_seed(unsigned int s, unsigned int thread_index)
+{
+    if (thread_index == 0)
+        return s;
+    return unsigned(splitmix64((uint64_t(s) << 32) | thread_index) >> 32);
+}
+
+
+
+
 std::default_random_engine & global_urng()
 {
-    static std::default_random_engine u{};
-    return u;
+    auto & t = this_thread_urng();
+    unsigned int g = global_seed_generation.load(std::memory_order_acquire);
+    if (!t.seeded || t.generation != g)
+    {
+        t.engine.seed(thread_seed(global_seed_value.load(std::memory_order_relaxed), t.index));
+        t.generation = g;
+        t.seeded = true;
+    }
+    return t.engine;
 }
 
 
@@ -24,7 +119,20 @@ std::default_random_engine & global_urng()
 
 void global_seed(unsigned int s)
 {
-    global_urng().seed(s);
+    global_seed_value.store(s, std::memory_order_relaxed);
+    global_seed_generation.fetch_add(1, std::memory_order_release);
+    global_urng();
+}
+
+
+
+
+void global_seed_thread(unsigned int thread_index)
+{
+    auto & t = this_thread_urng();
+    t.index = thread_index;
+    t.seeded = false;
+    global_urng();
 }
 
 
@@ -34,7 +142,12 @@ void global_seed(unsigned int s)
 unsigned int global_randomize()
 {
     static std::random_device rd{};
-    auto s = rd();
+    static std::mutex m{};
+    unsigned int s;
+    {
+        std::lock_guard<std::mutex> lock(m);
+        s = rd();
+    }
     global_seed(s);
     return s;
 }
@@ -52,9 +165,8 @@ unsigned int global_randomise()
 
 int pick_a_number(int from, int thru)
 {
-    static std::uniform_int_distribution<int> d{};
-    using param_t = decltype(d)::param_type;
-    return d( global_urng(), param_t{from, thru} );
+    std::uniform_int_distribution<int> d{from, thru};
+    return d(global_urng());
 }
 
 
@@ -62,226 +174,293 @@ int pick_a_number(int from, int thru)
 
 double pick_a_number(double from, double upto)
 {
-    static std::uniform_real_distribution<double> d{};
-    using param_t = decltype(d)::param_type;
-    return d( global_urng(), param_t{from, upto} );
+    std::uniform_real_distribution<double> d{from, upto};
+    return d(global_urng());
 }
 
 
 
 
-//////////// functions for weighted_reservoir   ////////////////
+// The start of a splitmix64 sequence, from two results of the global
+// URNG, which have 31 or 32 random bits each.
+static uint64_t global_bits64()
+{
+    auto & urng = global_urng();
+    uint64_t x = uint64_t(urng()) << 32;
+    x ^= urng();
+    return splitmix64(x);
+}
 
-using qquad_t = std::tuple<size_t, max_size_t, double, double>;
-        // < index, time, u, priority >
 
 
-weighted_reservoir::weighted_reservoir()
+
+void pick_numbers(int * out, const size_t n, const int from, const int thru)
 {
+    assert(from <= thru);
+    const uint64_t base = global_bits64();
+    const uint64_t range = uint64_t(int64_t(thru) - int64_t(from)) + 1;
+        // At most 2^32.
+    for (size_t i = 0; i < n; ++i)
+    {
+        uint64_t x = splitmix64(base + i * 0x9e3779b97f4a7c15ULL);
+        out[i] = int(int64_t(from) + int64_t(((x >> 32) * range) >> 32));
+    }
 }
 
 
-weighted_reservoir::weighted_reservoir(
-        const size_t cap,
-        const double alph)
+
+
+void pick_numbers(double * out, const size_t n, const double from, const double upto)
 {
-    assert(alph >= 0.);
-    assert(cap > 0);
-    _alpha = alph;
-    _capacity = cap;
-    _chosen_times = std::unique_ptr<max_size_t[]>{new max_size_t[cap]()};
-    _chosen_u = std::unique_ptr<double[]>{new double[cap]()};
-        // The trailing '()' default-initializes the allocated memory;
-        // otherwise 'valgrind' can give very puzzling memory error
-        // messages related to 'export_to_file'.
-        // These initializations also make the values upon export to and
-        // import from disk files definite, which is a good thing.
-    _idx_kept_or_removed = std::unique_ptr<size_t[]>{new size_t[cap]};
-    _idx_appended_or_injected = std::unique_ptr<size_t[]>{new size_t[cap]};
-        // The two above are not written out to files, hence
-        // 'valgrind' won't complain about them.
+    assert(from < upto);
+    const uint64_t base = global_bits64();
+    const double scale = (upto - from) / 9007199254740992.;
+        // 2^53
+    for (size_t i = 0; i < n; ++i)
+    {
+        uint64_t x = splitmix64(base + i * 0x9e3779b97f4a7c15ULL);
+        out[i] = from + (double(x >> 11) + 0.5) * scale;
+    }
 }
 
 
 
 
-// 'clear' empties the reservoir but does not change its
-// '_alpha' and '_capacity' settings; neither does it free the allocated
-// spaces for the internal arrays---note that the sizes of
-// these spaces should stay consistent with '_capacity'.
-void weighted_reservoir::clear()
-{
-    _current_size = 0;
-    _grand_total = 0;
-    _ref_L = 0;
-    _kept_or_removed = 0;
-    _n_kept_or_removed = 0;
-    _n_appended_or_injected = 0;
-}
+//////////// memory resources   ////////////////
 
 
+class new_delete_resource : public reservoir_memory_resource
+{
+    public:
+        void * allocate(size_t bytes, size_t alignment)
+        {
+            assert(alignment <= alignof(std::max_align_t));
+            return ::operator new(bytes);
+        }
+
+        void deallocate(void * p, size_t, size_t)
+        {
+            ::operator delete(p);
+        }
+};
 
 
-bool weighted_reservoir::empty() const
+reservoir_memory_resource * default_reservoir_resource()
 {
-    return
-        _current_size == 0 &&
-        _grand_total == 0 &&
-        _ref_L == 0;
+    static new_delete_resource r{};
+    return &r;
 }
 
 
 
+class hugepage_resource : public reservoir_memory_resource
+{
+    public:
+        static const size_t huge_page = size_t(2) << 20;
+
+        void * allocate(size_t bytes, size_t alignment)
+        {
+            size_t len = this->mapped_bytes(bytes);
+            assert(alignment <= huge_page);
+            void * m = ::mmap(nullptr, len + huge_page, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (m == MAP_FAILED)
+                throw std::bad_alloc{};
+            // 'mmap' aligns to a page only; map a huge page more and
+            // unmap the slack on either side of an aligned region, so
+            // that the region can be backed by huge pages at all.
+            char * p = reinterpret_cast<char *>(
+                    (reinterpret_cast<uintptr_t>(m) + huge_page - 1) & ~uintptr_t(huge_page - 1));
+            const size_t head = p - static_cast<char *>(m);
+            if (head > 0)
+                ::munmap(m, head);
+            if (head < huge_page)
+                ::munmap(p + len, huge_page - head);
+#ifdef MADV_HUGEPAGE
+            ::madvise(p, len, MADV_HUGEPAGE);
+                // Advisory; failure just leaves normal pages.
+#endif
+            // Fault the pages in now rather than in the sampling loop.
+            const size_t page = ::sysconf(_SC_PAGESIZE);
+            volatile char * c = static_cast<char *>(p);
+            for (size_t i = 0; i < len; i += page)
+                c[i] = 0;
+            return p;
+        }
+
+        void deallocate(void * p, size_t bytes, size_t)
+        {
+            ::munmap(p, this->mapped_bytes(bytes));
+        }
+
+    private:
+        static size_t mapped_bytes(size_t bytes)
+        {
+            return (std::max<size_t>(bytes, 1) + huge_page - 1) / huge_page * huge_page;
+        }
+};
+
 
-double weighted_reservoir::alpha() const
+reservoir_memory_resource * hugepage_reservoir_resource()
 {
-    return _alpha;
+    static hugepage_resource r{};
+    return &r;
 }
 
 
 
-
-size_t weighted_reservoir::capacity() const
+// Allocate 'n' value-initialized elements from 'resource'.
+template<typename T>
+reservoir_array<T> allocate_array(reservoir_memory_resource * resource, size_t n)
 {
-    return _capacity;
+    reservoir_array_deleter d;
+    d.resource = resource;
+    d.bytes = n * sizeof(T);
+    d.alignment = alignof(T);
+    T * p = static_cast<T *>(resource->allocate(d.bytes, d.alignment));
+    for (size_t i = 0; i < n; ++i)
+        new (p + i) T();
+    return reservoir_array<T>{p, d};
 }
 
 
 
 
+//////////// functions for weighted_reservoir   ////////////////
+
+using qquad_t = reservoir_candidate<size_t, max_size_t, double>;
+        // < index, time, u, priority >
+
 
-size_t weighted_reservoir::size() const
+weighted_reservoir::weighted_reservoir()
 {
-    return _current_size;
 }
 
 
-
-max_size_t weighted_reservoir::grand_total() const
+weighted_reservoir::weighted_reservoir(
+        reservoir_memory_resource * resource,
+        reservoir_memory_resource * workspace_resource)
 {
-    return _grand_total;
+    assert(resource != nullptr);
+    _resource = resource;
+    _workspace_resource = workspace_resource ? workspace_resource : resource;
 }
 
 
+weighted_reservoir::weighted_reservoir(
+        const size_t cap,
+        const double alph,
+        reservoir_memory_resource * resource,
+        reservoir_memory_resource * workspace_resource)
+{
+    assert(alph >= 0.);
+    assert(cap > 0);
+    _alpha = alph;
+    _capacity = cap;
+    if (resource != nullptr)
+        _resource = resource;
+    _workspace_resource = workspace_resource ? workspace_resource : _resource;
+
+    _chosen_times = allocate_array<max_size_t>(_resource, cap);
+    _chosen_u = allocate_array<double>(_resource, cap);
+        // 'allocate_array' zero-initializes the memory;
+        // otherwise 'valgrind' can give very puzzling memory error
+        // messages related to 'export_to_file'.
+        // These initializations also make the values upon export to and
+        // import from disk files definite, which is a good thing.
+    _idx_kept_or_removed = allocate_array<size_t>(_resource, cap);
+    _idx_appended_or_injected = allocate_array<size_t>(_resource, cap);
+    _moves = allocate_array<reservoir_move>(_workspace_resource, cap);
+        // Derived from the index views, hence, like the workspace,
+        // not part of the state.
+
+    STATS_ADD(_stats, n_allocations, 5);
+    STATS_ADD(_stats, bytes_allocated,
+            cap * (sizeof(max_size_t) + sizeof(double) + 2 * sizeof(size_t) + sizeof(reservoir_move)));
+}
 
 
 
 
-// Add new data points to the reservoir with bookkeeping
-// for the new data points; no sampling is involved b/c
-// the new total does not exceed the reservoir's capacity.
-void direct_inject(
-        max_size_t * const chosen_times,
-        double * const chosen_u,
-        size_t current_size,
-        max_size_t grand_total,
-        const size_t n_provided
-        )
+// 'clear' empties the reservoir but does not change its
+// '_alpha' and '_capacity' settings; neither does it free the allocated
+// spaces for the internal arrays---note that the sizes of
+// these spaces should stay consistent with '_capacity'.
+void weighted_reservoir::clear()
 {
-    std::uniform_real_distribution<double> urd{0.0, 1.0};
-    auto urng = global_urng();
-
-    for (size_t i = 0; i < n_provided; ++i)
-    {
-        chosen_times[current_size] = grand_total;
-            // The first one gets index '0'.
-        chosen_u[current_size] = urd(urng);
-        ++current_size;
-        ++grand_total;
-    }
+    _current_size = 0;
+    _grand_total = 0;
+    _ref_L = 0;
+    _kept_or_removed = 0;
+    _n_kept_or_removed = 0;
+    _n_appended_or_injected = 0;
+    _n_relocations = 0;
+    _n_insertions = 0;
+    _threshold = 0.;
+    _batch_remaining = 0;
+    _batch_done = 0;
+    if (_slot_index != nullptr)
+        this->build_slot_index();
+    if (_weights != nullptr)
+        this->build_weights();
 }
 
 
 
 
-// Added new data to the reservoir with sampling, b/c
-// the current size plus new data exceeds the reservoir's capacity.
-// Upon return, the workspace 'quad' contains most useful info to be
-// used for further processing.
-// The reservoir's state is barely changed within this function;
-// changes will be made after returning from this function.
-void sample_inject(
-        max_size_t const * const chosen_times,
-        double const * const chosen_u,
-        const size_t current_size,
-        const max_size_t grand_total,
-        const size_t n_provided,
-        const size_t capacity,
-        const double alpha,
-        max_size_t & _ref_L,
-        qquad_t * const quad,
-            // Pre-allocated workspace, size should be at least
-            //   current_size + n_provided
-            // Upon return, its content is used for subsequent
-            // processing.
-        const size_t quad_len
-        )
+// Where 'sample_inject' spends its time, for 'reservoir_stats'.
+#ifdef RESERVOIR_STATS
+
+namespace {
+
+struct stats_probe
 {
-    assert(quad_len > capacity);
+    reservoir_stats & stats;
+    max_size_t t = 0;
 
-    std::uniform_real_distribution<double> urd{0.0, 1.0};
-    auto urng = global_urng();
+    explicit stats_probe(reservoir_stats & s) : stats(s) {}
 
-    if (current_size  > 0)
+    void ref_L(bool moved)
     {
-        _ref_L = *std::min_element(chosen_times, chosen_times + current_size);
+        stats.n_ref_L_moves += moved;
     }
 
-    double factor = 1.0 / (grand_total - _ref_L + n_provided);
+    void mark()
+    {
+        t = stats_ticks();
+    }
 
-    for (size_t i = 0; i < current_size; ++i)
+    void keys()
     {
-        quad[i] = std::make_tuple(
-                i,     // Index in existing data.
-                chosen_times[i],  // Grand index in entire history.
-                chosen_u[i],
-                std::pow((chosen_times[i] - _ref_L) * factor, alpha) / chosen_u[i]
-                );
-            // FIXME: if _ref_L has not changed recently,
-            // some speed improvement is possible here, b/c the pow does
-            // not change except for a scaling.
+        max_size_t now = stats_ticks();
+        stats.ticks_keys += now - t;
+        t = now;
     }
 
+    void select()
+    {
+        max_size_t now = stats_ticks();
+        stats.ticks_select += now - t;
+        t = now;
+    }
+};
 
-    max_size_t idx_grand = grand_total;
-    max_size_t ref_diff = idx_grand - _ref_L;
-    size_t idx_0 = current_size;
-    size_t idx_new = 0;
+}  // namespace
 
-    while (idx_new < n_provided)
-    {
-        size_t idx = idx_0;
-        while (idx < quad_len)
-        {
-            auto u = urd(urng);
-            quad[idx] = std::make_tuple(
-                    idx_new,
-                    idx_grand,
-                    u,
-                    std::pow(ref_diff * factor, alpha) / u
-                    );
-            ++idx;
-            ++idx_new;
-            if (idx_new == n_provided)
-                break;
-            ++idx_grand;
-            ++ref_diff;
-        }
+static inline stats_probe sample_probe(reservoir_stats & stats)
+{
+    return stats_probe(stats);
+}
 
-        // Place the 'capacity' number of elements with the largest 'pow/u'
-        // value at the front; these are the elements to stay in the
-        // reservoir.
-        std::nth_element(
-                quad,
-                quad + capacity,
-                quad + idx,
-                [](qquad_t const & x, qquad_t const & y)
-                {  return std::get<3>(x) > std::get<3>(y); });
+#else
 
-        idx_0 = capacity;
-    }
+static inline reservoir_no_probe sample_probe(reservoir_stats &)
+{
+    return reservoir_no_probe();
 }
 
+#endif  // RESERVOIR_STATS
+
 
 
 // if (current_size + n_provided <= capacity)
@@ -330,42 +509,68 @@ void sample_inject(
 
 
 void weighted_reservoir::keep_n_append(
-        const size_t n_provided
+        const size_t n_provided,
+        double const * const u
         )
 {
     assert(n_provided > 0);
     assert(_grand_total + n_provided > _grand_total);
         // Guard against overfow of 'max_size_t'.
 
+    STATS_ADD(_stats, n_calls, 1);
+    STATS_ADD(_stats, n_offered, n_provided);
+
     if (_current_size + n_provided <= _capacity)
     {
-        direct_inject(
+        if (_threshold > 0.)
+            this->update_threshold(_ref_L, n_provided, 0.);
+                // To the scale of this call's keys.
+
+        const size_t n_admitted = direct_inject(
                 _chosen_times.get(), _chosen_u.get(),
                 _current_size, _grand_total,
-                n_provided);
+                n_provided, _alpha, _ref_L, _threshold,
+                _idx_appended_or_injected.get(), u, global_urng());
 
         _n_kept_or_removed = _current_size;
             // Number kept.
         std::iota(_idx_kept_or_removed.get(), _idx_kept_or_removed.get() + _current_size, 0);
 
-        _n_appended_or_injected = n_provided;
+        _n_appended_or_injected = n_admitted;
             // Number appended.
-        std::iota(_idx_appended_or_injected.get(), _idx_appended_or_injected.get() + n_provided, 0);
+
+        _n_relocations = 0;
+        _n_insertions = n_admitted;
+        for (size_t i = 0; i < n_admitted; ++i)
+        {
+            _moves[i] = reservoir_move{_idx_appended_or_injected[i], _current_size + i};
+        }
 
         _kept_or_removed = 1;
             // keep_n_append
 
-        _current_size += n_provided;
+        STATS_ADD(_stats, n_accepted, n_admitted);
+
+        if (_slot_index != nullptr)
+            this->update_slot_index(_current_size, _grand_total);
+
+        _current_size += n_admitted;
         _grand_total += n_provided;
+
+        if (_weights != nullptr)
+            this->update_weights(_ref_L, _grand_total - n_provided);
         return;
     }
 
 
     size_t buffer_size = std::min(_current_size + n_provided, _capacity + _capacity + _capacity);
-    std::unique_ptr<qquad_t[]> buffer{new qquad_t[buffer_size]};
-    auto workspace = buffer.get();
+    auto workspace = this->workspace();
 
-    sample_inject(
+    STATS_ADD(_stats, n_sampled_calls, 1);
+
+    const max_size_t old_ref_L = _ref_L;
+
+    const size_t n_chosen = sample_inject(
             _chosen_times.get(),
             _chosen_u.get(),
             _current_size,
@@ -375,20 +580,54 @@ void weighted_reservoir::keep_n_append(
             _alpha,
             _ref_L,   // by reference
             workspace,
-            buffer_size);
+            buffer_size,
+            _threshold,  // by reference
+            u,
+            global_urng(),
+            sample_probe(_stats));
 
+    STATS_TICK(t_bookkeeping);
 
-    size_t nn;
+    if (_slot_index != nullptr)
+    {
+        std::copy_n(_chosen_times.get(), _current_size, _slot_index_times.get());
+            // '_chosen_times' is rearranged below; 'update_slot_index'
+            // needs the old one to find evicted and relocated data
+            // points.
+    }
 
-    nn = 0;
-    for (size_t i = 0; i < _capacity; ++i)
+
+    std::fill_n(_chosen_times.get(), _current_size, _grand_total);
+        // As in 'remove_n_inject', after the following block elements
+        // of '_chosen_times' with value '_grand_total' are the
+        // pre-existing data points not kept.
+    for (size_t i = 0; i < n_chosen; ++i)
     {
         auto k = std::get<1>(workspace[i]);
         if (k < _grand_total)
         {
-            _chosen_times[nn] = k;
-            _chosen_u[nn] = std::get<2>(workspace[i]);
-            _idx_kept_or_removed[nn] = std::get<0>(workspace[i]);
+            _chosen_times[std::get<0>(workspace[i])] = k;
+        }
+    }
+
+    // Compact the kept data points to the front in increasing order of
+    // their old locations, so that moving them along in place is safe
+    // (see 'move_plan').
+    size_t nn;
+
+    nn = 0;
+    _n_relocations = 0;
+    for (size_t i = 0; i < _current_size; ++i)
+    {
+        if (_chosen_times[i] < _grand_total)
+        {
+            if (nn != i)
+            {
+                _chosen_times[nn] = _chosen_times[i];
+                _chosen_u[nn] = _chosen_u[i];
+                _moves[_n_relocations++] = reservoir_move{i, nn};
+            }
+            _idx_kept_or_removed[nn] = i;
             ++nn;
         }
     }
@@ -396,7 +635,7 @@ void weighted_reservoir::keep_n_append(
         // Number kept.
 
     nn = 0;
-    for (size_t i = 0, j = _n_kept_or_removed; i < _capacity; ++i)
+    for (size_t i = 0, j = _n_kept_or_removed; i < n_chosen; ++i)
     {
         auto k = std::get<1>(workspace[i]);
         if (k >= _grand_total)
@@ -404,18 +643,30 @@ void weighted_reservoir::keep_n_append(
             _chosen_times[j] = k;
             _chosen_u[j] = std::get<2>(workspace[i]);
             _idx_appended_or_injected[nn] = std::get<0>(workspace[i]);
+            _moves[_n_relocations + nn] = reservoir_move{std::get<0>(workspace[i]), j};
             ++nn;
             ++j;
         }
     }
     _n_appended_or_injected = nn;
         // Number appended.
+    _n_insertions = nn;
 
     _kept_or_removed = 1;
         // keep_n_append
 
-    _current_size = _capacity;
+    STATS_ADD(_stats, n_accepted, _n_appended_or_injected);
+    STATS_ADD(_stats, n_evicted, _current_size - _n_kept_or_removed);
+    STATS_ADD(_stats, ticks_bookkeeping, stats_ticks() - t_bookkeeping);
+
+    if (_slot_index != nullptr)
+        this->update_slot_index(_current_size, _grand_total);
+
+    _current_size = n_chosen;
     _grand_total += n_provided;
+
+    if (_weights != nullptr)
+        this->update_weights(old_ref_L, _grand_total - n_provided);
 }
 
 
@@ -423,42 +674,68 @@ void weighted_reservoir::keep_n_append(
 
 
 void weighted_reservoir::remove_n_inject(
-        const size_t n_provided
+        const size_t n_provided,
+        double const * const u
         )
 {
     assert(n_provided > 0);
     assert(_grand_total + n_provided > _grand_total);
         // Guard against overfow of 'max_size_t'.
 
+    STATS_ADD(_stats, n_calls, 1);
+    STATS_ADD(_stats, n_offered, n_provided);
+
     if (_current_size + n_provided <= _capacity)
     {
-        direct_inject(
+        if (_threshold > 0.)
+            this->update_threshold(_ref_L, n_provided, 0.);
+                // To the scale of this call's keys.
+
+        const size_t n_admitted = direct_inject(
                 _chosen_times.get(), _chosen_u.get(),
                 _current_size, _grand_total,
-                n_provided);
+                n_provided, _alpha, _ref_L, _threshold,
+                _idx_appended_or_injected.get(), u, global_urng());
 
         _n_kept_or_removed = 0;
             // Number removed.
 
-        _n_appended_or_injected = n_provided;
+        _n_appended_or_injected = n_admitted;
             // Number injected.
-        std::iota(_idx_appended_or_injected.get(), _idx_appended_or_injected.get() + _n_appended_or_injected, 0);
+
+        _n_relocations = 0;
+        _n_insertions = n_admitted;
+        for (size_t i = 0; i < n_admitted; ++i)
+        {
+            _moves[i] = reservoir_move{_idx_appended_or_injected[i], _current_size + i};
+        }
 
         _kept_or_removed = 2;
             // remove_n_inject
 
-        _current_size += n_provided;
+        STATS_ADD(_stats, n_accepted, n_admitted);
+
+        if (_slot_index != nullptr)
+            this->update_slot_index(_current_size, _grand_total);
+
+        _current_size += n_admitted;
         _grand_total += n_provided;
 
+        if (_weights != nullptr)
+            this->update_weights(_ref_L, _grand_total - n_provided);
+
         return;
     }
 
 
     size_t buffer_size = std::min(_current_size + n_provided, _capacity + _capacity + _capacity);
-    std::unique_ptr<qquad_t[]> buffer{new qquad_t[buffer_size]};
-    auto workspace = buffer.get();
+    auto workspace = this->workspace();
 
-    sample_inject(
+    STATS_ADD(_stats, n_sampled_calls, 1);
+
+    const max_size_t old_ref_L = _ref_L;
+
+    const size_t n_chosen = sample_inject(
             _chosen_times.get(),
             _chosen_u.get(),
             _current_size,
@@ -468,7 +745,21 @@ void weighted_reservoir::remove_n_inject(
             _alpha,
             _ref_L,  // by reference
             workspace,
-            buffer_size);
+            buffer_size,
+            _threshold,  // by reference
+            u,
+            global_urng(),
+            sample_probe(_stats));
+
+    STATS_TICK(t_bookkeeping);
+
+    if (_slot_index != nullptr)
+    {
+        std::copy_n(_chosen_times.get(), _current_size, _slot_index_times.get());
+            // '_chosen_times' is rearranged below; 'update_slot_index'
+            // needs the old one to find evicted and relocated data
+            // points.
+    }
 
 
     std::fill_n(_chosen_times.get(), _capacity, _grand_total);
@@ -483,7 +774,7 @@ void weighted_reservoir::remove_n_inject(
 
     nn = _current_size;
         // Number removed.
-    for (size_t i = 0; i < _capacity; ++i)
+    for (size_t i = 0; i < n_chosen; ++i)
     {
         auto k = std::get<1>(workspace[i]);
         if (k < _grand_total)
@@ -519,13 +810,14 @@ void weighted_reservoir::remove_n_inject(
         _chosen_times[_idx_kept_or_removed[j]] = std::get<1>(workspace[i]);
         _chosen_u[_idx_kept_or_removed[j]] = std::get<2>(workspace[i]);
         _idx_appended_or_injected[nn] = std::get<0>(workspace[i]);
+        _moves[nn] = reservoir_move{std::get<0>(workspace[i]), _idx_kept_or_removed[j]};
         ++nn;
         ++j;
         ++i;
     }
 
     j = _current_size;
-    while (i < _capacity)
+    while (i < n_chosen)
     {
         auto k = std::get<1>(workspace[i]);
         if (k >= _grand_total)
@@ -533,6 +825,7 @@ void weighted_reservoir::remove_n_inject(
             _chosen_times[j] = k;
             _chosen_u[j] = std::get<2>(workspace[i]);
             _idx_appended_or_injected[nn] = std::get<0>(workspace[i]);
+            _moves[nn] = reservoir_move{std::get<0>(workspace[i]), j};
             ++nn;
             ++j;
         }
@@ -540,115 +833,937 @@ void weighted_reservoir::remove_n_inject(
     }
 
     _n_appended_or_injected = nn;
+    _n_relocations = 0;
+    _n_insertions = nn;
 
 
     _kept_or_removed = 2;
         // remove_n_inject
 
-    _current_size = _capacity;
-    _grand_total += n_provided;
-}
-
-
+    STATS_ADD(_stats, n_accepted, _n_appended_or_injected);
+    STATS_ADD(_stats, n_evicted, _n_kept_or_removed);
+    STATS_ADD(_stats, ticks_bookkeeping, stats_ticks() - t_bookkeeping);
 
+    if (_slot_index != nullptr)
+        this->update_slot_index(_current_size, _grand_total);
 
+    _current_size = n_chosen;
+    _grand_total += n_provided;
 
-size_t weighted_reservoir::n_kept() const
-{
-    if (_kept_or_removed == 1)
-        return _n_kept_or_removed;
-    else
-        return 0;
+    if (_weights != nullptr)
+        this->update_weights(old_ref_L, _grand_total - n_provided);
 }
 
 
 
 
-size_t const * weighted_reservoir::idx_kept() const
+
+// The workspace of the sampling calls, of '3 * capacity' entries.
+// Allocated by the first call after a change of capacity and kept, so
+// that a call neither allocates nor, from a resource like the huge
+// page one, maps and faults in memory.
+qquad_t * weighted_reservoir::workspace()
 {
-    if (_kept_or_removed == 1)
-        return _idx_kept_or_removed.get();
-    else
-        return nullptr;
+    const size_t n = 3 * _capacity;
+    if (_workspace_len != n)
+    {
+        _workspace.reset(nullptr);
+        _workspace = allocate_array<qquad_t>(_workspace_resource, n);
+        _workspace_len = n;
+
+        STATS_ADD(_stats, n_allocations, 1);
+        STATS_ADD(_stats, bytes_allocated, n * sizeof(qquad_t));
+    }
+    return _workspace.get();
 }
 
 
 
 
-size_t weighted_reservoir::n_appended() const
+// Move the per-slot arrays into new ones of 'cap' entries, keeping
+// what is in use: the data points in the reservoir, the keep view,
+// and the relocations of the move plan. All of these must fit.
+void weighted_reservoir::reallocate(size_t cap)
 {
-    if (_kept_or_removed == 1)
-        return _n_appended_or_injected;
-    else
-        return 0;
-}
+    assert(_current_size <= cap && _n_kept_or_removed <= cap);
+    assert(_n_appended_or_injected == 0 && _n_relocations + _n_insertions <= cap);
 
+    auto times = allocate_array<max_size_t>(_resource, cap);
+    std::copy_n(_chosen_times.get(), _current_size, times.get());
+    _chosen_times = std::move(times);
 
+    auto us = allocate_array<double>(_resource, cap);
+    std::copy_n(_chosen_u.get(), _current_size, us.get());
+    _chosen_u = std::move(us);
 
+    auto kept = allocate_array<size_t>(_resource, cap);
+    std::copy_n(_idx_kept_or_removed.get(), _n_kept_or_removed, kept.get());
+    _idx_kept_or_removed = std::move(kept);
 
-size_t const * weighted_reservoir::idx_appended() const
-{
-    if (_kept_or_removed == 1)
-        return _idx_appended_or_injected.get();
-    else
-        return nullptr;
-}
-
+    _idx_appended_or_injected = allocate_array<size_t>(_resource, cap);
 
+    auto moves = allocate_array<reservoir_move>(_workspace_resource, cap);
+    std::copy_n(_moves.get(), _n_relocations, moves.get());
+    _moves = std::move(moves);
 
+    STATS_ADD(_stats, n_allocations, 5);
+    STATS_ADD(_stats, bytes_allocated,
+            cap * (sizeof(max_size_t) + sizeof(double) + 2 * sizeof(size_t) + sizeof(reservoir_move)));
 
+    _capacity = cap;
 
-size_t weighted_reservoir::n_removed() const
-{
-    if (_kept_or_removed == 2)
-        return _n_kept_or_removed;
-    else
-        return 0;
+    if (_slot_index != nullptr)
+        this->enable_slot_index(true);
+    if (_weights != nullptr)
+    {
+        _weights = allocate_array<double>(_workspace_resource, cap);
+        this->build_weights();
+    }
 }
 
 
 
 
-size_t const * weighted_reservoir::idx_removed() const
+bool weighted_reservoir::shrink_to(const size_t cap)
 {
-    if (_kept_or_removed == 2)
-        return _idx_kept_or_removed.get();
-    else
-        return nullptr;
-}
+    assert(cap > 0 && cap <= _capacity);
 
+    if (!_resource->resizable())
+        return false;
 
+    _n_appended_or_injected = 0;
+    _n_insertions = 0;
+    _kept_or_removed = 1;
+        // keep_n_append
 
+    if (_current_size <= cap)
+    {
+        _n_kept_or_removed = _current_size;
+        std::iota(_idx_kept_or_removed.get(), _idx_kept_or_removed.get() + _current_size, 0);
+        _n_relocations = 0;
+        this->reallocate(cap);
+        return true;
+    }
 
-size_t weighted_reservoir::n_injected() const
-{
-    if (_kept_or_removed == 2)
-        return _n_appended_or_injected;
-    else
-        return 0;
-}
+    auto workspace = this->workspace();
 
+    // Keys as 'sample_inject' would compute them for a call with no new
+    // data points.
+    const max_size_t old_ref_L = _ref_L;
+    _ref_L = *std::min_element(_chosen_times.get(), _chosen_times.get() + _current_size);
+    STATS_ADD(_stats, n_ref_L_moves, _ref_L != old_ref_L);
+    const double factor = 1.0 / (_grand_total - _ref_L);
+    for (size_t i = 0; i < _current_size; ++i)
+    {
+        workspace[i] = std::make_tuple(
+                i,
+                _chosen_times[i],
+                _chosen_u[i],
+                std::pow((_chosen_times[i] - _ref_L) * factor, _alpha) / _chosen_u[i]);
+    }
+    std::nth_element(
+            workspace,
+            workspace + cap,
+            workspace + _current_size,
+            [](qquad_t const & x, qquad_t const & y)
+            {  return std::get<3>(x) > std::get<3>(y); });
 
+    this->update_threshold(old_ref_L, 0, std::get<3>(workspace[cap]));
 
+    // Compact the kept data points to the front in increasing order of
+    // their old locations, as in 'keep_n_append'.
+    std::fill_n(_chosen_times.get(), _current_size, _grand_total);
+    for (size_t i = 0; i < cap; ++i)
+    {
+        _chosen_times[std::get<0>(workspace[i])] = std::get<1>(workspace[i]);
+    }
+
+    size_t nn = 0;
+    _n_relocations = 0;
+    for (size_t i = 0; i < _current_size; ++i)
+    {
+        if (_chosen_times[i] < _grand_total)
+        {
+            if (nn != i)
+            {
+                _chosen_times[nn] = _chosen_times[i];
+                _chosen_u[nn] = _chosen_u[i];
+                _moves[_n_relocations++] = reservoir_move{i, nn};
+            }
+            _idx_kept_or_removed[nn] = i;
+            ++nn;
+        }
+    }
+    _n_kept_or_removed = nn;
+
+    STATS_ADD(_stats, n_evicted, _current_size - cap);
+
+    _current_size = cap;
+    this->reallocate(cap);
+    return true;
+}
+
+
+
+
+bool weighted_reservoir::grow_to(const size_t cap)
+{
+    assert(cap >= _capacity);
+
+    if (!_resource->resizable())
+        return false;
+
+    _n_kept_or_removed = _current_size;
+    std::iota(_idx_kept_or_removed.get(), _idx_kept_or_removed.get() + _current_size, 0);
+    _n_appended_or_injected = 0;
+    _n_relocations = 0;
+    _n_insertions = 0;
+    _kept_or_removed = 1;
+        // keep_n_append
+
+    this->reallocate(cap);
+    return true;
+}
+
+
+
+
+
+void weighted_reservoir::begin_batch(const size_t n_provided, const bool keep)
+{
+    assert(_batch_remaining == 0);
+    assert(n_provided > 0);
+    _batch_remaining = n_provided;
+    _batch_done = 0;
+    _batch_keep = keep;
+}
+
+
+
+bool weighted_reservoir::step(const size_t max_items)
+{
+    assert(_batch_remaining > 0);
+    assert(max_items > 0);
+
+    const size_t n = std::min(max_items, _batch_remaining);
+    if (_batch_keep)
+        this->keep_n_append(n);
+    else
+        this->remove_n_inject(n);
+
+    // Count the new data points from the start of the batch.
+    if (_batch_done > 0)
+    {
+        for (size_t i = 0; i < _n_appended_or_injected; ++i)
+        {
+            _idx_appended_or_injected[i] += _batch_done;
+        }
+        for (size_t j = _n_relocations; j < _n_relocations + _n_insertions; ++j)
+        {
+            _moves[j].src += _batch_done;
+        }
+    }
+
+    _batch_done += n;
+    _batch_remaining -= n;
+    return _batch_remaining == 0;
+}
+
+
+
+bool weighted_reservoir::step_for(const double seconds)
+{
+    assert(seconds > 0.);
+
+    size_t n = 3 * _capacity;
+    if (_batch_ns_per_item > 0.)
+        n = std::max(_capacity, size_t(seconds * 1e9 / _batch_ns_per_item));
+            // A step costs O(capacity) however few data points it
+            // takes; shorter steps would not spread that cost.
+
+    const size_t m = std::min(n, _batch_remaining);
+    auto t0 = std::chrono::steady_clock::now();
+    bool done = this->step(m);
+    auto t1 = std::chrono::steady_clock::now();
+
+    double ns = std::chrono::duration<double, std::nano>(t1 - t0).count();
+    _batch_ns_per_item = std::max(ns, 1.) / m;
+        // Includes the fixed cost of a call; step sizes settle where a
+        // whole step takes 'seconds'.
+    return done;
+}
+
+
+
+size_t weighted_reservoir::batch_remaining() const
+{
+    return _batch_remaining;
+}
+
+
+
+
+typedef reservoir_bulk_candidate<max_size_t, double> bulk_candidate;
+
+
+
+void weighted_reservoir::bulk_append(const size_t n_provided, unsigned n_threads)
+{
+    assert(this->empty());
+    assert(n_provided > 0);
+
+    if (n_threads == 0)
+        n_threads = std::max(1u, std::thread::hardware_concurrency());
+    if (n_provided <= _capacity)
+    {
+        this->keep_n_append(n_provided);
+        return;
+    }
+
+    STATS_ADD(_stats, n_calls, 1);
+    STATS_ADD(_stats, n_sampled_calls, 1);
+    STATS_ADD(_stats, n_offered, n_provided);
+
+    const unsigned seed = global_urng()();
+    const double factor = 1.0 / n_provided;
+    const size_t c_len = 2 * _capacity;
+    auto candidates = allocate_array<bulk_candidate>(
+            _workspace_resource, size_t(n_threads) * c_len);
+    bulk_candidate * const c = candidates.get();
+    STATS_ADD(_stats, n_allocations, 1);
+    STATS_ADD(_stats, bytes_allocated, size_t(n_threads) * c_len * sizeof(bulk_candidate));
+    std::vector<size_t> n_chosen(n_threads);
+    std::vector<double> rejected(n_threads, 0.);
+
+    auto work = [&](unsigned i)
+    {
+        std::default_random_engine urng{thread_seed(seed, i + 1)};
+            // Not 'seed' itself: an engine seeded by an output of
+            // 'global_urng()' may go on with that very stream.
+        max_size_t begin = max_size_t(n_provided) * i / n_threads;
+        max_size_t end = max_size_t(n_provided) * (i + 1) / n_threads;
+        n_chosen[i] = bulk_select(begin, end, factor, _alpha, _capacity,
+                urng, c + size_t(i) * c_len, c_len, rejected[i]);
+    };
+    std::vector<std::thread> pool;
+    for (unsigned i = 1; i < n_threads; ++i)
+        pool.emplace_back(work, i);
+    work(0);
+    for (auto & t : pool)
+        t.join();
+
+    // Gather the survivors of every share, and choose among them.
+    size_t m = 0;
+    double threshold = 0.;
+    for (unsigned i = 0; i < n_threads; ++i)
+    {
+        std::copy_n(c + size_t(i) * c_len, n_chosen[i], c + m);
+        m += n_chosen[i];
+        threshold = std::max(threshold, rejected[i]);
+    }
+    if (m > _capacity)
+    {
+        std::nth_element(c, c + _capacity, c + m,
+                [](bulk_candidate const & x, bulk_candidate const & y)
+                { return x.key > y.key; });
+        threshold = std::max(threshold, c[_capacity].key);
+        m = _capacity;
+    }
+    std::sort(c, c + m,
+            [](bulk_candidate const & x, bulk_candidate const & y) { return x.t < y.t; });
+
+    for (size_t i = 0; i < m; ++i)
+    {
+        _chosen_times[i] = c[i].t;
+        _chosen_u[i] = c[i].u;
+        _idx_appended_or_injected[i] = size_t(c[i].t);
+        _moves[i] = reservoir_move{size_t(c[i].t), i};
+    }
+    _threshold = threshold;
+    _kept_or_removed = 1;
+    _n_kept_or_removed = 0;
+    _n_appended_or_injected = m;
+    _n_relocations = 0;
+    _n_insertions = m;
+    _current_size = m;
+    _grand_total = n_provided;
+
+    STATS_ADD(_stats, n_accepted, m);
+
+    if (_slot_index != nullptr)
+        this->build_slot_index();
+    if (_weights != nullptr)
+        this->build_weights();
+}
+
+
+
+bool weighted_reservoir::retract(const max_size_t grand_index)
+{
+    return this->retract(1, &grand_index) == 1;
+}
+
+
+
+size_t weighted_reservoir::retract(const size_t n, max_size_t const * grand_indices)
+{
+    // Flag the locations of retracted data points with '_grand_total',
+    // as the sampling calls do for evicted ones.
+    size_t r = 0;
+    for (size_t j = 0; j < n; ++j)
+    {
+        max_size_t t = grand_indices[j];
+        if (t >= _grand_total)
+            continue;
+        size_t slot;
+        if (_slot_index != nullptr)
+        {
+            slot = this->slot_of(t);
+            if (slot == size_t(-1))
+                continue;
+            this->slot_index_erase(t);
+        } else
+        {
+            slot = std::find(_chosen_times.get(), _chosen_times.get() + _current_size, t)
+                - _chosen_times.get();
+            if (slot == _current_size)
+                continue;
+        }
+        _chosen_times[slot] = _grand_total;
+        ++r;
+    }
+
+    // Compact the survivors to the front in increasing order of their
+    // old locations, as 'shrink_to' does.
+    size_t nn = 0;
+    _n_relocations = 0;
+    for (size_t i = 0; i < _current_size; ++i)
+    {
+        if (_chosen_times[i] < _grand_total)
+        {
+            if (nn != i)
+            {
+                _chosen_times[nn] = _chosen_times[i];
+                _chosen_u[nn] = _chosen_u[i];
+                if (_weights != nullptr)
+                    _weights[nn] = _weights[i];
+                if (_slot_index != nullptr)
+                    _slot_index[this->slot_index_find(_chosen_times[nn])].slot = nn;
+                _moves[_n_relocations++] = reservoir_move{i, nn};
+            }
+            _idx_kept_or_removed[nn] = i;
+            ++nn;
+        }
+    }
+
+    _n_kept_or_removed = nn;
+    _n_appended_or_injected = 0;
+    _n_insertions = 0;
+    _kept_or_removed = 1;
+        // keep_n_append
+
+    STATS_ADD(_stats, n_evicted, r);
+
+    _current_size = nn;
+    return r;
+}
+
+
+
+
+size_t weighted_reservoir::n_kept() const
+{
+    if (_kept_or_removed == 1)
+        return _n_kept_or_removed;
+    else
+        return 0;
+}
+
+
+
+
+size_t const * weighted_reservoir::idx_kept() const
+{
+    if (_kept_or_removed == 1)
+        return _idx_kept_or_removed.get();
+    else
+        return nullptr;
+}
+
+
+
+
+size_t weighted_reservoir::n_appended() const
+{
+    if (_kept_or_removed == 1)
+        return _n_appended_or_injected;
+    else
+        return 0;
+}
+
+
+
+
+size_t const * weighted_reservoir::idx_appended() const
+{
+    if (_kept_or_removed == 1)
+        return _idx_appended_or_injected.get();
+    else
+        return nullptr;
+}
+
+
+
+
+
+size_t weighted_reservoir::n_removed() const
+{
+    if (_kept_or_removed == 2)
+        return _n_kept_or_removed;
+    else
+        return 0;
+}
+
+
+
+
+size_t const * weighted_reservoir::idx_removed() const
+{
+    if (_kept_or_removed == 2)
+        return _idx_kept_or_removed.get();
+    else
+        return nullptr;
+}
+
+
+
+
+size_t weighted_reservoir::n_injected() const
+{
+    if (_kept_or_removed == 2)
+        return _n_appended_or_injected;
+    else
+        return 0;
+}
+
+
+
+
+size_t const * weighted_reservoir::idx_injected() const
+{
+    if (_kept_or_removed == 2)
+        return _idx_appended_or_injected.get();
+    else
+        return nullptr;
+}
+
+
+
+
+
+/// Slot index.
+//
+// Open addressing with linear probing over a power-of-two table of at
+// least '2 * capacity' entries, hence a load factor of at most 1/2.
+// Grand indices are consecutive integers; multiplicative (Fibonacci)
+// hashing spreads them over the table. Deletion shifts the following
+// entries of the probe sequence back, so there are no tombstones and
+// lookups never degrade.
+
+static const max_size_t slot_index_empty = max_size_t(-1);
+    // Never a grand index, b/c 'grand_total' cannot overflow.
+
+
+static inline size_t slot_index_hash(max_size_t t, unsigned shift)
+{
+    return static_cast<size_t>((uint64_t(t) * 0x9E3779B97F4A7C15ull) >> shift);
+}
+
+
+
+void weighted_reservoir::enable_slot_index(bool on)
+{
+    if (!on)
+    {
+        _slot_index.reset(nullptr);
+        _slot_index_times.reset(nullptr);
+        _slot_index_mask = 0;
+        return;
+    }
+
+    size_t n = 1;
+    unsigned bits = 0;
+    while (n < 2 * _capacity)
+    {
+        n *= 2;
+        ++bits;
+    }
+    if (_slot_index == nullptr || _slot_index_mask + 1 != n)
+    {
+        _slot_index = allocate_array<slot_index_entry>(_workspace_resource, n);
+        _slot_index_mask = n - 1;
+        _slot_index_shift = 64 - bits;
+    }
+    _slot_index_times = allocate_array<max_size_t>(_workspace_resource, _capacity);
+        // The capacity may have changed within the same table size.
+    this->build_slot_index();
+}
+
+
+
+bool weighted_reservoir::slot_index_enabled() const
+{
+    return _slot_index != nullptr;
+}
+
+
+
+void weighted_reservoir::build_slot_index()
+{
+    std::fill_n(_slot_index.get(), _slot_index_mask + 1,
+            slot_index_entry{slot_index_empty, 0});
+    for (size_t i = 0; i < _current_size; ++i)
+    {
+        this->slot_index_insert(_chosen_times[i], i);
+    }
+}
+
+
+
+void weighted_reservoir::slot_index_insert(max_size_t t, size_t slot)
+{
+    size_t i = slot_index_hash(t, _slot_index_shift) & _slot_index_mask;
+    while (_slot_index[i].time != slot_index_empty)
+    {
+        i = (i + 1) & _slot_index_mask;
+    }
+    _slot_index[i] = slot_index_entry{t, slot};
+}
+
+
+
+size_t weighted_reservoir::slot_index_find(max_size_t t) const
+{
+    size_t i = slot_index_hash(t, _slot_index_shift) & _slot_index_mask;
+    while (_slot_index[i].time != t)
+    {
+        if (_slot_index[i].time == slot_index_empty)
+            return size_t(-1);
+        i = (i + 1) & _slot_index_mask;
+    }
+    return i;
+}
+
+
+
+void weighted_reservoir::slot_index_erase(max_size_t t)
+{
+    size_t i = this->slot_index_find(t);
+    assert(i != size_t(-1));
+
+    size_t j = i;
+    while (true)
+    {
+        j = (j + 1) & _slot_index_mask;
+        if (_slot_index[j].time == slot_index_empty)
+            break;
+        size_t home = slot_index_hash(_slot_index[j].time, _slot_index_shift) & _slot_index_mask;
+        if (((j - home) & _slot_index_mask) >= ((j - i) & _slot_index_mask))
+        {
+            // 'home' is not in the cyclic range (i, j], hence the entry
+            // at 'j' is still reachable from its home after moving to
+            // the hole at 'i'.
+            _slot_index[i] = _slot_index[j];
+            i = j;
+        }
+    }
+    _slot_index[i].time = slot_index_empty;
+}
+
+
+
+// Called at the end of 'keep_n_append' and 'remove_n_inject', while
+// '_current_size' and '_grand_total' still have their old values,
+// which are passed in; '_slot_index_times' holds the old
+// '_chosen_times' if sampling took place.
+void weighted_reservoir::update_slot_index(size_t old_size, max_size_t old_total)
+{
+    // Evicted data points first, so that the table never holds more
+    // than 'capacity' entries.
+    if (_kept_or_removed == 1)
+    {
+        // 'idx_kept' is in increasing order.
+        size_t k = 0;
+        for (size_t i = 0; i < old_size; ++i)
+        {
+            if (k < _n_kept_or_removed && _idx_kept_or_removed[k] == i)
+                ++k;
+            else
+                this->slot_index_erase(_slot_index_times[i]);
+        }
+    } else
+    {
+        for (size_t j = 0; j < _n_kept_or_removed; ++j)
+        {
+            this->slot_index_erase(_slot_index_times[_idx_kept_or_removed[j]]);
+        }
+    }
+
+    for (size_t j = 0; j < _n_relocations; ++j)
+    {
+        size_t i = this->slot_index_find(_slot_index_times[_moves[j].src]);
+        assert(i != size_t(-1));
+        _slot_index[i].slot = _moves[j].dst;
+    }
+
+    for (size_t j = _n_relocations; j < _n_relocations + _n_insertions; ++j)
+    {
+        this->slot_index_insert(old_total + _moves[j].src, _moves[j].dst);
+    }
+}
+
+
+
+size_t weighted_reservoir::slot_of(max_size_t grand_index) const
+{
+    assert(this->slot_index_enabled());
+    size_t i = this->slot_index_find(grand_index);
+    if (i == size_t(-1))
+        return i;
+    return _slot_index[i].slot;
+}
 
-size_t const * weighted_reservoir::idx_injected() const
+
+
+
+/// Estimation.
+
+
+// Bring '_threshold' to the scale of the keys of a call that takes
+// 'n_provided' new data points with reference '_ref_L', and raise it
+// to 'threshold' if that is larger. '_grand_total' and 'old_ref_L'
+// are those before the call.
+void weighted_reservoir::update_threshold(
+        max_size_t old_ref_L, size_t n_provided, double threshold)
 {
-    if (_kept_or_removed == 2)
-        return _idx_appended_or_injected.get();
-    else
-        return nullptr;
+    _threshold = std::max(threshold, rescale_threshold(_threshold,
+                _grand_total, old_ref_L,
+                _grand_total + n_provided, _ref_L, _alpha));
+}
+
+
+
+void weighted_reservoir::enable_estimates(bool on)
+{
+    if (!on)
+    {
+        _weights.reset(nullptr);
+        return;
+    }
+    if (_weights == nullptr)
+        _weights = allocate_array<double>(_workspace_resource, _capacity);
+    this->build_weights();
+}
+
+
+
+bool weighted_reservoir::estimates_enabled() const
+{
+    return _weights != nullptr;
+}
+
+
+
+void weighted_reservoir::build_weights()
+{
+    _weights_scale = std::max<max_size_t>(_grand_total - _ref_L, 1);
+    const double factor = 1.0 / _weights_scale;
+    for (size_t i = 0; i < _current_size; ++i)
+    {
+        _weights[i] = std::pow((_chosen_times[i] - _ref_L) * factor, _alpha);
+    }
+}
+
+
+
+// Called at the end of 'keep_n_append' and 'remove_n_inject', with
+// '_ref_L' and '_grand_total' before the call.
+// While '_ref_L' stays put, the weights of the data points kept are
+// valid as they are, and only the move plan needs to be applied.
+// The weights grow as '_grand_total - _ref_L' grows past
+// '_weights_scale'; rebuilding once that has doubled keeps them in
+// range for any 'alpha'.
+void weighted_reservoir::update_weights(max_size_t old_ref_L, max_size_t old_total)
+{
+    if (_ref_L != old_ref_L || _grand_total - _ref_L > 2 * _weights_scale)
+    {
+        this->build_weights();
+        return;
+    }
+
+    double * w = _weights.get();
+    reservoir_move const * m = _moves.get();
+    for (size_t j = 0; j < _n_relocations; ++j)
+    {
+        w[m[j].dst] = w[m[j].src];
+    }
+    const double factor = 1.0 / _weights_scale;
+    for (size_t j = _n_relocations; j < _n_relocations + _n_insertions; ++j)
+    {
+        w[m[j].dst] = std::pow((old_total + m[j].src - _ref_L) * factor, _alpha);
+    }
+}
+
+
+
+// '_threshold' on the scale of '_weights'.
+double weighted_reservoir::weights_threshold() const
+{
+    if (_threshold == 0.)
+        return 0.;
+    return _threshold * std::pow(double(_grand_total - _ref_L) / _weights_scale, _alpha);
 }
 
 
 
+double weighted_reservoir::inclusion_probability(size_t slot) const
+{
+    assert(this->estimates_enabled());
+    assert(slot < _current_size);
+    double tau = this->weights_threshold();
+    if (tau == 0.)
+        return 1.;
+    return std::min(1., _weights[slot] / tau);
+}
+
+
+
+double weighted_reservoir::adjusted_weight(size_t slot) const
+{
+    assert(this->estimates_enabled());
+    assert(slot < _current_size);
+    double to_normal = std::pow(double(_weights_scale) / (_grand_total - _ref_L), _alpha);
+    return std::max(_weights[slot], this->weights_threshold()) * to_normal;
+}
+
 
 
-max_size_t const * weighted_reservoir::idx_current() const
+// Horvitz-Thompson sum over 'n' sampled data points of 'x = values[i]'
+// (1 if not 'has_values'), restricted to 'mask[i] != 0' if
+// 'has_mask', and the unbiased estimate of its variance,
+//   sum x^2 (1 - p) / p^2  =  sum y (y - x),  y = x / p.
+// 'x - m' in place of 'x' if 'centered', for the mean.
+// '1 / p = max(1, tau / w)', which is 1 if 'tau' is 0 (a NaN from
+// '0 / 0' compares false in 'std::max').
+template<bool has_values, bool has_mask, bool centered>
+static reservoir_estimate ht_sum(
+        size_t n,
+        double const * w,
+        double tau,
+        double const * values,
+        unsigned char const * mask,
+        double m = 0.)
 {
-    if (_current_size > 0)
-        return _chosen_times.get();
+    double sum = 0.;
+    double var = 0.;
+    for (size_t i = 0; i < n; ++i)
+    {
+        double inv_p = std::max(1., tau / w[i]);
+        double x = has_values ? values[i] : 1.;
+        if (centered)
+            x -= m;
+        if (has_mask)
+            x *= double(mask[i] != 0);
+        double y = x * inv_p;
+        sum += y;
+        var += y * (y - x);
+    }
+    return reservoir_estimate{sum, var};
+}
+
+
+
+reservoir_estimate weighted_reservoir::estimate_sum(
+        double const * values,
+        unsigned char const * mask) const
+{
+    assert(this->estimates_enabled());
+    assert(values != nullptr || _current_size == 0);
+    double tau = this->weights_threshold();
+    if (mask != nullptr)
+        return ht_sum<true, true, false>(_current_size, _weights.get(), tau, values, mask);
     else
-        return nullptr;
+        return ht_sum<true, false, false>(_current_size, _weights.get(), tau, values, mask);
+}
+
+
+
+reservoir_estimate weighted_reservoir::estimate_count(
+        unsigned char const * mask) const
+{
+    assert(this->estimates_enabled());
+    double tau = this->weights_threshold();
+    if (mask != nullptr)
+        return ht_sum<false, true, false>(_current_size, _weights.get(), tau, nullptr, mask);
+    else
+        return ht_sum<false, false, false>(_current_size, _weights.get(), tau, nullptr, mask);
+}
+
+
+
+// The ratio 'S / N' of the estimated sum and count; by linearization,
+//   Var(S / N) ~= Var(sum (x - m) / p) / N^2,   m = S / N.
+reservoir_estimate weighted_reservoir::estimate_mean(
+        double const * values,
+        unsigned char const * mask) const
+{
+    reservoir_estimate s = this->estimate_sum(values, mask);
+    reservoir_estimate c = this->estimate_count(mask);
+    if (c.value == 0.)
+        return reservoir_estimate{0., 0.};
+
+    double m = s.value / c.value;
+    double tau = this->weights_threshold();
+    reservoir_estimate d = (mask != nullptr)
+        ? ht_sum<true, true, true>(_current_size, _weights.get(), tau, values, mask, m)
+        : ht_sum<true, false, true>(_current_size, _weights.get(), tau, values, mask, m);
+    return reservoir_estimate{m, d.variance / (c.value * c.value)};
+}
+
+
+
+
+reservoir_move_plan weighted_reservoir::move_plan() const
+{
+    reservoir_move_plan plan;
+    plan.moves = _moves.get();
+    plan.n_relocations = _n_relocations;
+    plan.n_insertions = _n_insertions;
+    return plan;
+}
+
+
+
+
+reservoir_stats weighted_reservoir::stats() const
+{
+    return _stats;
+}
+
+
+void weighted_reservoir::reset_stats()
+{
+    _stats = reservoir_stats();
+}
+
+
+bool weighted_reservoir::stats_enabled()
+{
+#ifdef RESERVOIR_STATS
+    return true;
+#else
+    return false;
+#endif
 }
 
 
@@ -683,6 +1798,10 @@ herr_t weighted_reservoir::export_to_file(hid_t loc_id) const
     if (status < 0)
         return status;
 
+    status = h5make_dataset_number(loc_id, "threshold", 1, dims, &_threshold);
+    if (status < 0)
+        return status;
+
 
     if (_capacity > 0)
     {
@@ -747,6 +1866,7 @@ herr_t weighted_reservoir::import_from_file(hid_t loc_id)
 
 
     auto old_capacity = _capacity;
+    auto old_alpha = _alpha;
 
     status = h5read_dataset_number(loc_id, "alpha", &_alpha);
     if (status < 0)
@@ -768,6 +1888,15 @@ herr_t weighted_reservoir::import_from_file(hid_t loc_id)
     if (status < 0)
         return status;
 
+    _threshold = 0.;
+    if (H5LTfind_dataset(loc_id, "threshold") > 0)
+    {
+        // Absent from files written before estimates were supported.
+        status = h5read_dataset_number(loc_id, "threshold", &_threshold);
+        if (status < 0)
+            return status;
+    }
+
 
 
     assert(_capacity > 0);
@@ -775,16 +1904,24 @@ herr_t weighted_reservoir::import_from_file(hid_t loc_id)
 
     if (old_capacity != _capacity)
     {
+        if (old_capacity > 0 && !_resource->resizable())
+        {
+            // The arrays cannot be reallocated; stay as before.
+            _capacity = old_capacity;
+            _alpha = old_alpha;
+            this->clear();
+            return -1;
+        }
         if (_chosen_times != nullptr)
         {
             _chosen_times.reset(nullptr);
         }
-        _chosen_times = std::unique_ptr<max_size_t[]>{new max_size_t[_capacity]()};
+        _chosen_times = allocate_array<max_size_t>(_resource, _capacity);
         if (_chosen_u != nullptr)
         {
             _chosen_u.reset(nullptr);
         }
-        _chosen_u = std::unique_ptr<double[]>{new double[_capacity]()};
+        _chosen_u = allocate_array<double>(_resource, _capacity);
     }
 
     status = h5read_dataset_number(loc_id, "chosen_times", _chosen_times.get());
@@ -800,18 +1937,35 @@ herr_t weighted_reservoir::import_from_file(hid_t loc_id)
     _kept_or_removed = 0;
     _n_kept_or_removed = 0;
     _n_appended_or_injected = 0;
+    _n_relocations = 0;
+    _n_insertions = 0;
     if (old_capacity != _capacity)
     {
         if (_idx_kept_or_removed != nullptr)
         {
             _idx_kept_or_removed.reset(nullptr);
         }
-        _idx_kept_or_removed = std::unique_ptr<size_t[]>{new size_t[_capacity]};
+        _idx_kept_or_removed = allocate_array<size_t>(_resource, _capacity);
         if (_idx_appended_or_injected != nullptr)
         {
             _idx_appended_or_injected.reset(nullptr);
         }
-        _idx_appended_or_injected = std::unique_ptr<size_t[]>{new size_t[_capacity]};
+        _idx_appended_or_injected = allocate_array<size_t>(_resource, _capacity);
+        _moves = allocate_array<reservoir_move>(_workspace_resource, _capacity);
+
+        STATS_ADD(_stats, n_allocations, 5);
+        STATS_ADD(_stats, bytes_allocated,
+                _capacity * (sizeof(max_size_t) + sizeof(double) + 2 * sizeof(size_t) + sizeof(reservoir_move)));
+    }
+
+    if (_slot_index != nullptr)
+        this->enable_slot_index(true);
+            // Reallocates if the capacity has changed.
+    if (_weights != nullptr)
+    {
+        if (old_capacity != _capacity)
+            _weights = allocate_array<double>(_workspace_resource, _capacity);
+        this->build_weights();
     }
 
     return 0;
@@ -854,3 +2008,295 @@ herr_t weighted_reservoir::import_from_file(char const * file)
 }
 
 
+
+
+
+
+//////////// bulk export/import of many reservoirs   ////////////////
+
+struct reservoir_record
+{
+    double alpha;
+    size_t capacity;
+    size_t current_size;
+    max_size_t grand_total;
+    max_size_t ref_L;
+    double threshold;
+};
+
+
+// Caller closes the returned type with 'H5Tclose'; negative on failure.
+hid_t make_record_type()
+{
+    hid_t t = H5Tcreate(H5T_COMPOUND, sizeof(reservoir_record));
+    if (t < 0)
+        return t;
+    if (H5Tinsert(t, "alpha", HOFFSET(reservoir_record, alpha), h5get_mem_type<double>()) < 0
+            || H5Tinsert(t, "capacity", HOFFSET(reservoir_record, capacity), h5get_mem_type<size_t>()) < 0
+            || H5Tinsert(t, "current_size", HOFFSET(reservoir_record, current_size), h5get_mem_type<size_t>()) < 0
+            || H5Tinsert(t, "grand_total", HOFFSET(reservoir_record, grand_total), h5get_mem_type<max_size_t>()) < 0
+            || H5Tinsert(t, "ref_L", HOFFSET(reservoir_record, ref_L), h5get_mem_type<max_size_t>()) < 0
+            || H5Tinsert(t, "threshold", HOFFSET(reservoir_record, threshold), h5get_mem_type<double>()) < 0)
+    {
+        H5Tclose(t);
+        return -1;
+    }
+    return t;
+}
+
+
+herr_t make_record_dataset(
+        hid_t loc_id,
+        reservoir_record const * records,
+        size_t n)
+{
+    hid_t t = make_record_type();
+    if (t < 0)
+        return t;
+    hsize_t dims[1] = {n};
+    herr_t status = H5LTmake_dataset(loc_id, "reservoirs", 1, dims, t, records);
+    H5Tclose(t);
+    return status;
+}
+
+
+herr_t read_record_dataset(
+        hid_t loc_id,
+        reservoir_record * records)
+{
+    hid_t t = make_record_type();
+    if (t < 0)
+        return t;
+    herr_t status = H5LTread_dataset(loc_id, "reservoirs", t, records);
+    H5Tclose(t);
+    return status;
+}
+
+
+herr_t write_reservoirs(
+        hid_t loc_id,
+        reservoir_record const * records,
+        size_t n,
+        max_size_t const * offsets,
+        max_size_t const * times,
+        double const * us)
+{
+    herr_t status = make_record_dataset(loc_id, records, n);
+    if (status < 0)
+        return status;
+
+    hsize_t dims[1];
+
+    dims[0] = n + 1;
+    status = h5make_dataset_number(loc_id, "offsets", 1, dims, offsets);
+    if (status < 0)
+        return status;
+
+    dims[0] = offsets[n];
+    status = h5make_dataset_number(loc_id, "chosen_times", 1, dims, times);
+    if (status < 0)
+        return status;
+
+    status = h5make_dataset_number(loc_id, "chosen_u", 1, dims, us);
+    if (status < 0)
+        return status;
+
+    return 0;
+}
+
+
+
+herr_t read_reservoirs(
+        hid_t loc_id,
+        hssize_t & n,
+        std::unique_ptr<reservoir_record[]> & records,
+        std::unique_ptr<max_size_t[]> & offsets,
+        std::unique_ptr<max_size_t[]> & times,
+        std::unique_ptr<double[]> & us)
+{
+    herr_t status;
+
+    n = h5get_array_npoints(loc_id, "reservoirs");
+    if (n < 0)
+        return n;
+
+    records.reset(new reservoir_record[n]());
+        // Zeroed, so that members absent from older files (e.g.
+        // 'threshold') read as 0.
+    status = read_record_dataset(loc_id, records.get());
+    if (status < 0)
+        return status;
+
+    offsets.reset(new max_size_t[n + 1]);
+    status = h5read_dataset_number(loc_id, "offsets", offsets.get());
+    if (status < 0)
+        return status;
+
+    times.reset(new max_size_t[offsets[n]]);
+    status = h5read_dataset_number(loc_id, "chosen_times", times.get());
+    if (status < 0)
+        return status;
+
+    us.reset(new double[offsets[n]]);
+    status = h5read_dataset_number(loc_id, "chosen_u", us.get());
+    if (status < 0)
+        return status;
+
+    return 0;
+}
+
+
+
+herr_t export_reservoirs(
+        hid_t loc_id,
+        char const * name,
+        weighted_reservoir const * const * reservoirs,
+        const size_t n)
+{
+    std::unique_ptr<reservoir_record[]> records{new reservoir_record[n]};
+    std::unique_ptr<max_size_t[]> offsets{new max_size_t[n + 1]};
+
+    offsets[0] = 0;
+    for (size_t i = 0; i < n; ++i)
+    {
+        offsets[i + 1] = offsets[i] + reservoirs[i]->_current_size;
+    }
+
+    std::unique_ptr<max_size_t[]> times{new max_size_t[offsets[n]]};
+    std::unique_ptr<double[]> us{new double[offsets[n]]};
+
+    for (size_t i = 0; i < n; ++i)
+    {
+        weighted_reservoir const & r = *reservoirs[i];
+        assert(r._capacity > 0);
+        records[i].alpha = r._alpha;
+        records[i].capacity = r._capacity;
+        records[i].current_size = r._current_size;
+        records[i].grand_total = r._grand_total;
+        records[i].ref_L = r._ref_L;
+        records[i].threshold = r._threshold;
+        std::copy_n(r._chosen_times.get(), r._current_size, times.get() + offsets[i]);
+        std::copy_n(r._chosen_u.get(), r._current_size, us.get() + offsets[i]);
+    }
+
+    if (name[0] == '.' && name[1] == '\0')
+    {
+        return write_reservoirs(loc_id, records.get(), n,
+                offsets.get(), times.get(), us.get());
+    } else
+    {
+        hid_t group_id = H5Gcreate(loc_id, name, H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+        if (group_id < 0)
+        {
+            return group_id;
+        }
+        auto status = write_reservoirs(group_id, records.get(), n,
+                offsets.get(), times.get(), us.get());
+        H5Gclose(group_id);
+        return status;
+    }
+}
+
+
+
+
+herr_t export_reservoirs(
+        hid_t loc_id,
+        char const * name,
+        std::vector<weighted_reservoir> const & reservoirs)
+{
+    std::vector<weighted_reservoir const *> ptrs(reservoirs.size());
+    for (size_t i = 0; i < reservoirs.size(); ++i)
+    {
+        ptrs[i] = &reservoirs[i];
+    }
+    return export_reservoirs(loc_id, name, ptrs.data(), ptrs.size());
+}
+
+
+
+
+herr_t export_reservoirs(
+        char const * file,
+        std::vector<weighted_reservoir> const & reservoirs)
+{
+    hid_t file_id = H5Fcreate(file, H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT);
+    if (file_id < 0)
+    {
+        return file_id;
+    }
+    herr_t status = export_reservoirs(file_id, ".", reservoirs);
+    H5Fclose(file_id);
+    return status;
+}
+
+
+
+
+herr_t import_reservoirs(
+        hid_t loc_id,
+        char const * name,
+        std::vector<weighted_reservoir> & reservoirs)
+{
+    hssize_t n;
+    std::unique_ptr<reservoir_record[]> records;
+    std::unique_ptr<max_size_t[]> offsets;
+    std::unique_ptr<max_size_t[]> times;
+    std::unique_ptr<double[]> us;
+    herr_t status;
+
+    if (name[0] == '.' && name[1] == '\0')
+    {
+        status = read_reservoirs(loc_id, n, records, offsets, times, us);
+    } else
+    {
+        hid_t group_id = H5Gopen(loc_id, name, H5P_DEFAULT);
+        if (group_id < 0)
+        {
+            return group_id;
+        }
+        status = read_reservoirs(group_id, n, records, offsets, times, us);
+        H5Gclose(group_id);
+    }
+    if (status < 0)
+        return status;
+
+    std::vector<weighted_reservoir> result;
+    result.reserve(n);
+    for (hssize_t i = 0; i < n; ++i)
+    {
+        auto const & rec = records[i];
+        assert(rec.capacity > 0);
+        assert(rec.current_size <= rec.capacity);
+        assert(offsets[i + 1] - offsets[i] == rec.current_size);
+
+        result.emplace_back(rec.capacity, rec.alpha);
+        weighted_reservoir & r = result.back();
+        r._current_size = rec.current_size;
+        r._grand_total = rec.grand_total;
+        r._ref_L = rec.ref_L;
+        r._threshold = rec.threshold;
+        std::copy_n(times.get() + offsets[i], rec.current_size, r._chosen_times.get());
+        std::copy_n(us.get() + offsets[i], rec.current_size, r._chosen_u.get());
+    }
+
+    reservoirs.swap(result);
+    return 0;
+}
+
+
+
+
+herr_t import_reservoirs(
+        char const * file,
+        std::vector<weighted_reservoir> & reservoirs)
+{
+    hid_t file_id = H5Fopen(file, H5F_ACC_RDONLY, H5P_DEFAULT);
+    if (file_id < 0)
+    {
+        return file_id;
+    }
+    herr_t status = import_reservoirs(file_id, ".", reservoirs);
+    H5Fclose(file_id);
+    return status;
+}
@@ -36,8 +36,11 @@
 #include <cassert>
 #include <cstddef>    // size_t
 #include <cstdint>    // uintmax_t
+#include <cstring>
 #include <memory>
 #include <random>
+#include <tuple>
+#include <vector>
 
 
 typedef uintmax_t max_size_t;
@@ -48,13 +51,35 @@ typedef uintmax_t max_size_t;
 
 
 
+// The global URNG of the calling thread.
+// Each thread has an engine of its own, so these functions may be
+// called from several threads at once without locking, and threads do
+// not contend for one engine. A thread's engine is seeded, on first use
+// and after every 'global_seed', by 'thread_seed(s, i)' from the last
+// global seed 's' and the thread's index 'i'. Indices are given in
+// order of first use, unless set by 'global_seed_thread'; the first
+// thread, normally 'main', gets index 0 and the global seed itself, as
+// when there was a single engine.
 std::default_random_engine & global_urng();
 
 // Seed the global URNG by a specified seed.
 // Calling this function with the same seed will make the global URNG
 // generate the same stream of random numbers.
+// The engines of the other threads are reseeded, from 's', on their
+// next use; call this while they are not drawing.
 void global_seed(unsigned int);
 
+// Give the calling thread index 'thread_index' and reseed its URNG
+// accordingly. A worker pool that numbers its threads this way gets
+// the same streams per worker from run to run, whatever the order in
+// which the threads start.
+void global_seed_thread(unsigned int thread_index);
+
+// The seed of thread 'thread_index' under global seed 's': 's' itself
+// for index 0, otherwise a splitmix64 mix of both, so that neighbouring
+// indices get unrelated streams.
+unsigned int thread_seed(unsigned int s, unsigned int thread_index);
+
 // Seed the global URNG by a hardware or environment (e.g. system time)
 // dependent value to achieve non-reproducible stream of random numbers
 // generated by the global URNG.
@@ -72,6 +97,20 @@ int pick_a_number(int from, int thru);
 double pick_a_number(double from, double upto);
 
 
+// Fill 'out[0 .. n)' with integers uniform in from,..., thru
+// (inclusive), or with reals uniform in (from, upto).
+// One call draws 64 bits from the global URNG of the calling thread as
+// the start of a splitmix64 sequence, and derives every number from
+// its own position in that sequence; the loop has no carried
+// dependence, and runs several times as fast as as many calls to
+// 'pick_a_number'. The numbers are reproducible under
+// 'global_seed', but differ from those of as many 'pick_a_number'.
+// Integers are mapped by multiply-shift, with a relative bias below
+// '(thru - from + 1) / 2^32'; reals have 53 random bits.
+void pick_numbers(int * out, size_t n, int from, int thru);
+void pick_numbers(double * out, size_t n, double from, double upto);
+
+
 
 /*
  * The following three functions are simple enough that
@@ -112,6 +151,170 @@ void random_indices(int_t * indices, int_t n, int_t k)
 */
 
 
+/*
+ * Runtime statistics of a 'weighted_reservoir', accumulated over calls
+ * to 'keep_n_append' and 'remove_n_inject' (and the evictions of
+ * 'shrink_to' and 'retract') since construction, import, or the last
+ * 'reset_stats'.
+ *
+ * The counters are maintained only if the library is compiled with
+ * 'RESERVOIR_STATS' defined (see Makefile); otherwise the
+ * instrumentation is compiled out of the hot path and all fields stay
+ * zero.
+ *
+ * The 'ticks_*' fields are raw time-stamp-counter cycles on x86 and
+ * nanoseconds elsewhere; they are meant for comparing phases against
+ * one another, not for wall-clock reporting.
+ */
+struct reservoir_stats
+{
+    max_size_t n_calls = 0;
+        // Calls to 'keep_n_append' or 'remove_n_inject'.
+    max_size_t n_sampled_calls = 0;
+        // Calls in which the reservoir overflowed, hence sampling took
+        // place; the others simply appended the new data points.
+    max_size_t n_offered = 0;
+        // New data points provided.
+    max_size_t n_accepted = 0;
+        // New data points that entered the reservoir.
+    max_size_t n_evicted = 0;
+        // Pre-existing data points dropped from the reservoir,
+        // including those taken back by 'retract'.
+    max_size_t n_ref_L_moves = 0;
+        // Sampled calls in which the reference time '_ref_L' changed,
+        // i.e. the oldest data point in the reservoir was evicted in
+        // the previous call.
+    max_size_t ticks_keys = 0;
+        // Computing priority keys of existing and new data points.
+    max_size_t ticks_select = 0;
+        // 'nth_element' selection of the top 'capacity' keys.
+    max_size_t ticks_bookkeeping = 0;
+        // Updating the reservoir state and the index views after
+        // selection.
+    max_size_t n_allocations = 0;
+    max_size_t bytes_allocated = 0;
+        // Heap allocations by the reservoir, including the internal
+        // arrays and the per-call sampling workspace.
+};
+
+
+
+/*
+ * Source of memory for the arrays of a 'weighted_reservoir'.
+ *
+ * This plays the role of 'std::pmr::memory_resource', which is not
+ * available in C++11: a reservoir takes one resource for its state
+ * (the per-slot arrays, allocated once) and one for the workspace of
+ * the sampling calls ('3 * capacity' entries of 32 bytes, allocated by
+ * the first and kept), so
+ * that large reservoirs can live in huge pages, NUMA-local pools,
+ * or shared memory, and many reservoirs on many threads need not
+ * contend on the global heap.
+ *
+ * 'allocate' returns memory of at least 'bytes' bytes aligned to
+ * 'alignment', or throws 'std::bad_alloc'. The resource must outlive
+ * every reservoir that uses it.
+ */
+class reservoir_memory_resource
+{
+    public:
+        virtual ~reservoir_memory_resource() {}
+
+        virtual void * allocate(size_t bytes, size_t alignment) = 0;
+        virtual void deallocate(void * p, size_t bytes, size_t alignment) = 0;
+
+        virtual bool resizable() const
+        {
+            return true;
+        }
+            // Whether a reservoir may allocate its per-slot arrays
+            // again, as 'shrink_to', 'grow_to' and an import with
+            // another capacity do; 'false' for a resource laid out for
+            // exactly one set of them.
+};
+
+
+// 'operator new' and 'operator delete'; the default for all reservoirs.
+reservoir_memory_resource * default_reservoir_resource();
+
+// Anonymous 'mmap' rounded up to and aligned at 2 MB, advised for
+// transparent huge pages and pre-touched, so that page faults happen
+// at allocation rather than during sampling. Each allocation is its
+// own mapping, hence this is meant for a few large arrays, not many
+// small ones. Falls back to plain pages where huge pages are
+// unavailable.
+reservoir_memory_resource * hugepage_reservoir_resource();
+
+
+// Deleter for arrays obtained from a 'reservoir_memory_resource'.
+// The element types are trivially destructible.
+struct reservoir_array_deleter
+{
+    reservoir_memory_resource * resource = nullptr;
+    size_t bytes = 0;
+    size_t alignment = 0;
+
+    void operator()(void * p) const
+    {
+        resource->deallocate(p, bytes, alignment);
+    }
+};
+
+template<typename T>
+using reservoir_array = std::unique_ptr<T[], reservoir_array_deleter>;
+
+
+
+/*
+ * One move of a user data point, as part of a 'reservoir_move_plan'.
+ */
+struct reservoir_move
+{
+    size_t src;
+    size_t dst;
+};
+
+
+/*
+ * The rearrangement of user data implied by the last call to
+ * 'keep_n_append' or 'remove_n_inject', in either mode, as a list of
+ * moves:
+ *
+ *   moves[0 .. n_relocations)
+ *       'src' is the location of a pre-existing data point before the
+ *       call, 'dst' its location after. These must be applied in the
+ *       order listed, and are safe to apply in place: the sources not
+ *       yet moved are never overwritten.
+ *   moves[n_relocations .. n_relocations + n_insertions)
+ *       'src' is the index of a new data point among the 'n_provided'
+ *       ones, 'dst' its location in the reservoir. These may be applied
+ *       in any order, after the relocations.
+ *
+ * Locations not named as a 'dst' keep their data point, or are beyond
+ * the new 'size()'. The plan has no more than 'capacity' moves.
+ * 'apply_plan' below applies a plan to user arrays.
+ */
+struct reservoir_move_plan
+{
+    reservoir_move const * moves;
+    size_t n_relocations;
+    size_t n_insertions;
+};
+
+
+
+/*
+ * A Horvitz-Thompson estimate of an aggregate over the stream, and
+ * an estimate of its variance, from 'weighted_reservoir::estimate_*'.
+ */
+struct reservoir_estimate
+{
+    double value;
+    double variance;
+};
+
+
+
 /*
  * References for weightd reservoir sampling:
  *
@@ -130,11 +333,25 @@ void random_indices(int_t * indices, int_t n, int_t k)
 class weighted_reservoir
 {
     public:
-        weighted_reservoir(size_t cap, double alph);
+        weighted_reservoir(
+                size_t cap,
+                double alph,
+                reservoir_memory_resource * resource = nullptr,
+                reservoir_memory_resource * workspace_resource = nullptr
+                    // 'resource' provides the per-slot state arrays,
+                    // 'workspace_resource' the temporary buffer of each
+                    // sampling call.
+                    // 'nullptr' means 'default_reservoir_resource()'
+                    // for 'resource' and the same as 'resource' for
+                    // 'workspace_resource'.
+                );
 
         weighted_reservoir();
-            // Use this form only when the reservoir is to be imported
-            // from a disk file; otherwise use the other form.
+        explicit weighted_reservoir(
+                reservoir_memory_resource * resource,
+                reservoir_memory_resource * workspace_resource = nullptr);
+            // Use these forms only when the reservoir is to be imported
+            // from a disk file; otherwise use the first form.
 
         void clear();
 
@@ -146,9 +363,15 @@ class weighted_reservoir
 
 
         void keep_n_append(
-                size_t n_provided
+                size_t n_provided,
                     // Number of new data points provided to the
                     // reservoir.
+                double const * u = nullptr
+                    // If not 'nullptr', the 'n_provided' uniforms in
+                    // [0, 1) of the new data points, used instead of
+                    // draws from 'global_urng()'; so that reservoirs
+                    // fed the same stream can share them (see
+                    // 'multi_reservoir').
                 );
 
         // Used the following functions after 'keep_n_append'.
@@ -156,7 +379,7 @@ class weighted_reservoir
         size_t const * idx_kept() const;
             // The first 'n_kept()' entries are indices of
             // pre-existing data points in the reservoir that should
-            // be kept.
+            // be kept, in increasing order.
             // The indices are 0 based and are in terms of the
             // location of a data point in the reservoir before
             // 'keep_n_append' is called.
@@ -182,7 +405,9 @@ class weighted_reservoir
 
 
         void remove_n_inject(
-                size_t n_provided
+                size_t n_provided,
+                double const * u = nullptr
+                    // As in 'keep_n_append'.
                 );
 
         // Used the following functions after 'removed_n_inject'.
@@ -218,6 +443,115 @@ class weighted_reservoir
             // specified by 'idx_injected'.
 
 
+        bool shrink_to(size_t cap);
+            // Reduce the capacity to 'cap'. If the reservoir holds more
+            // than 'cap' data points, the 'cap' with the highest
+            // priority keys stay, as if 'keep_n_append' had been
+            // called with the smaller capacity and no new data points.
+            // Afterwards, 'n_kept', 'idx_kept' and 'move_plan' tell how
+            // to rearrange the user data (in either mode), before the
+            // user storage is reduced; 'n_appended' is 0.
+            // The internal arrays are reallocated at the new size.
+            // Return 'false', and change nothing, if the resource of the
+            // state is not 'resizable'.
+        bool grow_to(size_t cap);
+            // Raise the capacity to 'cap', reallocating the internal
+            // arrays once; the data points stay where they are, as
+            // 'idx_kept' (all of them) and an empty 'move_plan' tell.
+            // If data points have been rejected before, new ones are
+            // admitted, until the reservoir is full, only if their keys
+            // exceed 'threshold()', which keeps the estimates valid.
+            // Return 'false' as 'shrink_to'.
+            // Once full, sampling goes on as usual.
+
+
+        bool retract(max_size_t grand_index);
+        size_t retract(size_t n, max_size_t const * grand_indices);
+            // Take data points back from the stream, e.g. deleted
+            // upstream; return how many of them were in the reservoir
+            // and have been removed. Those not in the reservoir, or
+            // not yet offered, are ignored.
+            // Survivors stay in the sample with unchanged inclusion
+            // probabilities given 'threshold()', so the estimates
+            // become those over the surviving stream. As after
+            // 'grow_to', new data points then fill the freed slots
+            // only if their keys exceed the threshold, which plays the
+            // part of the compensation in random pairing (Gemulla et
+            // al. 2006).
+            // Afterwards, as after 'shrink_to', 'n_kept', 'idx_kept'
+            // and 'move_plan' tell how to compact the survivors to the
+            // front in increasing order of their old locations;
+            // 'n_appended' is 0.
+            // Constant expected time per data point to find it with
+            // 'enable_slot_index', otherwise a scan of the reservoir;
+            // then one pass to compact.
+
+
+        /*
+         * Incremental ingestion of a large batch, for callers that
+         * cannot be blocked for the whole of it, e.g. an event loop.
+         *
+         *   reservoir.begin_batch(n);
+         *   while (!reservoir.step_for(0.002))
+         *   {
+         *       // apply 'move_plan()' with the batch; serve readers
+         *   }
+         *   // apply 'move_plan()' of the last step
+         *
+         * Each step is a sampling call, in the mode given to
+         * 'begin_batch', over the next data points of the batch; it
+         * leaves the reservoir complete and readable, and the views
+         * and 'move_plan' describe that step, with indices of new data
+         * points counted from the start of the batch (hence 'batch'
+         * in 'apply_plan' is the whole batch). The result is that of
+         * calling 'keep_n_append' or 'remove_n_inject' once per step;
+         * for 'alpha = 0' it is the same sample as one call with the
+         * whole batch. Steps of at least a few times 'capacity' data
+         * points cost about as much per data point as one call.
+         */
+        void begin_batch(
+                size_t n_provided,
+                bool keep = true
+                    // 'keep_n_append' if true, else 'remove_n_inject'.
+                );
+        bool step(size_t max_items);
+            // Take up to 'max_items' more data points of the batch.
+            // Return true once the batch is done.
+        bool step_for(double seconds);
+            // As 'step', with as many data points as are expected to
+            // take 'seconds', by the time per data point measured over
+            // the earlier steps of this reservoir; the first step
+            // takes '3 * capacity', and none fewer than 'capacity',
+            // which sets the shortest pause this can achieve.
+        size_t batch_remaining() const;
+            // Data points of the batch not yet taken; 0 if none is
+            // under way.
+
+
+        void bulk_append(
+                size_t n_provided,
+                unsigned n_threads = 0
+                    // 0 for 'std::thread::hardware_concurrency()'.
+                );
+            // As 'keep_n_append(n_provided)' on an empty reservoir,
+            // e.g. to load a historical data set at once, with the
+            // work shared among 'n_threads' threads: each draws the
+            // uniforms and ranks the keys of a contiguous share of the
+            // data points, keeping its 'capacity' best; one final
+            // selection over those gives the sample and the threshold.
+            // The keys, on the landmark and scale of the whole load,
+            // are those of 'keep_n_append', so the sample and the
+            // state that later calls go on from are distributed as
+            // after 'keep_n_append'; the random stream differs. Share
+            // 'i' is drawn from an engine seeded by
+            // 'thread_seed(s, i + 1)', with 's' drawn from
+            // 'global_urng()' of the caller.
+            // The views and 'move_plan' are those of 'keep_n_append',
+            // with the new data points in increasing order.
+            // Each thread needs a workspace of '2 * capacity'
+            // candidates of 24 bytes.
+
+
         max_size_t grand_total() const;
             // Total number of data points ever offered to the
             // reservoir. Of these, up to 'capacity' have been chosen to
@@ -238,6 +572,95 @@ class weighted_reservoir
             // 'reservoir.grand_total() - 1'.
 
 
+        reservoir_move_plan move_plan() const;
+            // The rearrangement of user data implied by the last call
+            // to 'keep_n_append' or 'remove_n_inject', in either mode;
+            // an alternative to the four index views above.
+            // Valid until the next such call.
+
+
+        void enable_slot_index(bool on = true);
+            // Maintain an index from the grand index of each data
+            // point in the reservoir to its location, updated
+            // incrementally by 'keep_n_append' and 'remove_n_inject'.
+            // Off by default; costs about '32 * capacity' bytes, plus
+            // a copy of 'idx_current' per sampling call.
+        bool slot_index_enabled() const;
+
+        size_t slot_of(max_size_t grand_index) const;
+            // Location of the data point 'grand_index' in the
+            // reservoir, in constant expected time, or 'size_t(-1)'
+            // if it is not in the reservoir.
+            // Requires 'enable_slot_index'.
+
+
+        /*
+         * Estimation of aggregates over the whole stream from the
+         * sample.
+         *
+         * A data point 't' has weight
+         *   w(t) = ((t - ref_L) / (grand_total - ref_L))^alpha,
+         * and is in the reservoir iff its key 'w(t) / u' exceeds the
+         * threshold 'tau', the largest key ever rejected, on the
+         * current scale of the weights. Given 'tau', data point 't'
+         * is included with probability 'p(t) = min(1, w(t) / tau)'
+         * (Alon et al.; Duffield, Lund, Thorup); weighting each
+         * sampled value by '1 / p' gives unbiased subset sums.
+         * For 'alpha > 0', the data point 'ref_L' itself has weight 0
+         * and is never sampled, hence is missing from the estimates.
+         *
+         * This is exact for 'alpha = 0', and for 'alpha > 0' as long
+         * as 'ref_L' stays put. When 'ref_L' moves, the keys of
+         * rejected data points no longer scale uniformly, and the
+         * carried-over threshold is an approximation.
+         */
+
+        void enable_estimates(bool on = true);
+            // Maintain the weights of the data points in the
+            // reservoir, updated incrementally by 'keep_n_append' and
+            // 'remove_n_inject' along with the move plan.
+            // Off by default; costs '8 * capacity' bytes.
+        bool estimates_enabled() const;
+
+        double threshold() const;
+            // 'tau' above; 0 until the reservoir has overflowed, in
+            // which case every data point has been kept.
+
+        // Of the data point in location 'slot' of the reservoir.
+        // Require 'enable_estimates'.
+        double inclusion_probability(size_t slot) const;
+        double adjusted_weight(size_t slot) const;
+            // 'max(w, tau)', i.e. 'w / p'.
+
+        // 'values' has one entry per location in the reservoir, in
+        // the order of 'idx_current'; 'mask', if not 'nullptr',
+        // likewise, and selects the data points with a nonzero entry
+        // (e.g. those satisfying a predicate).
+        // Require 'enable_estimates'. O(size()), with no branches in
+        // the loops.
+        reservoir_estimate estimate_sum(
+                double const * values,
+                unsigned char const * mask = nullptr) const;
+            // Sum of the values over all data points ever offered.
+        reservoir_estimate estimate_count(
+                unsigned char const * mask = nullptr) const;
+            // Number of data points ever offered in the subset.
+        reservoir_estimate estimate_mean(
+                double const * values,
+                unsigned char const * mask = nullptr) const;
+            // Ratio of the above two; the variance is that of the
+            // linearization (delta method).
+
+
+        reservoir_stats stats() const;
+            // Snapshot of the runtime statistics.
+            // All zero unless compiled with 'RESERVOIR_STATS'.
+        void reset_stats();
+
+        static bool stats_enabled();
+            // Whether the library was compiled with 'RESERVOIR_STATS'.
+
+
         herr_t export_to_file(char const * file_name) const;
         herr_t export_to_file(hid_t loc_id, char const * obj_name) const;
 
@@ -249,7 +672,8 @@ class weighted_reservoir
         double _alpha = 0.;
         size_t _capacity = 0;
             // _alpha and _capacity are set at object initiation
-            // or upon import from disk file.
+            // or upon import from disk file; _capacity also changes by
+            // 'shrink_to' and 'grow_to'.
             // Otherwise they are constant during the lifetime of the
             // class object.
 
@@ -257,8 +681,11 @@ class weighted_reservoir
         max_size_t _grand_total = 0;
         max_size_t _ref_L = 0;
 
-        std::unique_ptr<max_size_t[]> _chosen_times = nullptr;
-        std::unique_ptr<double[]> _chosen_u = nullptr;
+        reservoir_memory_resource * _resource = default_reservoir_resource();
+        reservoir_memory_resource * _workspace_resource = default_reservoir_resource();
+
+        reservoir_array<max_size_t> _chosen_times;
+        reservoir_array<double> _chosen_u;
 
         // The following objects will not be exported to disk files
         // b/c they are of a temporary nature.
@@ -279,15 +706,247 @@ class weighted_reservoir
             // reservoir depends on the value of '_kept_or_removed'.
         size_t _n_kept_or_removed = 0;
         size_t _n_appended_or_injected = 0;
-        std::unique_ptr<size_t[]> _idx_kept_or_removed;
-        std::unique_ptr<size_t[]> _idx_appended_or_injected;
+        reservoir_array<size_t> _idx_kept_or_removed;
+        reservoir_array<size_t> _idx_appended_or_injected;
+
+        reservoir_array<reservoir_move> _moves;
+        size_t _n_relocations = 0;
+        size_t _n_insertions = 0;
+
+        struct slot_index_entry
+        {
+            max_size_t time;
+            size_t slot;
+        };
+
+        reservoir_array<slot_index_entry> _slot_index;
+            // 'nullptr' unless 'enable_slot_index'.
+        reservoir_array<max_size_t> _slot_index_times;
+        size_t _slot_index_mask = 0;
+        unsigned _slot_index_shift = 0;
 
+        void build_slot_index();
+        void slot_index_insert(max_size_t, size_t);
+        size_t slot_index_find(max_size_t) const;
+        void slot_index_erase(max_size_t);
+        void update_slot_index(size_t, max_size_t);
+
+        double _threshold = 0.;
+            // On the scale of the weights at the end of the last call.
+
+        reservoir_array<double> _weights;
+            // 'nullptr' unless 'enable_estimates'.
+            // '((t - _ref_L) / _weights_scale)^alpha' for each data
+            // point 't' in the reservoir; unlike the normalized weights,
+            // these stay valid across calls until '_ref_L' moves.
+        max_size_t _weights_scale = 0;
+
+        void build_weights();
+        void update_weights(max_size_t, max_size_t);
+        void update_threshold(max_size_t, size_t, double);
+        double weights_threshold() const;
+
+        reservoir_stats _stats;
+            // Always present so that the object layout does not depend
+            // on 'RESERVOIR_STATS'.
+
+        size_t _batch_remaining = 0;
+        size_t _batch_done = 0;
+        bool _batch_keep = true;
+        double _batch_ns_per_item = 0.;
+            // Of the last 'step_for'; 0 before the first.
+
+
+        typedef std::tuple<size_t, max_size_t, double, double> workspace_entry;
+            // < index, grand index, u, key >, as 'reservoir_candidate'.
+
+        reservoir_array<workspace_entry> _workspace;
+        size_t _workspace_len = 0;
+
+        workspace_entry * workspace();
+
+        void reallocate(size_t);
 
         herr_t export_to_file(hid_t) const;
         herr_t import_from_file(hid_t);
+
+        friend herr_t export_reservoirs(
+                hid_t, char const *, weighted_reservoir const * const *, size_t);
+        friend herr_t import_reservoirs(
+                hid_t, char const *, std::vector<weighted_reservoir> &);
 };
 
 
 
+// Accessors, inline so that a caller's loop over calls does not pay a
+// call into the library for each.
+
+inline bool weighted_reservoir::empty() const
+{
+    return
+        _current_size == 0 &&
+        _grand_total == 0 &&
+        _ref_L == 0;
+}
+
+inline double weighted_reservoir::alpha() const
+{
+    return _alpha;
+}
+
+inline size_t weighted_reservoir::capacity() const
+{
+    return _capacity;
+}
+
+inline max_size_t weighted_reservoir::grand_total() const
+{
+    return _grand_total;
+}
+
+inline size_t weighted_reservoir::size() const
+{
+    return _current_size;
+}
+
+inline max_size_t const * weighted_reservoir::idx_current() const
+{
+    if (_current_size > 0)
+        return _chosen_times.get();
+    else
+        return nullptr;
+}
+
+inline double weighted_reservoir::threshold() const
+{
+    return _threshold;
+}
+
+
+
+
+/*
+ * Apply a 'reservoir_move_plan' to user data of the reservoir, 'data',
+ * given the data of the new data points, 'batch', that were provided
+ * to the call that produced the plan.
+ *
+ * The source of a move a few moves ahead is prefetched, which hides
+ * most of the latency of the random reads when the arrays are much
+ * larger than the cache.
+ */
+
+inline void reservoir_prefetch(void const * p)
+{
+#if defined(__GNUC__)
+    __builtin_prefetch(p);
+#endif
+}
+
+
+// One element of type 'T' per data point, contiguous.
+template<typename T>
+void apply_plan(reservoir_move_plan const & plan, T * data, T const * batch)
+{
+    const size_t ahead = 8;
+    reservoir_move const * m = plan.moves;
+    const size_t n = plan.n_relocations;
+    for (size_t i = 0; i < n; ++i)
+    {
+        if (i + ahead < n)
+            reservoir_prefetch(data + m[i + ahead].src);
+        data[m[i].dst] = data[m[i].src];
+    }
+
+    m += n;
+    const size_t k = plan.n_insertions;
+    for (size_t i = 0; i < k; ++i)
+    {
+        if (i + ahead < k)
+            reservoir_prefetch(batch + m[i + ahead].src);
+        data[m[i].dst] = batch[m[i].src];
+    }
+}
+
+
+// 'row_bytes' bytes per data point, copied by 'memcpy', with data
+// point 'i' starting at byte 'i * data_stride' of 'data' and
+// 'i * batch_stride' of 'batch'. Strides must be at least 'row_bytes'.
+inline void apply_plan(
+        reservoir_move_plan const & plan,
+        void * data, size_t data_stride,
+        void const * batch, size_t batch_stride,
+        size_t row_bytes)
+{
+    assert(data_stride >= row_bytes && batch_stride >= row_bytes);
+
+    const size_t ahead = 8;
+    char * d = static_cast<char *>(data);
+    char const * b = static_cast<char const *>(batch);
+    reservoir_move const * m = plan.moves;
+    const size_t n = plan.n_relocations;
+    for (size_t i = 0; i < n; ++i)
+    {
+        if (i + ahead < n)
+            reservoir_prefetch(d + m[i + ahead].src * data_stride);
+        std::memcpy(d + m[i].dst * data_stride, d + m[i].src * data_stride, row_bytes);
+    }
+
+    m += n;
+    const size_t k = plan.n_insertions;
+    for (size_t i = 0; i < k; ++i)
+    {
+        if (i + ahead < k)
+            reservoir_prefetch(b + m[i + ahead].src * batch_stride);
+        std::memcpy(d + m[i].dst * data_stride, b + m[i].src * batch_stride, row_bytes);
+    }
+}
+
+
+
+
+/*
+ * Bulk export/import of many reservoirs into one HDF5 object.
+ *
+ * 'export_to_file' writes a group with seven datasets per reservoir,
+ * five of which hold a single number; for many thousands of
+ * reservoirs the HDF5 metadata dominates both time and file size.
+ * The functions below write all reservoirs in one pass into a single
+ * group 'obj_name' (or directly into 'loc_id' if 'obj_name' is "."),
+ * which contains
+ *
+ *   'reservoirs'    compound dataset, one record per reservoir, with
+ *                   members 'alpha', 'capacity', 'current_size',
+ *                   'grand_total', 'ref_L', 'threshold';
+ *   'offsets'       'n + 1' entries; the slots of reservoir 'i' are
+ *                   entries 'offsets[i]' thru 'offsets[i+1] - 1' of
+ *                   the following two datasets;
+ *   'chosen_times'  concatenated '_chosen_times' of all reservoirs;
+ *   'chosen_u'      concatenated '_chosen_u' of all reservoirs.
+ *
+ * Only the first 'size()' slots of each reservoir are written.
+ */
+
+herr_t export_reservoirs(
+        hid_t loc_id, char const * obj_name,
+        weighted_reservoir const * const * reservoirs,
+        size_t n);
+herr_t export_reservoirs(
+        hid_t loc_id, char const * obj_name,
+        std::vector<weighted_reservoir> const & reservoirs);
+herr_t export_reservoirs(
+        char const * file_name,
+        std::vector<weighted_reservoir> const & reservoirs);
+
+// Upon success, 'reservoirs' is replaced by the imported reservoirs,
+// in the order they were exported.
+herr_t import_reservoirs(
+        hid_t loc_id, char const * obj_name,
+        std::vector<weighted_reservoir> & reservoirs);
+herr_t import_reservoirs(
+        char const * file_name,
+        std::vector<weighted_reservoir> & reservoirs);
+
+
+
 #endif  // RESERVOIR_H
 
@@ -0,0 +1,360 @@
+#ifndef RESERVOIR_CORE_H
+#define RESERVOIR_CORE_H
+
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <limits>
+#include <numeric>
+#include <random>
+#include <tuple>
+
+
+
+/*
+ * The sampling core of 'weighted_reservoir', as templates.
+ *
+ * 'weighted_reservoir' calls these with 'Index = size_t',
+ * 'Time = max_size_t', 'Key = double' and the engine of
+ * 'global_urng()'; its bookkeeping (views, move plan, slot index,
+ * weights) stays in libreservoir. A caller that keeps its own sample
+ * arrays may call them directly, e.g. with 32-bit indices, 'float'
+ * keys or an engine of its own, and have them inlined into its loop.
+ *
+ * 'Index' counts data points within a call and slots; 'Time' is a
+ * grand index; 'Key' is the type of uniforms, keys and thresholds.
+ *
+ * A key is '((t - ref_L) / (grand_total - ref_L + n_provided))^alpha / u'
+ * for grand index 't' and uniform 'u', with 'ref_L' the oldest grand
+ * index in the sample before the call (Efraimidis and Spirakis 2006,
+ * with forward decay).
+ *
+ * The optional 'Probe' of 'sample_inject' is told where its time goes;
+ * 'reservoir_no_probe' does nothing, and compiles away.
+ */
+
+
+// < index among the new data points or slot, grand index, u, key >
+template<typename Index, typename Time, typename Key>
+using reservoir_candidate = std::tuple<Index, Time, Key, Key>;
+
+
+
+struct reservoir_no_probe
+{
+    void ref_L(bool /* moved */) {}
+        // Once per call on a non-empty reservoir.
+    void mark() {}
+        // Start of a phase.
+    void keys() {}
+        // Time since the mark went to computing keys; mark again.
+    void select() {}
+        // Time since the mark went to selection; mark again.
+};
+
+
+
+// A key threshold of an earlier call, whose keys were scaled by
+// '1 / (old_total - old_ref_L)', on the scale of the keys of a call
+// with 'new_total' and 'new_ref_L'. Exact if the reference has not
+// moved, or for 'alpha = 0'.
+template<typename Time, typename Key>
+inline Key rescale_threshold(
+        Key threshold,
+        Time old_total, Time old_ref_L,
+        Time new_total, Time new_ref_L,
+        Key alpha)
+{
+    if (threshold == Key(0))
+        return Key(0);
+    Key scale = Key(old_total - old_ref_L) / Key(new_total - new_ref_L);
+    return threshold * std::pow(scale, alpha);
+}
+
+
+
+// Add new data points to the reservoir with bookkeeping
+// for the new data points; no sampling is involved b/c
+// the new total does not exceed the reservoir's capacity.
+// If 'threshold' is positive, data points have been rejected before
+// and the capacity has since been raised by 'grow_to'; then only those
+// whose key exceeds 'threshold', on the scale of this call's keys, are
+// admitted, so that the reservoir keeps holding exactly the data points
+// with keys above the threshold. Otherwise all are admitted.
+// Return the number admitted; their indices among the new data points
+// are placed in 'idx_admitted'.
+// The uniforms of the new data points are taken from 'uniforms' if not
+// 'nullptr', otherwise drawn from 'urng'.
+template<typename Index, typename Time, typename Key, typename URNG>
+Index direct_inject(
+        Time * const chosen_times,
+        Key * const chosen_u,
+        Index current_size,
+        Time grand_total,
+        const Index n_provided,
+        const Key alpha,
+        const Time ref_L,
+        const Key threshold,
+        Index * const idx_admitted,
+        Key const * const uniforms,
+        URNG & urng
+        )
+{
+    std::uniform_real_distribution<Key> urd{Key(0), Key(1)};
+
+    if (threshold == Key(0))
+    {
+        for (Index i = 0; i < n_provided; ++i)
+        {
+            chosen_times[current_size] = grand_total;
+                // The first one gets index '0'.
+            chosen_u[current_size] = uniforms ? uniforms[i] : urd(urng);
+            ++current_size;
+            ++grand_total;
+        }
+        std::iota(idx_admitted, idx_admitted + n_provided, Index(0));
+        return n_provided;
+    }
+
+    Key factor = Key(1) / Key(grand_total - ref_L + n_provided);
+    Index n = 0;
+    for (Index i = 0; i < n_provided; ++i)
+    {
+        auto u = uniforms ? uniforms[i] : urd(urng);
+        if (std::pow(Key(grand_total + i - ref_L) * factor, alpha) / u > threshold)
+        {
+            chosen_times[current_size + n] = grand_total + i;
+            chosen_u[current_size + n] = u;
+            idx_admitted[n] = i;
+            ++n;
+        }
+    }
+    return n;
+}
+
+
+
+// Added new data to the reservoir with sampling, b/c
+// the current size plus new data exceeds the reservoir's capacity.
+// Upon return, the workspace 'quad' contains most useful info to be
+// used for further processing: its first entries, as many as returned,
+// are the data points chosen, which is 'capacity' unless new data
+// points were rejected outright (see 'threshold').
+// The reservoir's state is barely changed within this function;
+// changes will be made after returning from this function.
+//
+// A new key is at most '1 / u', as '(t - ref_L) * factor < 1'. New data
+// points whose key, or that bound, does not exceed 'bound' below cannot
+// be chosen, and are dropped before 'pow' and before entering 'quad';
+// once the reservoir is full most new data points go this way, and cost
+// a uniform and a comparison.
+template<typename Index, typename Time, typename Key, typename URNG,
+        typename Probe = reservoir_no_probe>
+Index sample_inject(
+        Time const * const chosen_times,
+        Key const * const chosen_u,
+        const Index current_size,
+        const Time grand_total,
+        const Index n_provided,
+        const Index capacity,
+        const Key alpha,
+        Time & _ref_L,
+        reservoir_candidate<Index, Time, Key> * const quad,
+            // Pre-allocated workspace, size should be at least
+            //   current_size + n_provided
+            // Upon return, its content is used for subsequent
+            // processing.
+        const Index quad_len,
+        Key & threshold,
+            // On input, the threshold of earlier calls on the scale of
+            // their keys, or '0'; new data points whose keys do not
+            // exceed it are rejected outright. Upon return, the largest
+            // key rejected so far, on the scale of this call's keys.
+        Key const * const uniforms,
+            // As in 'direct_inject'.
+        URNG & urng,
+        Probe probe = Probe()
+        )
+{
+    typedef reservoir_candidate<Index, Time, Key> candidate_t;
+
+    assert(quad_len > capacity);
+
+    std::uniform_real_distribution<Key> urd{Key(0), Key(1)};
+
+    probe.mark();
+
+    const Time old_ref_L = _ref_L;
+    if (current_size  > 0)
+    {
+        Time L = *std::min_element(chosen_times, chosen_times + current_size);
+        probe.ref_L(L != _ref_L);
+        _ref_L = L;
+    }
+
+    Key factor = Key(1) / Key(grand_total - _ref_L + n_provided);
+
+    threshold = rescale_threshold(threshold, grand_total, old_ref_L,
+            Time(grand_total + n_provided), _ref_L, alpha);
+    const Key floor = (current_size < capacity) ? threshold : Key(0);
+        // Positive only after 'grow_to', while the reservoir is not
+        // yet full. A full reservoir is ranked by keys alone, as ever.
+
+    Key min_key = std::numeric_limits<Key>::infinity();
+    for (Index i = 0; i < current_size; ++i)
+    {
+        quad[i] = candidate_t(
+                i,     // Index in existing data.
+                chosen_times[i],  // Grand index in entire history.
+                chosen_u[i],
+                std::pow(Key(chosen_times[i] - _ref_L) * factor, alpha) / chosen_u[i]
+                );
+            // FIXME: if _ref_L has not changed recently,
+            // some speed improvement is possible here, b/c the pow does
+            // not change except for a scaling.
+        min_key = std::min(min_key, std::get<3>(quad[i]));
+    }
+
+    Key bound = floor;
+    if (current_size == capacity)
+        bound = std::min(threshold, min_key);
+        // A key not above every pre-existing one loses to all of them,
+        // and one not above 'threshold' leaves the threshold as is;
+        // the rescaled threshold alone is not enough, as it may exceed
+        // pre-existing keys if '_ref_L' has moved.
+
+    probe.keys();
+
+
+    Time idx_grand = grand_total;
+    Time ref_diff = idx_grand - _ref_L;
+    Index idx_0 = current_size;
+    Index idx_new = 0;
+
+    while (idx_new < n_provided)
+    {
+        probe.mark();
+
+        Index idx = idx_0;
+        while (idx < quad_len)
+        {
+            auto u = uniforms ? uniforms[idx_new] : urd(urng);
+            if (bound == Key(0) || Key(1) / u > bound)
+            {
+                auto key = std::pow(Key(ref_diff) * factor, alpha) / u;
+                if (bound == Key(0) || key > bound)
+                {
+                    quad[idx] = candidate_t(
+                            idx_new,
+                            idx_grand,
+                            u,
+                            key
+                            );
+                    ++idx;
+                }
+            }
+            ++idx_new;
+            if (idx_new == n_provided)
+                break;
+            ++idx_grand;
+            ++ref_diff;
+        }
+
+        probe.keys();
+
+        if (idx <= capacity)
+        {
+            // Only if new data points were dropped by 'bound'; nothing
+            // to select from yet.
+            idx_0 = idx;
+            continue;
+        }
+
+        // Place the 'capacity' number of elements with the largest 'pow/u'
+        // value at the front; these are the elements to stay in the
+        // reservoir.
+        std::nth_element(
+                quad,
+                quad + capacity,
+                quad + idx,
+                [](candidate_t const & x, candidate_t const & y)
+                {  return std::get<3>(x) > std::get<3>(y); });
+
+        threshold = std::max(threshold, std::get<3>(quad[capacity]));
+            // Elements after 'capacity' are rejected, and none has a
+            // larger key.
+        bound = std::max(bound, std::get<3>(quad[capacity]));
+            // 'capacity' data points seen so far have larger keys.
+
+        probe.select();
+
+        idx_0 = capacity;
+    }
+
+    return idx_0;
+}
+
+
+
+// A candidate of 'bulk_select'.
+template<typename Time, typename Key>
+struct reservoir_bulk_candidate
+{
+    Time t;
+    Key u;
+    Key key;
+};
+
+
+// Of the data points 't = begin .. end' of a bulk load into an empty
+// reservoir, with key scale 'factor', the 'capacity' with the largest
+// keys, drawn from 'urng', into 'c[0 .. returned)'. 'rejected' is
+// raised to the largest key rejected. As 'sample_inject' into an empty
+// reservoir, with a workspace of 'c_len > capacity'.
+template<typename Index, typename Time, typename Key, typename URNG>
+Index bulk_select(
+        Time begin, Time end,
+        Key factor, Key alpha, Index capacity,
+        URNG & urng,
+        reservoir_bulk_candidate<Time, Key> * c, Index c_len,
+        Key & rejected)
+{
+    typedef reservoir_bulk_candidate<Time, Key> candidate_t;
+
+    std::uniform_real_distribution<Key> urd{Key(0), Key(1)};
+    auto by_key = [](candidate_t const & x, candidate_t const & y)
+        { return x.key > y.key; };
+
+    Index m = 0;
+    Key bound = Key(0);
+    for (Time t = begin; t < end; ++t)
+    {
+        auto u = urd(urng);
+        if (bound != Key(0) && Key(1) / u <= bound)
+            continue;
+        auto key = std::pow(Key(t) * factor, alpha) / u;
+            // 'ref_L' is 0.
+        if (bound != Key(0) && key <= bound)
+            continue;
+        c[m++] = candidate_t{t, u, key};
+        if (m == c_len)
+        {
+            std::nth_element(c, c + capacity, c + m, by_key);
+            rejected = std::max(rejected, c[capacity].key);
+            bound = c[capacity].key;
+            m = capacity;
+        }
+    }
+    if (m > capacity)
+    {
+        std::nth_element(c, c + capacity, c + m, by_key);
+        rejected = std::max(rejected, c[capacity].key);
+        m = capacity;
+    }
+    return m;
+}
+
+
+
+#endif  // RESERVOIR_CORE_H
@@ -0,0 +1,329 @@
+#include "reservoir_snapshot.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+
+
+struct reservoir_snapshot_data
+{
+    mutable std::atomic<size_t> refs{0};
+    uint64_t retired_epoch = 0;
+
+    uint64_t version = 0;
+    double alpha = 0.;
+    size_t capacity = 0;
+    max_size_t grand_total = 0;
+    std::vector<max_size_t> idx_current;
+    size_t payload_bytes = 0;
+    std::vector<char> payload;
+        // The vectors keep their capacity when the buffer is reused,
+        // hence a reused buffer does not allocate.
+};
+
+
+
+// 'epoch' is 0 while the reader is not inside 'acquire'.
+// Padded to a cache line so that readers do not share lines.
+struct reservoir_snapshot_publisher::reader_slot
+{
+    std::atomic<uint64_t> epoch{0};
+    std::atomic<bool> in_use{false};
+    char unused[64 - sizeof(std::atomic<uint64_t>) - sizeof(std::atomic<bool>)];
+};
+
+
+
+
+/// reservoir_snapshot
+
+
+reservoir_snapshot::reservoir_snapshot()
+{
+}
+
+
+reservoir_snapshot::reservoir_snapshot(reservoir_snapshot_data const * data)
+    : _data(data)
+{
+}
+
+
+reservoir_snapshot::~reservoir_snapshot()
+{
+    if (_data != nullptr)
+        _data->refs.fetch_sub(1, std::memory_order_release);
+}
+
+
+reservoir_snapshot::reservoir_snapshot(reservoir_snapshot && other)
+    : _data(other._data)
+{
+    other._data = nullptr;
+}
+
+
+reservoir_snapshot & reservoir_snapshot::operator=(reservoir_snapshot && other)
+{
+    if (this != &other)
+    {
+        if (_data != nullptr)
+            _data->refs.fetch_sub(1, std::memory_order_release);
+        _data = other._data;
+        other._data = nullptr;
+    }
+    return *this;
+}
+
+
+bool reservoir_snapshot::valid() const
+{
+    return _data != nullptr;
+}
+
+
+uint64_t reservoir_snapshot::version() const
+{
+    return _data->version;
+}
+
+
+double reservoir_snapshot::alpha() const
+{
+    return _data->alpha;
+}
+
+
+size_t reservoir_snapshot::capacity() const
+{
+    return _data->capacity;
+}
+
+
+size_t reservoir_snapshot::size() const
+{
+    return _data->idx_current.size();
+}
+
+
+max_size_t reservoir_snapshot::grand_total() const
+{
+    return _data->grand_total;
+}
+
+
+max_size_t const * reservoir_snapshot::idx_current() const
+{
+    return _data->idx_current.data();
+}
+
+
+size_t reservoir_snapshot::payload_bytes() const
+{
+    return _data->payload_bytes;
+}
+
+
+void const * reservoir_snapshot::payload(size_t slot) const
+{
+    assert(slot < this->size());
+    return _data->payload.data() + slot * _data->payload_bytes;
+}
+
+
+
+
+/// reservoir_snapshot_reader
+
+
+reservoir_snapshot_reader::reservoir_snapshot_reader()
+{
+}
+
+
+reservoir_snapshot_reader::~reservoir_snapshot_reader()
+{
+    if (_publisher != nullptr)
+        _publisher->unregister(_slot);
+}
+
+
+reservoir_snapshot_reader::reservoir_snapshot_reader(reservoir_snapshot_reader && other)
+    : _publisher(other._publisher), _slot(other._slot)
+{
+    other._publisher = nullptr;
+}
+
+
+reservoir_snapshot_reader & reservoir_snapshot_reader::operator=(reservoir_snapshot_reader && other)
+{
+    if (this != &other)
+    {
+        if (_publisher != nullptr)
+            _publisher->unregister(_slot);
+        _publisher = other._publisher;
+        _slot = other._slot;
+        other._publisher = nullptr;
+    }
+    return *this;
+}
+
+
+bool reservoir_snapshot_reader::valid() const
+{
+    return _publisher != nullptr;
+}
+
+
+reservoir_snapshot reservoir_snapshot_reader::acquire()
+{
+    assert(this->valid());
+    return _publisher->acquire(_slot);
+}
+
+
+
+
+/// reservoir_snapshot_publisher
+
+
+reservoir_snapshot_publisher::reservoir_snapshot_publisher(size_t max_readers)
+    : _slots(new reader_slot[max_readers]), _n_slots(max_readers), _epoch(1), _current(nullptr)
+{
+    // Version 0: an empty sample, so that 'acquire' always succeeds.
+    _buffers.emplace_back(new reservoir_snapshot_data());
+    _current.store(_buffers.back().get(), std::memory_order_release);
+}
+
+
+reservoir_snapshot_publisher::~reservoir_snapshot_publisher()
+{
+}
+
+
+
+
+reservoir_snapshot_reader reservoir_snapshot_publisher::register_reader()
+{
+    reservoir_snapshot_reader r;
+    for (size_t i = 0; i < _n_slots; ++i)
+    {
+        bool expected = false;
+        if (_slots[i].in_use.compare_exchange_strong(expected, true))
+        {
+            r._publisher = this;
+            r._slot = i;
+            break;
+        }
+    }
+    return r;
+}
+
+
+void reservoir_snapshot_publisher::unregister(size_t slot)
+{
+    _slots[slot].epoch.store(0, std::memory_order_release);
+    _slots[slot].in_use.store(false, std::memory_order_release);
+}
+
+
+
+
+reservoir_snapshot reservoir_snapshot_publisher::acquire(size_t slot)
+{
+    // The announcement must be visible to the writer before the
+    // pointer is loaded; both are sequentially consistent.
+    _slots[slot].epoch.store(_epoch.load(std::memory_order_seq_cst), std::memory_order_seq_cst);
+    reservoir_snapshot_data * p = _current.load(std::memory_order_seq_cst);
+    p->refs.fetch_add(1, std::memory_order_relaxed);
+    _slots[slot].epoch.store(0, std::memory_order_release);
+    return reservoir_snapshot(p);
+}
+
+
+
+
+void reservoir_snapshot_publisher::publish(
+        weighted_reservoir const & reservoir,
+        void const * payload,
+        const size_t payload_bytes)
+{
+    this->reclaim();
+
+    reservoir_snapshot_data * p;
+    if (!_free.empty())
+    {
+        p = _free.back();
+        _free.pop_back();
+    } else
+    {
+        _buffers.emplace_back(new reservoir_snapshot_data());
+        p = _buffers.back().get();
+    }
+
+    const size_t n = reservoir.size();
+    auto idx = reservoir.idx_current();
+    p->version = ++_version;
+    p->alpha = reservoir.alpha();
+    p->capacity = reservoir.capacity();
+    p->grand_total = reservoir.grand_total();
+    p->idx_current.assign(idx, idx + n);
+    if (payload != nullptr)
+    {
+        char const * src = static_cast<char const *>(payload);
+        p->payload_bytes = payload_bytes;
+        p->payload.assign(src, src + n * payload_bytes);
+    } else
+    {
+        p->payload_bytes = 0;
+        p->payload.clear();
+    }
+    p->refs.store(0, std::memory_order_relaxed);
+
+    reservoir_snapshot_data * old = _current.exchange(p, std::memory_order_seq_cst);
+    old->retired_epoch = _epoch.fetch_add(1, std::memory_order_seq_cst);
+        // Readers announcing an epoch after this one load the pointer
+        // after the exchange, hence cannot see 'old'.
+    _retired.push_back(old);
+}
+
+
+
+
+void reservoir_snapshot_publisher::reclaim()
+{
+    if (_retired.empty())
+        return;
+
+    uint64_t min_epoch = UINT64_MAX;
+    for (size_t i = 0; i < _n_slots; ++i)
+    {
+        uint64_t e = _slots[i].epoch.load(std::memory_order_seq_cst);
+        if (e != 0)
+            min_epoch = std::min(min_epoch, e);
+    }
+
+    size_t j = 0;
+    for (size_t i = 0; i < _retired.size(); ++i)
+    {
+        reservoir_snapshot_data * p = _retired[i];
+        if (p->retired_epoch < min_epoch && p->refs.load(std::memory_order_acquire) == 0)
+            _free.push_back(p);
+        else
+            _retired[j++] = p;
+    }
+    _retired.resize(j);
+}
+
+
+uint64_t reservoir_snapshot_publisher::version() const
+{
+    return _version;
+}
+
+
+size_t reservoir_snapshot_publisher::n_buffers() const
+{
+    return _buffers.size();
+}
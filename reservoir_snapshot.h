@@ -0,0 +1,173 @@
+#ifndef RESERVOIR_SNAPSHOT_H
+#define RESERVOIR_SNAPSHOT_H
+
+
+#include "reservoir.h"
+
+#include <atomic>
+#include <cstddef>    // size_t
+#include <cstdint>    // uint64_t
+#include <memory>
+#include <vector>
+
+
+
+/*
+ * Immutable snapshots of a 'weighted_reservoir' for reader threads,
+ * published by the ingesting thread, in the manner of RCU.
+ *
+ * 'keep_n_append' and 'remove_n_inject' rearrange '_chosen_times' in
+ * place, so another thread reading 'idx_current()' meanwhile sees a
+ * torn state. Instead, after each ingestion the writer calls
+ * 'publish', which copies the sample (and optionally a fixed-size
+ * payload per data point) into a snapshot buffer and swaps it in as
+ * the current version with one atomic pointer exchange. Readers
+ * 'acquire' the current version as a reference-counted, read-only
+ * 'reservoir_snapshot' and may hold it for as long as they like.
+ *
+ * A reader's acquire is: announce the global epoch in its slot, load
+ * the current pointer, increment the reference count, clear the slot.
+ * A version replaced by 'publish' is retired with the epoch at
+ * replacement; it is reused for a later version once no reader slot
+ * announces an epoch up to that one (no reader can still be between
+ * loading the pointer and incrementing the count) and its reference
+ * count is zero. Reclamation is attempted by 'publish' and never waits:
+ * ingestion is not blocked by readers, and readers never block.
+ *
+ * There is one writer per publisher. The publisher must outlive its
+ * readers and every snapshot acquired from it.
+ */
+
+
+struct reservoir_snapshot_data;
+class reservoir_snapshot_publisher;
+
+
+
+// A read-only version of the sample. Move-only; releases the version
+// upon destruction.
+class reservoir_snapshot
+{
+    public:
+        reservoir_snapshot();
+        ~reservoir_snapshot();
+
+        reservoir_snapshot(reservoir_snapshot &&);
+        reservoir_snapshot & operator=(reservoir_snapshot &&);
+
+        reservoir_snapshot(reservoir_snapshot const &) = delete;
+        reservoir_snapshot & operator=(reservoir_snapshot const &) = delete;
+
+        bool valid() const;
+
+        uint64_t version() const;
+            // Number of 'publish' calls that produced this snapshot;
+            // 0 before the first one.
+
+        double alpha() const;
+        size_t capacity() const;
+        size_t size() const;
+        max_size_t grand_total() const;
+
+        max_size_t const * idx_current() const;
+            // 'size()' entries, as 'weighted_reservoir::idx_current'.
+
+        size_t payload_bytes() const;
+        void const * payload(size_t slot) const;
+
+    private:
+        explicit reservoir_snapshot(reservoir_snapshot_data const *);
+
+        reservoir_snapshot_data const * _data = nullptr;
+
+        friend class reservoir_snapshot_publisher;
+};
+
+
+
+// A registered reader thread. Obtain from
+// 'reservoir_snapshot_publisher::register_reader' and use from one
+// thread at a time.
+class reservoir_snapshot_reader
+{
+    public:
+        reservoir_snapshot_reader();
+        ~reservoir_snapshot_reader();
+
+        reservoir_snapshot_reader(reservoir_snapshot_reader &&);
+        reservoir_snapshot_reader & operator=(reservoir_snapshot_reader &&);
+
+        reservoir_snapshot_reader(reservoir_snapshot_reader const &) = delete;
+        reservoir_snapshot_reader & operator=(reservoir_snapshot_reader const &) = delete;
+
+        bool valid() const;
+            // 'false' if all reader slots of the publisher were taken.
+
+        reservoir_snapshot acquire();
+            // The current version. Wait-free.
+
+    private:
+        reservoir_snapshot_publisher * _publisher = nullptr;
+        size_t _slot = 0;
+
+        friend class reservoir_snapshot_publisher;
+};
+
+
+
+class reservoir_snapshot_publisher
+{
+    public:
+        explicit reservoir_snapshot_publisher(size_t max_readers = 64);
+        ~reservoir_snapshot_publisher();
+
+        reservoir_snapshot_publisher(reservoir_snapshot_publisher const &) = delete;
+        reservoir_snapshot_publisher & operator=(reservoir_snapshot_publisher const &) = delete;
+
+
+        // Publish the current sample of 'reservoir' as a new version.
+        // If 'payload' is not 'nullptr', it holds 'payload_bytes'
+        // bytes for each of the 'reservoir.size()' slots,
+        // consecutively, and is copied into the snapshot as well.
+        // Call from the writer thread only, between ingestions.
+        void publish(
+                weighted_reservoir const & reservoir,
+                void const * payload = nullptr,
+                size_t payload_bytes = 0);
+
+        // Claim a reader slot; thread safe.
+        reservoir_snapshot_reader register_reader();
+
+        uint64_t version() const;
+            // Version of the most recent 'publish'.
+
+        size_t n_buffers() const;
+            // Snapshot buffers allocated so far, current and retired
+            // ones included. Stays bounded when readers release their
+            // snapshots in time, b/c retired buffers are reused.
+
+    private:
+        struct reader_slot;
+
+        std::unique_ptr<reader_slot[]> _slots;
+        size_t _n_slots;
+
+        std::atomic<uint64_t> _epoch;
+        std::atomic<reservoir_snapshot_data *> _current;
+
+        // Writer-side only.
+        std::vector<std::unique_ptr<reservoir_snapshot_data>> _buffers;
+        std::vector<reservoir_snapshot_data *> _retired;
+        std::vector<reservoir_snapshot_data *> _free;
+        uint64_t _version = 0;
+
+        void reclaim();
+        reservoir_snapshot acquire(size_t slot);
+        void unregister(size_t slot);
+
+        friend class reservoir_snapshot_reader;
+};
+
+
+
+#endif  // RESERVOIR_SNAPSHOT_H
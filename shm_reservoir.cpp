@@ -0,0 +1,432 @@
+#include "shm_reservoir.h"
+
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <new>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+
+// Layout of the segment:
+//
+//   shm_reservoir_header
+//   arena      per-slot arrays of the 'weighted_reservoir'
+//   payload    capacity * payload_bytes
+//
+// The fields written by the writer after creation are atomic, so that
+// readers can load them without tearing while an update is going on;
+// a reader validates what it loaded against 'generation'.
+struct shm_reservoir_header
+{
+    char magic[8];
+    uint64_t capacity;
+    uint64_t payload_bytes;
+    double alpha;
+    uint64_t segment_bytes;
+    uint64_t arena_offset;
+    uint64_t arena_bytes;
+    uint64_t payload_offset;
+
+    alignas(64) std::atomic<uint64_t> generation;
+    std::atomic<uint64_t> current_size;
+    std::atomic<uint64_t> grand_total;
+    std::atomic<uint64_t> times_offset;
+        // Offset of 'idx_current' in the segment; 0 while empty.
+};
+
+static_assert(sizeof(max_size_t) == 8, "segment layout assumes 8-byte max_size_t");
+
+static const char shm_magic[8] = {'R', 'E', 'S', 'V', 'S', 'H', 'M', '1'};
+
+
+
+static size_t round_up(size_t n, size_t m)
+{
+    return (n + m - 1) / m * m;
+}
+
+
+
+// Bump allocation from the arena area of the segment, which is sized
+// for one set of the per-slot arrays of a 'weighted_reservoir'; nothing
+// is ever given back. The capacity in the header is fixed as well, so
+// the resource is not 'resizable': 'shrink_to' and 'grow_to' return
+// 'false', and an import with another capacity fails.
+class shm_reservoir_writer::arena_resource : public reservoir_memory_resource
+{
+    public:
+        arena_resource(char * base, size_t bytes) : _base(base), _bytes(bytes)
+        {
+        }
+
+        bool resizable() const
+        {
+            return false;
+        }
+
+        void * allocate(size_t bytes, size_t alignment)
+        {
+            size_t offset = round_up(_used, alignment);
+            if (offset + bytes > _bytes)
+                throw std::bad_alloc{};
+            _used = offset + bytes;
+            return _base + offset;
+        }
+
+        void deallocate(void *, size_t, size_t)
+        {
+        }
+
+    private:
+        char * _base;
+        size_t _bytes;
+        size_t _used = 0;
+};
+
+
+
+
+shm_reservoir_writer::shm_reservoir_writer()
+{
+}
+
+
+
+shm_reservoir_writer::~shm_reservoir_writer()
+{
+    this->close();
+}
+
+
+
+
+int shm_reservoir_writer::create(
+        char const * name,
+        const size_t cap,
+        const double alph,
+        const size_t payload_bytes)
+{
+    assert(alph >= 0.);
+    assert(cap > 0);
+
+    this->close();
+
+    const size_t arena_offset = round_up(sizeof(shm_reservoir_header), 64);
+    const size_t arena_bytes =
+        cap * (sizeof(max_size_t) + sizeof(double) + 2 * sizeof(size_t)) + 4 * 64;
+    const size_t payload_offset = round_up(arena_offset + arena_bytes, 64);
+    const size_t bytes = payload_offset + cap * payload_bytes;
+
+    ::shm_unlink(name);
+    _fd = ::shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (_fd < 0)
+        return -1;
+    _name = name;
+
+    if (::ftruncate(_fd, bytes) < 0)
+    {
+        this->unlink();
+        this->close();
+        return -1;
+    }
+
+    _map = ::mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+    if (_map == MAP_FAILED)
+    {
+        _map = nullptr;
+        this->unlink();
+        this->close();
+        return -1;
+    }
+    _map_bytes = bytes;
+
+    char * base = static_cast<char *>(_map);
+    _header = new (_map) shm_reservoir_header();
+    _header->capacity = cap;
+    _header->payload_bytes = payload_bytes;
+    _header->alpha = alph;
+    _header->segment_bytes = bytes;
+    _header->arena_offset = arena_offset;
+    _header->arena_bytes = arena_bytes;
+    _header->payload_offset = payload_offset;
+    _header->generation.store(0, std::memory_order_relaxed);
+    _payload = base + payload_offset;
+
+    _arena.reset(new arena_resource(base + arena_offset, arena_bytes));
+    _reservoir.reset(new weighted_reservoir(cap, alph, _arena.get(), default_reservoir_resource()));
+        // The sampling workspace is private to this process.
+    this->publish();
+
+    // Readers check the magic upon 'open'; write it last.
+    std::atomic_thread_fence(std::memory_order_release);
+    std::memcpy(_header->magic, shm_magic, sizeof(shm_magic));
+
+    return 0;
+}
+
+
+
+
+int shm_reservoir_writer::close()
+{
+    int status = 0;
+    _reservoir.reset();
+    _arena.reset();
+    if (_map != nullptr)
+    {
+        ::munmap(_map, _map_bytes);
+        _map = nullptr;
+        _map_bytes = 0;
+    }
+    if (_fd >= 0)
+    {
+        if (::close(_fd) < 0)
+            status = -1;
+        _fd = -1;
+    }
+    _header = nullptr;
+    _payload = nullptr;
+    return status;
+}
+
+
+
+int shm_reservoir_writer::unlink()
+{
+    if (_name.empty())
+        return 0;
+    int status = ::shm_unlink(_name.c_str());
+    _name.clear();
+    return status;
+}
+
+
+
+bool shm_reservoir_writer::is_open() const
+{
+    return _map != nullptr;
+}
+
+
+size_t shm_reservoir_writer::payload_bytes() const
+{
+    return _header->payload_bytes;
+}
+
+
+weighted_reservoir & shm_reservoir_writer::reservoir()
+{
+    return *_reservoir;
+}
+
+
+weighted_reservoir const & shm_reservoir_writer::reservoir() const
+{
+    return *_reservoir;
+}
+
+
+void * shm_reservoir_writer::payload(size_t slot)
+{
+    assert(slot < _reservoir->capacity());
+    return _payload + slot * _header->payload_bytes;
+}
+
+
+
+
+void shm_reservoir_writer::publish()
+{
+    char const * base = static_cast<char const *>(_map);
+    auto idx = _reservoir->idx_current();
+    _header->current_size.store(_reservoir->size(), std::memory_order_relaxed);
+    _header->grand_total.store(_reservoir->grand_total(), std::memory_order_relaxed);
+    _header->times_offset.store(
+            idx ? reinterpret_cast<char const *>(idx) - base : 0,
+            std::memory_order_relaxed);
+}
+
+
+
+void shm_reservoir_writer::begin_update()
+{
+    auto g = _header->generation.load(std::memory_order_relaxed);
+    assert(g % 2 == 0);
+    _header->generation.store(g + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+        // Keeps the following writes to the data from becoming visible
+        // before the odd generation.
+}
+
+
+
+void shm_reservoir_writer::end_update()
+{
+    this->publish();
+    auto g = _header->generation.load(std::memory_order_relaxed);
+    assert(g % 2 == 1);
+    _header->generation.store(g + 1, std::memory_order_release);
+}
+
+
+
+
+void shm_reservoir_writer::keep_n_append(const size_t n_provided, void const * payload)
+{
+    const size_t pb = _header->payload_bytes;
+    assert(payload != nullptr || pb == 0);
+    char const * src = static_cast<char const *>(payload);
+
+    this->begin_update();
+
+    _reservoir->keep_n_append(n_provided);
+    if (pb > 0)
+        apply_plan(_reservoir->move_plan(), _payload, pb, src, pb, pb);
+
+    this->end_update();
+}
+
+
+
+
+void shm_reservoir_writer::remove_n_inject(const size_t n_provided, void const * payload)
+{
+    const size_t pb = _header->payload_bytes;
+    assert(payload != nullptr || pb == 0);
+    char const * src = static_cast<char const *>(payload);
+
+    this->begin_update();
+
+    _reservoir->remove_n_inject(n_provided);
+    if (pb > 0)
+        apply_plan(_reservoir->move_plan(), _payload, pb, src, pb, pb);
+
+    this->end_update();
+}
+
+
+
+
+
+shm_reservoir_reader::shm_reservoir_reader()
+{
+}
+
+
+
+shm_reservoir_reader::~shm_reservoir_reader()
+{
+    this->close();
+}
+
+
+
+int shm_reservoir_reader::open(char const * name)
+{
+    this->close();
+
+    _fd = ::shm_open(name, O_RDONLY, 0);
+    if (_fd < 0)
+        return -1;
+
+    struct stat st;
+    if (::fstat(_fd, &st) < 0 || size_t(st.st_size) < sizeof(shm_reservoir_header))
+    {
+        this->close();
+        errno = EINVAL;
+        return -1;
+    }
+
+    void * map = ::mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, _fd, 0);
+    if (map == MAP_FAILED)
+    {
+        this->close();
+        return -1;
+    }
+    _map = map;
+    _map_bytes = st.st_size;
+    _header = static_cast<shm_reservoir_header const *>(_map);
+
+    if (std::memcmp(_header->magic, shm_magic, sizeof(shm_magic)) != 0
+            || _header->segment_bytes > _map_bytes)
+    {
+        this->close();
+        errno = EINVAL;
+        return -1;
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+
+    return 0;
+}
+
+
+
+int shm_reservoir_reader::close()
+{
+    int status = 0;
+    if (_map != nullptr)
+    {
+        ::munmap(const_cast<void *>(_map), _map_bytes);
+        _map = nullptr;
+        _map_bytes = 0;
+    }
+    if (_fd >= 0)
+    {
+        if (::close(_fd) < 0)
+            status = -1;
+        _fd = -1;
+    }
+    _header = nullptr;
+    return status;
+}
+
+
+
+bool shm_reservoir_reader::is_open() const
+{
+    return _map != nullptr;
+}
+
+
+uint64_t shm_reservoir_reader::generation() const
+{
+    return _header->generation.load(std::memory_order_acquire);
+}
+
+
+
+
+bool shm_reservoir_reader::begin_read(shm_reservoir_view & v) const
+{
+    v.generation = _header->generation.load(std::memory_order_acquire);
+    if (v.generation % 2 == 1)
+        return false;
+
+    char const * base = static_cast<char const *>(_map);
+    auto times_offset = _header->times_offset.load(std::memory_order_relaxed);
+
+    v.alpha = _header->alpha;
+    v.capacity = _header->capacity;
+    v.size = _header->current_size.load(std::memory_order_relaxed);
+    v.grand_total = _header->grand_total.load(std::memory_order_relaxed);
+    v.payload_bytes = _header->payload_bytes;
+    v.idx_current = times_offset
+        ? reinterpret_cast<max_size_t const *>(base + times_offset) : nullptr;
+    v.payload = base + _header->payload_offset;
+    return true;
+}
+
+
+
+bool shm_reservoir_reader::end_read(shm_reservoir_view const & v) const
+{
+    std::atomic_thread_fence(std::memory_order_acquire);
+        // Keeps the reads of the data by the callback from moving
+        // after the following load.
+    return _header->generation.load(std::memory_order_relaxed) == v.generation;
+}
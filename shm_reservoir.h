@@ -0,0 +1,196 @@
+#ifndef SHM_RESERVOIR_H
+#define SHM_RESERVOIR_H
+
+
+#include "reservoir.h"
+
+#include <atomic>
+#include <cstddef>    // size_t
+#include <cstdint>    // uint64_t
+#include <memory>
+#include <string>
+
+
+
+/*
+ * A 'weighted_reservoir' whose state lives in a POSIX shared-memory
+ * segment, so that other processes can read the current sample
+ * ('idx_current' and a fixed-size payload per data point) in place,
+ * without export to a file.
+ *
+ * The segment holds a header, the per-slot arrays of the reservoir
+ * (allocated from the segment through a 'reservoir_memory_resource'),
+ * and a payload area of 'capacity * payload_bytes' bytes.
+ *
+ * Consistency is by a sequence lock: the writer makes the generation
+ * counter in the header odd before it changes anything and even again
+ * after; a reader notes the generation before and after looking at the
+ * data and retries if it was odd or has changed. Readers never block
+ * the writer, and the writer never waits for readers.
+ *
+ * There is one writer per segment, and any number of readers.
+ */
+
+
+struct shm_reservoir_header;
+
+
+class shm_reservoir_writer
+{
+    public:
+        shm_reservoir_writer();
+
+        ~shm_reservoir_writer();
+
+        shm_reservoir_writer(shm_reservoir_writer const &) = delete;
+        shm_reservoir_writer & operator=(shm_reservoir_writer const &) = delete;
+
+
+        // Create the shared-memory object 'shm_name' (a name as for
+        // 'shm_open', e.g. "/my_reservoir"), replacing an existing one,
+        // for a reservoir of the specified capacity and alpha with
+        // 'payload_bytes' bytes of user data per data point
+        // ('payload_bytes' may be 0).
+        // Return 0 on success, -1 on failure ('errno' is set).
+        int create(
+                char const * shm_name,
+                size_t cap,
+                double alph,
+                size_t payload_bytes);
+
+        // Unmap the segment. The shared-memory object stays until
+        // 'unlink', so readers that have it mapped are unaffected.
+        // Also called by the destructor.
+        int close();
+
+        // Remove the shared-memory object name.
+        int unlink();
+
+        bool is_open() const;
+
+        size_t payload_bytes() const;
+
+
+        // Sample 'n_provided' new data points, whose payloads are
+        // 'n_provided * payload_bytes()' consecutive bytes in
+        // 'payload' (may be 'nullptr' if 'payload_bytes()' is 0), and
+        // rearrange the payload area following the index views of
+        // the reservoir, all within one update.
+        void keep_n_append(size_t n_provided, void const * payload);
+        void remove_n_inject(size_t n_provided, void const * payload);
+
+
+        // For callers that manage the payload themselves: call
+        // 'reservoir().keep_n_append' or 'remove_n_inject', and write
+        // 'payload(slot)' accordingly, between 'begin_update' and
+        // 'end_update'.
+        void begin_update();
+        void end_update();
+
+        weighted_reservoir & reservoir();
+        weighted_reservoir const & reservoir() const;
+            // Its capacity is that of the segment, for good:
+            // 'shrink_to' and 'grow_to' return 'false'.
+
+        void * payload(size_t slot);
+
+    private:
+        class arena_resource;
+
+        int _fd = -1;
+        void * _map = nullptr;
+        size_t _map_bytes = 0;
+        std::string _name;
+
+        shm_reservoir_header * _header = nullptr;
+        char * _payload = nullptr;
+
+        std::unique_ptr<arena_resource> _arena;
+        std::unique_ptr<weighted_reservoir> _reservoir;
+            // Declared after '_arena', hence destroyed before it.
+
+        void publish();
+};
+
+
+
+// What a reader sees of the reservoir, valid inside the callback of
+// 'shm_reservoir_reader::read' only.
+struct shm_reservoir_view
+{
+    uint64_t generation;
+    double alpha;
+    size_t capacity;
+    size_t size;
+    max_size_t grand_total;
+    size_t payload_bytes;
+    max_size_t const * idx_current;
+        // 'size' grand indices, as 'weighted_reservoir::idx_current'.
+    char const * payload;
+        // 'size * payload_bytes' bytes; the payload of slot 'i' starts
+        // at 'payload + i * payload_bytes'.
+};
+
+
+
+class shm_reservoir_reader
+{
+    public:
+        shm_reservoir_reader();
+
+        ~shm_reservoir_reader();
+
+        shm_reservoir_reader(shm_reservoir_reader const &) = delete;
+        shm_reservoir_reader & operator=(shm_reservoir_reader const &) = delete;
+
+
+        // Map the shared-memory object 'shm_name', created by a
+        // 'shm_reservoir_writer', read-only.
+        // Return 0 on success, -1 on failure ('errno' is set).
+        int open(char const * shm_name);
+
+        int close();
+
+        bool is_open() const;
+
+        uint64_t generation() const;
+            // Changes whenever the writer updates the reservoir; odd
+            // while an update is in progress.
+
+
+        // Call 'f(shm_reservoir_view const &)' on the data in place.
+        // Since the writer may change the data while 'f' looks at it,
+        // 'f' may see a torn state and is called again until it has
+        // seen a consistent one, or until 'max_tries' attempts (0 for
+        // no limit; attempts during an update do not call 'f'). Hence
+        // 'f' should only collect what it needs, and the caller should
+        // act on the result only if 'read' returns 'true'.
+        template<typename F>
+        bool read(F && f, unsigned max_tries = 0) const
+        {
+            for (unsigned i = 0; max_tries == 0 || i < max_tries; ++i)
+            {
+                shm_reservoir_view v;
+                if (!this->begin_read(v))
+                    continue;
+                f(static_cast<shm_reservoir_view const &>(v));
+                if (this->end_read(v))
+                    return true;
+            }
+            return false;
+        }
+
+    private:
+        int _fd = -1;
+        void const * _map = nullptr;
+        size_t _map_bytes = 0;
+
+        shm_reservoir_header const * _header = nullptr;
+
+        bool begin_read(shm_reservoir_view & v) const;
+        bool end_read(shm_reservoir_view const & v) const;
+};
+
+
+
+#endif  // SHM_RESERVOIR_H
@@ -0,0 +1,487 @@
+#include "reservoir.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+
+
+// Benchmarks of 'weighted_reservoir' against two reference samplers,
+// over a sweep of capacity, alpha, batch size (as a ratio to capacity)
+// and mode ('keep_n_append' vs 'remove_n_inject').
+//
+// Each configuration starts from a saturated reservoir, runs a number
+// of warm-up calls, then times each of a number of calls separately.
+// Reported per configuration:
+//
+//   items_per_s, ns_per_item       over all timed calls
+//   p50_us, p99_us                 per-call latency percentiles
+//   allocs_per_call, bytes_per_call  heap allocations made by a call
+//
+// Per capacity, export to and import from an HDF5 file are timed and
+// reported as MB/s of reservoir state.
+//
+// Output is CSV (default) or JSON, one record per line of results,
+// so that runs on different commits can be compared mechanically.
+
+
+
+/// Allocation counting.
+
+static std::atomic<size_t> n_allocs{0};
+static std::atomic<size_t> n_alloc_bytes{0};
+
+void * operator new(size_t size)
+{
+    n_allocs.fetch_add(1, std::memory_order_relaxed);
+    n_alloc_bytes.fetch_add(size, std::memory_order_relaxed);
+    void * p = std::malloc(size ? size : 1);
+    if (p == nullptr)
+        throw std::bad_alloc{};
+    return p;
+}
+
+void operator delete(void * p) noexcept
+{
+    std::free(p);
+}
+
+
+
+typedef std::chrono::steady_clock clock_type;
+
+// Memory resource of the 'weighted_reservoir' under test. Allocations
+// through 'hugepage_reservoir_resource' bypass 'operator new', hence do
+// not show in 'allocs_per_call'.
+static reservoir_memory_resource * bench_resource = default_reservoir_resource();
+
+inline double ns_since(clock_type::time_point t0)
+{
+    return std::chrono::duration<double, std::nano>(clock_type::now() - t0).count();
+}
+
+
+
+/// Reference samplers.
+
+// Algorithm R (Vitter 1985): uniform sampling, no decay.
+class algorithm_r
+{
+    public:
+        algorithm_r(size_t cap, double) : _cap(cap), _slots(cap) {}
+
+        void fill()
+        {
+            this->append(_cap);
+        }
+
+        void append(size_t n)
+        {
+            std::uniform_int_distribution<max_size_t> d{};
+            typedef std::uniform_int_distribution<max_size_t>::param_type param_t;
+            auto & urng = global_urng();
+            for (size_t i = 0; i < n; ++i, ++_total)
+            {
+                if (_total < _cap)
+                {
+                    _slots[_total] = _total;
+                } else
+                {
+                    max_size_t j = d(urng, param_t{0, _total});
+                    if (j < _cap)
+                        _slots[j] = _total;
+                }
+            }
+        }
+
+    private:
+        size_t _cap;
+        max_size_t _total = 0;
+        std::vector<max_size_t> _slots;
+};
+
+
+// A-Res (Efraimidis & Spirakis 2006) with a min-heap of keys, using
+// forward-decay weights '(t + 1)^alpha' with a fixed landmark.
+class ares_heap
+{
+    public:
+        ares_heap(size_t cap, double alpha) : _cap(cap), _alpha(alpha)
+        {
+            _heap.reserve(cap);
+        }
+
+        void fill()
+        {
+            this->append(_cap);
+        }
+
+        void append(size_t n)
+        {
+            std::uniform_real_distribution<double> urd{0.0, 1.0};
+            auto & urng = global_urng();
+            auto greater = [](entry const & x, entry const & y) { return x.key > y.key; };
+            for (size_t i = 0; i < n; ++i, ++_total)
+            {
+                double key = _alpha * std::log(double(_total) + 1.) - std::log(urd(urng));
+                if (_heap.size() < _cap)
+                {
+                    _heap.push_back(entry{key, _total});
+                    std::push_heap(_heap.begin(), _heap.end(), greater);
+                } else if (key > _heap.front().key)
+                {
+                    std::pop_heap(_heap.begin(), _heap.end(), greater);
+                    _heap.back() = entry{key, _total};
+                    std::push_heap(_heap.begin(), _heap.end(), greater);
+                }
+            }
+        }
+
+    private:
+        struct entry
+        {
+            double key;
+            max_size_t time;
+        };
+
+        size_t _cap;
+        double _alpha;
+        max_size_t _total = 0;
+        std::vector<entry> _heap;
+};
+
+
+
+/// Benchmark driver.
+
+struct config_t
+{
+    std::string engine;
+    std::string mode;
+    size_t capacity;
+    double alpha;
+    double ratio;
+};
+
+
+struct result_t
+{
+    config_t config;
+    size_t batch;
+    size_t calls;
+    double items_per_s;
+    double ns_per_item;
+    double p50_us;
+    double p99_us;
+    double allocs_per_call;
+    double bytes_per_call;
+};
+
+
+double percentile(std::vector<double> v, double p)
+{
+    if (v.empty())
+        return 0.;
+    size_t k = std::min(v.size() - 1, size_t(p * (v.size() - 1) + 0.5));
+    std::nth_element(v.begin(), v.begin() + k, v.end());
+    return v[k];
+}
+
+
+template<typename F>
+result_t run(config_t const & cfg, int warmup, int reps, F && call)
+{
+    size_t batch = std::max<size_t>(1, size_t(cfg.ratio * cfg.capacity));
+
+    for (int i = 0; i < warmup; ++i)
+    {
+        call(batch);
+    }
+
+    std::vector<double> ns(reps);
+    size_t allocs0 = n_allocs.load();
+    size_t bytes0 = n_alloc_bytes.load();
+    for (int i = 0; i < reps; ++i)
+    {
+        auto t0 = clock_type::now();
+        call(batch);
+        ns[i] = ns_since(t0);
+    }
+    size_t allocs = n_allocs.load() - allocs0;
+    size_t bytes = n_alloc_bytes.load() - bytes0;
+
+    double total_ns = 0.;
+    for (auto x : ns)
+        total_ns += x;
+
+    result_t r;
+    r.config = cfg;
+    r.batch = batch;
+    r.calls = reps;
+    r.ns_per_item = total_ns / (double(batch) * reps);
+    r.items_per_s = 1e9 / r.ns_per_item;
+    r.p50_us = percentile(ns, 0.50) / 1e3;
+    r.p99_us = percentile(ns, 0.99) / 1e3;
+    r.allocs_per_call = double(allocs) / reps;
+    r.bytes_per_call = double(bytes) / reps;
+    return r;
+}
+
+
+result_t bench(config_t const & cfg, int warmup, int reps)
+{
+    if (cfg.engine == "weighted_reservoir")
+    {
+        weighted_reservoir r(cfg.capacity, cfg.alpha, bench_resource);
+        r.keep_n_append(cfg.capacity);
+        if (cfg.mode == "keep")
+            return run(cfg, warmup, reps, [&](size_t n) { r.keep_n_append(n); });
+        else
+            return run(cfg, warmup, reps, [&](size_t n) { r.remove_n_inject(n); });
+    } else if (cfg.engine == "algorithm_r")
+    {
+        algorithm_r r(cfg.capacity, cfg.alpha);
+        r.fill();
+        return run(cfg, warmup, reps, [&](size_t n) { r.append(n); });
+    } else
+    {
+        ares_heap r(cfg.capacity, cfg.alpha);
+        r.fill();
+        return run(cfg, warmup, reps, [&](size_t n) { r.append(n); });
+    }
+}
+
+
+
+struct io_result_t
+{
+    size_t capacity;
+    double state_mb;
+    double export_mb_per_s;
+    double import_mb_per_s;
+};
+
+
+io_result_t bench_io(size_t capacity, double alpha, int reps)
+{
+    weighted_reservoir r(capacity, alpha);
+    r.keep_n_append(capacity * 2);
+
+    io_result_t res;
+    res.capacity = capacity;
+    res.state_mb = double(capacity) * (sizeof(max_size_t) + sizeof(double)) / (1024. * 1024.);
+
+    const char * file = "bench_reservoir.h5";
+    double export_ns = 0.;
+    double import_ns = 0.;
+    for (int i = 0; i < reps; ++i)
+    {
+        auto t0 = clock_type::now();
+        r.export_to_file(file);
+        export_ns += ns_since(t0);
+
+        weighted_reservoir again;
+        t0 = clock_type::now();
+        again.import_from_file(file);
+        import_ns += ns_since(t0);
+    }
+    std::remove(file);
+
+    res.export_mb_per_s = res.state_mb * reps / (export_ns / 1e9);
+    res.import_mb_per_s = res.state_mb * reps / (import_ns / 1e9);
+    return res;
+}
+
+
+
+template<typename T>
+std::vector<T> parse_list(char const * s)
+{
+    std::vector<T> v;
+    std::stringstream ss{s};
+    std::string item;
+    while (std::getline(ss, item, ','))
+    {
+        std::stringstream is{item};
+        T x;
+        is >> x;
+        v.push_back(x);
+    }
+    return v;
+}
+
+
+
+void print_usage(std::string const & cmd)
+{
+    std::cout
+        << "usage: " << cmd << std::endl
+        << "         --caps  comma-separated capacities  (default 1000,100000)" << std::endl
+        << "         --alphas  comma-separated alphas  (default 0,1)" << std::endl
+        << "         --ratios  comma-separated batch-size/capacity ratios  (default 0.01,0.1,1,10)" << std::endl
+        << "         --reps  timed calls per configuration  (default 50)" << std::endl
+        << "         --warmup  untimed calls per configuration  (default 5)" << std::endl
+        << "         --format  csv or json  (default csv)" << std::endl
+        << "         --no-baselines  skip Algorithm R and A-Res heap" << std::endl
+        << "         --hugepages  back 'weighted_reservoir' by 'hugepage_reservoir_resource'" << std::endl
+        << "         -s  seed  (default 1)" << std::endl;
+}
+
+
+
+int main(int argc, char ** argv)
+{
+    std::vector<size_t> caps{1000, 100000};
+    std::vector<double> alphas{0., 1.};
+    std::vector<double> ratios{0.01, 0.1, 1., 10.};
+    int reps = 50;
+    int warmup = 5;
+    std::string format = "csv";
+    bool baselines = true;
+    unsigned seed = 1;
+
+    int iarg = 1;
+    while (iarg < argc)
+    {
+        std::string arg{argv[iarg]};
+        ++iarg;
+        if (arg.compare("--no-baselines") == 0)
+        {
+            baselines = false;
+            continue;
+        }
+        if (arg.compare("--hugepages") == 0)
+        {
+            bench_resource = hugepage_reservoir_resource();
+            continue;
+        }
+        if (iarg >= argc)
+        {
+            print_usage(argv[0]);
+            return -1;
+        }
+        if (arg.compare("--caps") == 0)
+        {
+            caps = parse_list<size_t>(argv[iarg]);
+        } else if (arg.compare("--alphas") == 0)
+        {
+            alphas = parse_list<double>(argv[iarg]);
+        } else if (arg.compare("--ratios") == 0)
+        {
+            ratios = parse_list<double>(argv[iarg]);
+        } else if (arg.compare("--reps") == 0)
+        {
+            reps = atoi(argv[iarg]);
+        } else if (arg.compare("--warmup") == 0)
+        {
+            warmup = atoi(argv[iarg]);
+        } else if (arg.compare("--format") == 0)
+        {
+            format = argv[iarg];
+        } else if (arg.compare("-s") == 0)
+        {
+            seed = atoi(argv[iarg]);
+        } else
+        {
+            print_usage(argv[0]);
+            return -1;
+        }
+        iarg++;
+    }
+
+    if (caps.empty() || alphas.empty() || ratios.empty() || reps < 1 || warmup < 0
+            || (format != "csv" && format != "json"))
+    {
+        print_usage(argv[0]);
+        return -1;
+    }
+
+    global_seed(seed);
+
+    std::vector<config_t> configs;
+    for (auto cap : caps)
+        for (auto alpha : alphas)
+            for (auto ratio : ratios)
+            {
+                configs.push_back(config_t{"weighted_reservoir", "keep", cap, alpha, ratio});
+                configs.push_back(config_t{"weighted_reservoir", "remove", cap, alpha, ratio});
+                if (baselines)
+                {
+                    if (alpha == 0.)
+                        configs.push_back(config_t{"algorithm_r", "-", cap, alpha, ratio});
+                    configs.push_back(config_t{"ares_heap", "-", cap, alpha, ratio});
+                }
+            }
+
+    bool json = (format == "json");
+    if (json)
+    {
+        std::cout << "{\"seed\": " << seed << ", \"sampling\": [" << std::endl;
+    } else
+    {
+        std::cout << "kind,engine,mode,capacity,alpha,ratio,batch,calls,"
+            << "items_per_s,ns_per_item,p50_us,p99_us,allocs_per_call,bytes_per_call,"
+            << "state_mb,export_mb_per_s,import_mb_per_s" << std::endl;
+    }
+
+    for (size_t i = 0; i < configs.size(); ++i)
+    {
+        result_t r = bench(configs[i], warmup, reps);
+        config_t const & c = r.config;
+        if (json)
+        {
+            std::cout << "  {\"engine\": \"" << c.engine << "\", \"mode\": \"" << c.mode
+                << "\", \"capacity\": " << c.capacity << ", \"alpha\": " << c.alpha
+                << ", \"ratio\": " << c.ratio << ", \"batch\": " << r.batch
+                << ", \"calls\": " << r.calls << ", \"items_per_s\": " << r.items_per_s
+                << ", \"ns_per_item\": " << r.ns_per_item << ", \"p50_us\": " << r.p50_us
+                << ", \"p99_us\": " << r.p99_us << ", \"allocs_per_call\": " << r.allocs_per_call
+                << ", \"bytes_per_call\": " << r.bytes_per_call << "}"
+                << (i + 1 < configs.size() ? "," : "") << std::endl;
+        } else
+        {
+            std::cout << "sampling," << c.engine << "," << c.mode << "," << c.capacity << ","
+                << c.alpha << "," << c.ratio << "," << r.batch << "," << r.calls << ","
+                << r.items_per_s << "," << r.ns_per_item << "," << r.p50_us << ","
+                << r.p99_us << "," << r.allocs_per_call << "," << r.bytes_per_call
+                << ",,," << std::endl;
+        }
+    }
+
+    if (json)
+    {
+        std::cout << "], \"io\": [" << std::endl;
+    }
+
+    for (size_t i = 0; i < caps.size(); ++i)
+    {
+        io_result_t r = bench_io(caps[i], alphas[0], std::max(1, reps / 10));
+        if (json)
+        {
+            std::cout << "  {\"capacity\": " << r.capacity << ", \"state_mb\": " << r.state_mb
+                << ", \"export_mb_per_s\": " << r.export_mb_per_s
+                << ", \"import_mb_per_s\": " << r.import_mb_per_s << "}"
+                << (i + 1 < caps.size() ? "," : "") << std::endl;
+        } else
+        {
+            std::cout << "io,weighted_reservoir,-," << r.capacity << "," << alphas[0]
+                << ",,,,,,,,,," << r.state_mb << "," << r.export_mb_per_s << ","
+                << r.import_mb_per_s << std::endl;
+        }
+    }
+
+    if (json)
+    {
+        std::cout << "]}" << std::endl;
+    }
+
+    return 0;
+}
@@ -0,0 +1,248 @@
+#include "reservoir.h"
+#include "hdf5util.h"
+
+#include <chrono>
+#include <cstring>
+#include <future>
+#include <iostream>
+#include <memory>
+
+
+// Reservoir-sample the rows of a (possibly huge) HDF5 dataset.
+//
+// The dataset is read in blocks of rows along its first dimension.
+// While block 'i' is being sampled, block 'i + 1' is read by a separate
+// thread into the other of two buffers, so that reading and sampling
+// overlap.
+//
+// The chosen rows, their grand indices, and the reservoir state are
+// written to the output file as datasets 'data', 'grand_index', and
+// group 'reservoir'.
+
+
+typedef std::chrono::steady_clock clock_type;
+
+
+double seconds_since(clock_type::time_point t0)
+{
+    return std::chrono::duration<double>(clock_type::now() - t0).count();
+}
+
+
+
+void print_usage(std::string const & cmd, double alpha, size_t block, unsigned s)
+{
+    std::cout
+        << "usage: " << cmd << std::endl
+        << "         -i  input file  (required)" << std::endl
+        << "         -d  dataset name in input file  (required)" << std::endl
+        << "         -o  output file  (required)" << std::endl
+        << "         --cap  capacity  (required)" << std::endl
+        << "         --alpha  alpha  (default " << alpha << ")" << std::endl
+        << "         --block  rows per read  (default " << block << ")" << std::endl
+        << "         -s  seed  (default " << s << ", for random)" << std::endl;
+}
+
+
+
+herr_t write_output(
+        char const * file_name,
+        weighted_reservoir const & reservoir,
+        char const * payload,
+        hid_t native_type,
+        h5dataset const & source)
+{
+    h5file_handle file{H5Fcreate(file_name, H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT)};
+    if (!file.valid())
+        return file.get();
+
+    herr_t status;
+    hsize_t dims[H5S_MAX_RANK];
+    std::copy_n(source.dims(), source.rank(), dims);
+    dims[0] = reservoir.size();
+
+    h5dataspace_handle space{H5Screate_simple(source.rank(), dims, nullptr)};
+    if (!space.valid())
+        return space.get();
+    h5dataset_handle data{H5Dcreate(file.get(), "data", native_type, space.get(),
+            H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT)};
+    if (!data.valid())
+        return data.get();
+    if (reservoir.size() > 0)
+    {
+        status = H5Dwrite(data.get(), native_type, H5S_ALL, H5S_ALL, H5P_DEFAULT, payload);
+        if (status < 0)
+            return status;
+    }
+
+    if (reservoir.size() > 0)
+    {
+        status = h5make_dataset_number(file.get(), "grand_index", 1, dims,
+                reservoir.idx_current());
+        if (status < 0)
+            return status;
+    }
+
+    return reservoir.export_to_file(file.get(), "reservoir");
+}
+
+
+
+int main(int argc, char ** argv)
+{
+    std::string in_file;
+    std::string dset_name;
+    std::string out_file;
+    size_t capacity = 0;
+    double alpha = 1.0;
+    size_t block = 1 << 16;
+    unsigned seed = 0;
+
+    int iarg = 1;
+    while (iarg < argc)
+    {
+        std::string arg{argv[iarg]};
+        ++iarg;
+        if (iarg >= argc)
+        {
+            print_usage(argv[0], alpha, block, seed);
+            return -1;
+        }
+        if (arg.compare("-i") == 0)
+        {
+            in_file = argv[iarg];
+        } else if (arg.compare("-d") == 0)
+        {
+            dset_name = argv[iarg];
+        } else if (arg.compare("-o") == 0)
+        {
+            out_file = argv[iarg];
+        } else if (arg.compare("--cap") == 0)
+        {
+            capacity = atol(argv[iarg]);
+        } else if (arg.compare("--alpha") == 0)
+        {
+            alpha = atof(argv[iarg]);
+        } else if (arg.compare("--block") == 0)
+        {
+            block = atol(argv[iarg]);
+        } else if (arg.compare("-s") == 0)
+        {
+            seed = atoi(argv[iarg]);
+        } else
+        {
+            print_usage(argv[0], alpha, block, seed);
+            return -1;
+        }
+        iarg++;
+    }
+
+    if (in_file.empty() || dset_name.empty() || out_file.empty()
+            || capacity < 1 || alpha < 0. || block < 1)
+    {
+        print_usage(argv[0], alpha, block, seed);
+        return -1;
+    }
+
+    if (seed == 0)
+    {
+        seed = global_randomize();
+    } else
+    {
+        global_seed(seed);
+    }
+    std::cout << "Random seed set to " << seed << std::endl;
+
+
+    h5file_handle in{H5Fopen(in_file.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT)};
+    if (!in.valid())
+    {
+        std::cout << "failed to open " << in_file << std::endl;
+        return 1;
+    }
+    h5dataset source;
+    if (source.open(in.get(), dset_name.c_str()) < 0 || source.rank() < 1)
+    {
+        std::cout << "failed to open dataset " << dset_name << std::endl;
+        return 1;
+    }
+
+    const hsize_t n_rows = source.dims()[0];
+    const size_t row_bytes = source.row_len() * H5Tget_size(source.native_type());
+    block = std::min<hsize_t>(block, std::max<hsize_t>(n_rows, 1));
+
+    std::cout << "Sampling " << capacity << " of " << n_rows << " rows ("
+        << row_bytes << " bytes each) in blocks of " << block << " rows" << std::endl;
+
+    weighted_reservoir reservoir(capacity, alpha);
+    std::unique_ptr<char[]> payload{new char[capacity * row_bytes]};
+    std::unique_ptr<char[]> buffers[2] = {
+        std::unique_ptr<char[]>{new char[block * row_bytes]},
+        std::unique_ptr<char[]>{new char[block * row_bytes]}};
+
+    auto read_block = [&](hsize_t start, hsize_t n, char * buf) -> herr_t
+    {
+        return source.read_rows(start, n, buf, source.native_type());
+    };
+
+    double t_wait = 0.;
+    double t_sample = 0.;
+    auto t_start = clock_type::now();
+
+    std::future<herr_t> pending;
+    if (n_rows > 0)
+    {
+        pending = std::async(std::launch::async, read_block,
+                0, std::min<hsize_t>(block, n_rows), buffers[0].get());
+    }
+
+    for (hsize_t start = 0, i = 0; start < n_rows; start += block, ++i)
+    {
+        const hsize_t n = std::min<hsize_t>(block, n_rows - start);
+        char const * buf = buffers[i % 2].get();
+
+        auto t0 = clock_type::now();
+        herr_t status = pending.get();
+        t_wait += seconds_since(t0);
+        if (status < 0)
+        {
+            std::cout << "failed to read rows starting at " << start << std::endl;
+            return 1;
+        }
+
+        // Start reading the next block into the other buffer before
+        // sampling this one.
+        const hsize_t next = start + n;
+        if (next < n_rows)
+        {
+            pending = std::async(std::launch::async, read_block,
+                    next, std::min<hsize_t>(block, n_rows - next),
+                    buffers[(i + 1) % 2].get());
+        }
+
+        t0 = clock_type::now();
+        reservoir.remove_n_inject(n);
+        apply_plan(reservoir.move_plan(), payload.get(), row_bytes, buf, row_bytes, row_bytes);
+        t_sample += seconds_since(t0);
+    }
+
+    double t_total = seconds_since(t_start);
+    double mb = double(n_rows) * row_bytes / (1024. * 1024.);
+
+    std::cout << "Read and sampled " << n_rows << " rows (" << mb << " MB) in "
+        << t_total << " seconds: "
+        << (t_total > 0. ? n_rows / t_total : 0.) << " rows/s, "
+        << (t_total > 0. ? mb / t_total : 0.) << " MB/s" << std::endl
+        << "  waiting for reads: " << t_wait << " seconds;  sampling: "
+        << t_sample << " seconds" << std::endl;
+
+    if (write_output(out_file.c_str(), reservoir, payload.get(),
+                source.native_type(), source) < 0)
+    {
+        std::cout << "failed to write " << out_file << std::endl;
+        return 1;
+    }
+    std::cout << "Wrote " << reservoir.size() << " rows to " << out_file << std::endl;
+
+    return 0;
+}
@@ -0,0 +1,218 @@
+#include "budget_reservoir.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <vector>
+
+
+
+void print_usage(std::string const & cmd, const double alpha, const unsigned s)
+{
+    std::cout
+        << "usage: " << cmd << std::endl
+        << "         --alpha alpha (default " << alpha << ")" << std::endl
+        << "         --budget  budget in bytes  (required)" << std::endl
+        << "         -s  seed  (default " << s << ", for random)" << std::endl;
+}
+
+
+
+// The user arrays, maintained by following the move plan, must match
+// the reservoir, and the sizes must respect the budget.
+bool check(budget_weighted_reservoir const & r,
+        std::vector<max_size_t> const & data,
+        std::vector<size_t> const & data_bytes)
+{
+    size_t total = 0;
+    for (size_t i = 0; i < r.size(); ++i)
+    {
+        if (data[i] != r.idx_current()[i] || data_bytes[i] != r.item_bytes()[i])
+        {
+            std::cout << "data in slot " << i << " does not match its data point" << std::endl;
+            return false;
+        }
+        total += r.item_bytes()[i];
+    }
+    if (total != r.bytes() || r.bytes() > r.budget())
+    {
+        std::cout << "bytes " << r.bytes() << " (sum " << total
+            << ") inconsistent with budget " << r.budget() << std::endl;
+        return false;
+    }
+    for (size_t i = 0; i < r.n_kept(); ++i)
+    {
+        if (i > 0 && r.idx_kept()[i] <= r.idx_kept()[i-1])
+        {
+            std::cout << "keep view not increasing" << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+
+
+// With equal sizes, the budget reservoir must choose the data points a
+// count-bounded reservoir chooses from the same random stream. Batches
+// of up to 'n_max' data points; long ones are selected in several
+// windows.
+bool check_equal_sizes(const double alpha, const unsigned seed, const size_t n_max)
+{
+    const size_t k = 200;
+    const size_t s = 1000;
+    std::vector<size_t> sizes(n_max, s);
+
+    weighted_reservoir r1(k, alpha);
+    budget_weighted_reservoir r2(k * s, alpha);
+
+    for (int repeat = 0; repeat < 40; ++repeat)
+    {
+        global_seed(seed + repeat);
+        size_t n = pick_a_number(0.01, 1.0) * n_max + 1;
+
+        global_seed(seed + 1000 + repeat);
+        r1.keep_n_append(n);
+        global_seed(seed + 1000 + repeat);
+        r2.keep_n_append(n, sizes.data());
+
+        std::vector<max_size_t> a(r1.idx_current(), r1.idx_current() + r1.size());
+        std::vector<max_size_t> b(r2.idx_current(), r2.idx_current() + r2.size());
+        std::sort(a.begin(), a.end());
+        std::sort(b.begin(), b.end());
+        if (a != b)
+        {
+            std::cout << "equal sizes: differs from weighted_reservoir after "
+                << r2.grand_total() << " data points" << std::endl;
+            return false;
+        }
+    }
+    std::cout << "Equal sizes: same sample as weighted_reservoir of capacity "
+        << k << " over " << r2.grand_total() << " data points in batches of up to "
+        << n_max << std::endl;
+    return true;
+}
+
+
+
+// A data point larger than the budget is dropped: it evicts nothing,
+// whatever its rank.
+bool check_oversized(const double alpha)
+{
+    const size_t k = 50;
+    const size_t s = 1000;
+    std::vector<size_t> sizes(k, s);
+
+    budget_weighted_reservoir r(k * s, alpha);
+    r.keep_n_append(k, sizes.data());
+    std::vector<max_size_t> before(r.idx_current(), r.idx_current() + r.size());
+
+    const size_t too_large = k * s + 1;
+    for (int repeat = 0; repeat < 50; ++repeat)
+    {
+        r.keep_n_append(1, &too_large);
+        std::vector<max_size_t> after(r.idx_current(), r.idx_current() + r.size());
+        if (after != before || r.n_appended() != 0)
+        {
+            std::cout << "a data point larger than the budget changed the sample from "
+                << before.size() << " to " << after.size() << " data points" << std::endl;
+            return false;
+        }
+    }
+    std::cout << "Oversized data points left the sample of " << k << " alone" << std::endl;
+    return true;
+}
+
+
+
+int main(int argc, char ** argv)
+{
+    double alpha = 1.0;
+    unsigned seed = 0;
+    size_t budget = 0;
+
+    int iarg = 1;
+    while (iarg < argc)
+    {
+        std::string arg{argv[iarg]};
+        ++iarg;
+        if (arg.compare("--alpha") == 0)
+        {
+            alpha = atof(argv[iarg]);
+        } else if (arg.compare("--budget") == 0)
+        {
+            budget = atol(argv[iarg]);
+        } else if (arg.compare("-s") == 0)
+        {
+            seed = atoi(argv[iarg]);
+        } else
+        {
+            print_usage(argv[0], alpha, seed);
+            return -1;
+        }
+        iarg++;
+    }
+
+    if (budget < 1 || alpha < 0.)
+    {
+        print_usage(argv[0], alpha, seed);
+        return -1;
+    }
+
+    if (seed == 0)
+    {
+        seed = global_randomize();
+    } else
+    {
+        global_seed(seed);
+    }
+    std::cout << "Random seed set to " << seed << std::endl;
+
+    if (!check_equal_sizes(alpha, seed, 1000)
+            || !check_equal_sizes(alpha, seed, 20000))
+        return 1;
+
+    if (!check_oversized(alpha))
+        return 1;
+
+    // Payloads from 100 B to 1 MB, log-uniform.
+    const size_t n_max = 2000;
+    std::vector<max_size_t> batch(n_max);
+    std::vector<size_t> batch_bytes(n_max);
+    std::vector<max_size_t> data;
+    std::vector<size_t> data_bytes;
+
+    budget_weighted_reservoir reservoir(budget, alpha);
+    for (int repeat = 0; repeat < 50; ++repeat)
+    {
+        size_t n = pick_a_number(0.01, 1.0) * n_max + 1;
+        for (size_t i = 0; i < n; ++i)
+        {
+            batch[i] = reservoir.grand_total() + i;
+            batch_bytes[i] = std::pow(10., pick_a_number(2., 6.));
+        }
+        reservoir.keep_n_append(n, batch_bytes.data());
+
+        if (data.size() < reservoir.size())
+        {
+            data.resize(reservoir.size());
+            data_bytes.resize(reservoir.size());
+        }
+        auto plan = reservoir.move_plan();
+        apply_plan(plan, data.data(), batch.data());
+        apply_plan(plan, data_bytes.data(), batch_bytes.data());
+
+        if (!check(reservoir, data, data_bytes))
+            return 1;
+        if (repeat % 10 == 9)
+        {
+            std::cout << "Kept " << reservoir.n_kept() << ", appended "
+                << reservoir.n_appended() << " of " << n
+                << "; size " << reservoir.size() << ", " << reservoir.bytes()
+                << " of " << reservoir.budget() << " bytes, grand total "
+                << reservoir.grand_total() << std::endl;
+        }
+    }
+
+    return 0;
+}
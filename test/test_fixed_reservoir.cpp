@@ -0,0 +1,246 @@
+#include "fixed_reservoir.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <type_traits>
+#include <vector>
+
+
+
+void print_usage(std::string const & cmd, const double alpha, const unsigned s)
+{
+    std::cout
+        << "usage: " << cmd << std::endl
+        << "         --alpha alpha (default " << alpha << ")" << std::endl
+        << "         -s  seed  (default " << s << ", for random)" << std::endl;
+}
+
+
+
+template<typename R>
+std::vector<max_size_t> sorted_sample(R const & r)
+{
+    std::vector<max_size_t> v(r.idx_current(), r.idx_current() + r.size());
+    std::sort(v.begin(), v.end());
+    return v;
+}
+
+
+
+// Fed the same random stream, in both modes, the fixed reservoir must
+// hold the data points 'weighted_reservoir' holds, with the same
+// threshold; a user array following its move plan must match it. Then
+// each imports the other's export, and the two go on alike.
+template<size_t N>
+bool check_against_dynamic(const double alpha, const unsigned seed)
+{
+    static_assert(std::is_trivially_copyable<fixed_reservoir<N>>::value,
+            "fixed_reservoir must be relocatable by memcpy");
+
+    fixed_reservoir<N> fixed(alpha);
+    weighted_reservoir dynamic(N, alpha);
+    std::vector<max_size_t> data(N);
+    std::vector<max_size_t> batch(5 * N);
+
+    const int n_repeats = 200;
+    std::vector<int> sizes(n_repeats);
+    std::vector<int> modes(n_repeats);
+    global_seed(seed);
+    pick_numbers(sizes.data(), n_repeats, 1, int(5 * N));
+    pick_numbers(modes.data(), n_repeats, 0, 1);
+
+    for (int repeat = 0; repeat < n_repeats; ++repeat)
+    {
+        size_t n = sizes[repeat];
+        bool keep = modes[repeat];
+        for (size_t i = 0; i < n; ++i)
+            batch[i] = fixed.grand_total() + i;
+
+        global_seed(seed + 1000 + repeat);
+        if (keep)
+            fixed.keep_n_append(n);
+        else
+            fixed.remove_n_inject(n);
+        global_seed(seed + 1000 + repeat);
+        if (keep)
+            dynamic.keep_n_append(n);
+        else
+            dynamic.remove_n_inject(n);
+
+        apply_plan(fixed.move_plan(), data.data(), batch.data());
+        if (!std::equal(data.begin(), data.begin() + fixed.size(), fixed.idx_current()))
+        {
+            std::cout << "N = " << N << ": user array departs from the reservoir" << std::endl;
+            return false;
+        }
+        if (sorted_sample(fixed) != sorted_sample(dynamic)
+                || fixed.threshold() != dynamic.threshold())
+        {
+            std::cout << "N = " << N << ": differs from weighted_reservoir after "
+                << fixed.grand_total() << " data points" << std::endl;
+            return false;
+        }
+    }
+
+    const char * file_fixed = "fixed.h5";
+    const char * file_dynamic = "dynamic.h5";
+    fixed_reservoir<N> fixed_copy;
+    weighted_reservoir dynamic_copy;
+    if (fixed.export_to_file(file_fixed) < 0 || dynamic.export_to_file(file_dynamic) < 0
+            || dynamic_copy.import_from_file(file_fixed) < 0
+            || fixed_copy.import_from_file(file_dynamic) < 0)
+    {
+        std::cout << "N = " << N << ": failed to exchange files" << std::endl;
+        return false;
+    }
+    std::remove(file_fixed);
+    std::remove(file_dynamic);
+
+    for (int repeat = 0; repeat < 20; ++repeat)
+    {
+        size_t n = sizes[repeat];
+        global_seed(seed + 2000 + repeat);
+        fixed_copy.keep_n_append(n);
+        global_seed(seed + 2000 + repeat);
+        dynamic_copy.keep_n_append(n);
+        if (sorted_sample(fixed_copy) != sorted_sample(dynamic_copy))
+        {
+            std::cout << "N = " << N << ": imported reservoirs depart" << std::endl;
+            return false;
+        }
+    }
+
+    std::cout << "N = " << N << ": same as weighted_reservoir over "
+        << fixed.grand_total() << " data points, and across files" << std::endl;
+    return true;
+}
+
+
+
+// A 'weighted_reservoir' raised by 'grow_to' holds fewer than 'N' data
+// points under a positive threshold; imported, the fixed reservoir must
+// keep that threshold as a floor until it fills, as 'sample_inject' does.
+template<size_t N>
+bool check_after_grow(const double alpha, const unsigned seed)
+{
+    weighted_reservoir dynamic(N, alpha);
+    global_seed(seed);
+    for (int repeat = 0; repeat < 10; ++repeat)
+        dynamic.keep_n_append(5 * N);
+    dynamic.shrink_to(N / 2);
+    dynamic.grow_to(N);
+    if (dynamic.size() >= N || dynamic.threshold() <= 0.)
+    {
+        std::cout << "N = " << N << ": grow_to left no threshold to test" << std::endl;
+        return false;
+    }
+
+    const char * file_dynamic = "grown.h5";
+    fixed_reservoir<N> fixed;
+    if (dynamic.export_to_file(file_dynamic) < 0
+            || fixed.import_from_file(file_dynamic) < 0)
+    {
+        std::cout << "N = " << N << ": failed to import a grown reservoir" << std::endl;
+        return false;
+    }
+    std::remove(file_dynamic);
+
+    for (int repeat = 0; repeat < 20; ++repeat)
+    {
+        size_t n = (repeat % 2) ? N / 4 + 1 : 3 * N;
+        global_seed(seed + 3000 + repeat);
+        fixed.keep_n_append(n);
+        global_seed(seed + 3000 + repeat);
+        dynamic.keep_n_append(n);
+        if (sorted_sample(fixed) != sorted_sample(dynamic)
+                || fixed.threshold() != dynamic.threshold())
+        {
+            std::cout << "N = " << N << ": departs from a grown weighted_reservoir after "
+                << fixed.grand_total() << " data points" << std::endl;
+            return false;
+        }
+    }
+
+    std::cout << "N = " << N << ": same as a grown weighted_reservoir" << std::endl;
+    return true;
+}
+
+
+
+template<size_t N>
+void time_against_dynamic(const double alpha)
+{
+    const size_t n_calls = 200000;
+    fixed_reservoir<N> fixed(alpha);
+    weighted_reservoir dynamic(N, alpha);
+
+    auto t0 = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < n_calls; ++i)
+        fixed.keep_n_append(N);
+    auto t1 = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < n_calls; ++i)
+        dynamic.keep_n_append(N);
+    auto t2 = std::chrono::steady_clock::now();
+
+    std::cout << "N = " << N << ", calls of N: "
+        << std::chrono::duration<double, std::nano>(t1 - t0).count() / (n_calls * N)
+        << " ns per data point fixed, "
+        << std::chrono::duration<double, std::nano>(t2 - t1).count() / (n_calls * N)
+        << " dynamic" << std::endl;
+}
+
+
+
+int main(int argc, char ** argv)
+{
+    double alpha = 1.0;
+    unsigned seed = 0;
+
+    int iarg = 1;
+    while (iarg < argc)
+    {
+        std::string arg{argv[iarg]};
+        ++iarg;
+        if (arg.compare("--alpha") == 0)
+        {
+            alpha = atof(argv[iarg]);
+        } else if (arg.compare("-s") == 0)
+        {
+            seed = atoi(argv[iarg]);
+        } else
+        {
+            print_usage(argv[0], alpha, seed);
+            return -1;
+        }
+        iarg++;
+    }
+
+    if (alpha < 0.)
+    {
+        print_usage(argv[0], alpha, seed);
+        return -1;
+    }
+
+    if (seed == 0)
+    {
+        seed = global_randomize();
+    } else
+    {
+        global_seed(seed);
+    }
+    std::cout << "Random seed set to " << seed << std::endl;
+
+    if (!check_against_dynamic<1>(alpha, seed)
+            || !check_against_dynamic<8>(alpha, seed)
+            || !check_against_dynamic<64>(alpha, seed)
+            || !check_after_grow<8>(alpha, seed)
+            || !check_after_grow<64>(alpha, seed))
+        return 1;
+
+    time_against_dynamic<8>(alpha);
+    time_against_dynamic<64>(alpha);
+
+    return 0;
+}
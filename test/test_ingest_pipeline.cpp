@@ -0,0 +1,187 @@
+#include "ingest_pipeline.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+
+void print_usage(std::string const & cmd, const double alpha, const unsigned s)
+{
+    std::cout
+        << "usage: " << cmd << std::endl
+        << "         --alpha alpha (default " << alpha << ")" << std::endl
+        << "         --cap  capacity  (required)" << std::endl
+        << "         -s  seed  (default " << s << ", for random)" << std::endl;
+}
+
+
+
+double seconds_since(std::chrono::steady_clock::time_point t0)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+}
+
+
+
+int main(int argc, char ** argv)
+{
+    double alpha = 1.0;
+    unsigned seed = 0;
+    size_t capacity = 0;
+
+    int iarg = 1;
+    while (iarg < argc)
+    {
+        std::string arg{argv[iarg]};
+        ++iarg;
+        if (arg.compare("--alpha") == 0)
+        {
+            alpha = atof(argv[iarg]);
+        } else if (arg.compare("--cap") == 0)
+        {
+            capacity = atol(argv[iarg]);
+        } else if (arg.compare("-s") == 0)
+        {
+            seed = atoi(argv[iarg]);
+        } else
+        {
+            print_usage(argv[0], alpha, seed);
+            return -1;
+        }
+        iarg++;
+    }
+
+    if (capacity < 1 || alpha < 0.)
+    {
+        print_usage(argv[0], alpha, seed);
+        return -1;
+    }
+
+    if (seed == 0)
+    {
+        seed = global_randomize();
+    } else
+    {
+        global_seed(seed);
+    }
+    std::cout << "Random seed set to " << seed << std::endl;
+
+
+    // Producers push bursts of 10 to 100 data points, each burst
+    // carrying the grand indices it is given back in its callback.
+    // The user array follows the move plan of every batch.
+    const unsigned n_producers = 4;
+    const int bursts_per_producer = 2000;
+
+    weighted_reservoir reservoir(capacity, alpha);
+    std::vector<max_size_t> data(capacity);
+    std::vector<max_size_t> batch;
+    auto on_batch = [&](weighted_reservoir const & r, max_size_t first)
+    {
+        batch.resize(r.grand_total() - first);
+        for (size_t i = 0; i < batch.size(); ++i)
+            batch[i] = first + i;
+        apply_plan(r.move_plan(), data.data(), batch.data());
+    };
+
+    std::mutex results_mutex;
+    std::vector<ingest_result> results;
+    max_size_t n_pushed = 0;
+
+    auto t0 = std::chrono::steady_clock::now();
+    {
+        ingest_pipeline pipeline(reservoir, ingest_policy(), on_batch);
+        std::vector<std::thread> producers;
+        std::vector<max_size_t> pushed(n_producers);
+        for (unsigned p = 0; p < n_producers; ++p)
+        {
+            producers.emplace_back([&, p]()
+                    {
+                        global_seed_thread(p + 1);
+                        for (int i = 0; i < bursts_per_producer; ++i)
+                        {
+                            size_t n = pick_a_number(10, 100);
+                            pushed[p] += n;
+                            pipeline.push(n, [&](ingest_result const & r)
+                                    {
+                                        std::lock_guard<std::mutex> lock(results_mutex);
+                                        results.push_back(r);
+                                    });
+                            if (i % 100 == 99)
+                                std::this_thread::sleep_for(std::chrono::microseconds(500));
+                                    // Spread over many batches.
+                        }
+                    });
+        }
+        for (auto & t : producers)
+            t.join();
+
+        auto future = pipeline.submit(50);
+        pipeline.flush();
+        ingest_result last = future.get();
+        for (auto n : pushed)
+            n_pushed += n;
+        n_pushed += 50;
+        results.push_back(last);
+
+        if (pipeline.n_sampled() != n_pushed)
+        {
+            std::cout << "flush returned with " << pipeline.n_sampled()
+                << " of " << n_pushed << " data points sampled" << std::endl;
+            return 1;
+        }
+        std::cout << "Pipeline took " << n_producers * bursts_per_producer + 1
+            << " bursts in " << pipeline.n_batches() << " batches, "
+            << seconds_since(t0) << " seconds" << std::endl;
+    }
+
+    // The bursts tile the stream, and every data point in the reservoir
+    // was reported accepted by its burst.
+    std::sort(results.begin(), results.end(),
+            [](ingest_result const & x, ingest_result const & y) { return x.first < y.first; });
+    std::vector<max_size_t> accepted;
+    max_size_t next = 0;
+    for (auto const & r : results)
+    {
+        if (r.first != next)
+        {
+            std::cout << "bursts do not tile the stream at " << next << std::endl;
+            return 1;
+        }
+        next += r.n;
+        for (auto i : r.accepted)
+            accepted.push_back(r.first + i);
+    }
+    if (next != reservoir.grand_total() || next != n_pushed)
+    {
+        std::cout << "bursts add up to " << next << ", grand total "
+            << reservoir.grand_total() << std::endl;
+        return 1;
+    }
+    for (size_t i = 0; i < reservoir.size(); ++i)
+    {
+        if (data[i] != reservoir.idx_current()[i])
+        {
+            std::cout << "data in slot " << i << " does not match its data point" << std::endl;
+            return 1;
+        }
+        if (!std::binary_search(accepted.begin(), accepted.end(), data[i]))
+        {
+            std::cout << "data point " << data[i] << " not reported accepted" << std::endl;
+            return 1;
+        }
+    }
+
+    // The same bursts, one 'keep_n_append' each.
+    weighted_reservoir direct(capacity, alpha);
+    t0 = std::chrono::steady_clock::now();
+    for (auto const & r : results)
+        direct.keep_n_append(r.n);
+    std::cout << "One call per burst took " << seconds_since(t0) << " seconds" << std::endl;
+
+    return 0;
+}
@@ -0,0 +1,141 @@
+#include "multi_reservoir.h"
+
+#include <algorithm>
+#include <iostream>
+#include <vector>
+
+
+
+void print_usage(std::string const & cmd, const unsigned s)
+{
+    std::cout
+        << "usage: " << cmd << std::endl
+        << "         -s  seed  (default " << s << ", for random)" << std::endl;
+}
+
+
+
+std::vector<max_size_t> sorted_sample(weighted_reservoir const & r)
+{
+    std::vector<max_size_t> v(r.idx_current(), r.idx_current() + r.size());
+    std::sort(v.begin(), v.end());
+    return v;
+}
+
+
+
+int main(int argc, char ** argv)
+{
+    unsigned seed = 0;
+
+    int iarg = 1;
+    while (iarg < argc)
+    {
+        std::string arg{argv[iarg]};
+        ++iarg;
+        if (arg.compare("-s") == 0)
+        {
+            seed = atoi(argv[iarg]);
+        } else
+        {
+            print_usage(argv[0], seed);
+            return -1;
+        }
+        iarg++;
+    }
+
+    if (seed == 0)
+    {
+        seed = global_randomize();
+    } else
+    {
+        global_seed(seed);
+    }
+    std::cout << "Random seed set to " << seed << std::endl;
+
+    const std::vector<reservoir_config> configs{
+        {100, 0.0}, {1000, 0.0}, {300, 1.0}, {3000, 1.0}, {500, 2.5}};
+    const size_t n_max = 5000;
+
+    // A single configuration reproduces a plain reservoir under the
+    // same seed.
+    for (auto const & c : configs)
+    {
+        multi_reservoir m({c});
+        weighted_reservoir r(c.capacity, c.alpha);
+        for (int repeat = 0; repeat < 30; ++repeat)
+        {
+            global_seed(seed + repeat);
+            size_t n = pick_a_number(0.001, 1.0) * n_max + 1;
+            bool keep = (repeat % 3 != 0);
+
+            global_seed(seed + 1000 + repeat);
+            if (keep)
+                m.keep_n_append(n);
+            else
+                m.remove_n_inject(n);
+            global_seed(seed + 1000 + repeat);
+            if (keep)
+                r.keep_n_append(n);
+            else
+                r.remove_n_inject(n);
+
+            if (!std::equal(r.idx_current(), r.idx_current() + r.size(),
+                        m.reservoir(0).idx_current())
+                    || r.size() != m.reservoir(0).size()
+                    || r.threshold() != m.reservoir(0).threshold())
+            {
+                std::cout << "capacity " << c.capacity << ", alpha " << c.alpha
+                    << ": differs from a plain reservoir" << std::endl;
+                return 1;
+            }
+        }
+    }
+    std::cout << "Single configurations match plain reservoirs" << std::endl;
+
+    // With 'alpha = 0' keys are '1 / u', so the sample must be the
+    // data points with the smallest uniforms of the whole stream.
+    multi_reservoir m(configs);
+    std::vector<double> all_u;
+    for (int repeat = 0; repeat < 30; ++repeat)
+    {
+        size_t n = pick_a_number(0.001, 1.0) * n_max + 1;
+        if (repeat % 2)
+            m.keep_n_append(n);
+        else
+            m.remove_n_inject(n);
+        all_u.insert(all_u.end(), m.uniforms(), m.uniforms() + n);
+    }
+
+    std::vector<max_size_t> order(all_u.size());
+    for (size_t i = 0; i < order.size(); ++i)
+        order[i] = i;
+    std::sort(order.begin(), order.end(),
+            [&all_u](max_size_t a, max_size_t b) { return all_u[a] < all_u[b]; });
+
+    for (size_t i = 0; i < m.n_configs(); ++i)
+    {
+        auto const & r = m.reservoir(i);
+        if (r.grand_total() != all_u.size() || r.size() != configs[i].capacity)
+        {
+            std::cout << "configuration " << i << ": wrong size" << std::endl;
+            return 1;
+        }
+        if (configs[i].alpha == 0.)
+        {
+            std::vector<max_size_t> expected(order.begin(), order.begin() + r.size());
+            std::sort(expected.begin(), expected.end());
+            if (sorted_sample(r) != expected)
+            {
+                std::cout << "configuration " << i
+                    << ": not the smallest uniforms of the stream" << std::endl;
+                return 1;
+            }
+        }
+        std::cout << "Configuration " << i << ": capacity " << r.capacity()
+            << ", alpha " << r.alpha() << ", size " << r.size()
+            << ", threshold " << r.threshold() << std::endl;
+    }
+
+    return 0;
+}
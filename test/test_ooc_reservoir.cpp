@@ -0,0 +1,274 @@
+#include "ooc_reservoir.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+
+// Each payload carries the grand index of its data point, so the
+// payload in every slot can be checked against 'idx_current'.
+struct payload_t
+{
+    max_size_t grand_index;
+    char filler[24];
+};
+
+
+
+void print_usage(std::string const & cmd, const double alpha, const unsigned s)
+{
+    std::cout
+        << "usage: " << cmd << std::endl
+        << "         --alpha alpha (default " << alpha << ")" << std::endl
+        << "         --cap  capacity  (required)" << std::endl
+        << "         -s  seed  (default " << s << ", for random)" << std::endl;
+}
+
+
+
+bool check(ooc_weighted_reservoir const & r)
+{
+    for (size_t i = 0; i < r.size(); ++i)
+    {
+        auto p = static_cast<payload_t const *>(r.payload(i));
+        if (p->grand_index != r.idx_current()[i] || r.idx_current()[i] >= r.grand_total())
+        {
+            std::cout << "payload in slot " << i << " does not match its data point" << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+
+
+// Probability that weight index 'i' is among the 'k' largest keys
+// 'w_j / u_j', u_j iid uniform(0, 1); as in test_stats.
+double es_inclusion(std::vector<double> const & w, size_t i, size_t k)
+{
+    const int n_steps = 2000;
+    std::vector<double> dp(k);
+
+    auto integrand = [&](double y) -> double
+    {
+        std::fill(dp.begin(), dp.end(), 0.);
+        dp[0] = 1.;
+        for (size_t j = 0; j < w.size(); ++j)
+        {
+            if (j == i)
+                continue;
+            double p = std::min(1., w[j] * y / w[i]);
+            for (size_t c = k - 1; c > 0; --c)
+                dp[c] = dp[c] * (1. - p) + dp[c - 1] * p;
+            dp[0] *= 1. - p;
+        }
+        double s = 0.;
+        for (auto x : dp)
+            s += x;
+        return s;
+    };
+
+    // Composite Simpson's rule.
+    double h = 1. / n_steps;
+    double s = integrand(0.) + integrand(1.);
+    for (int m = 1; m < n_steps; ++m)
+    {
+        s += integrand(m * h) * ((m % 2) ? 4. : 2.);
+    }
+    return s * h / 3.;
+}
+
+
+
+// With the landmark fixed, a key never changes once drawn, so however
+// the stream is batched, the reservoir at the end holds an
+// Efraimidis-Spirakis sample with weights '(t + 1)^alpha'. The
+// inclusion counts of a short stream over many trials are checked by
+// chi-square (upper tail 1e-4) and KS (1e-3), as in test_stats; the
+// batches are long enough that slots are overwritten within a call.
+bool check_inclusion(const double alpha, char const * file)
+{
+    const size_t k = 4;
+    const size_t batches[] = {9, 3, 12};
+    const size_t n = 24;
+    const max_size_t trials = 20000;
+
+    std::vector<max_size_t> counts(n, 0);
+    for (max_size_t trial = 0; trial < trials; ++trial)
+    {
+        ooc_weighted_reservoir r;
+        if (r.create(file, k, alpha, 0) < 0)
+        {
+            std::cout << "failed to create " << file << std::endl;
+            return false;
+        }
+        for (auto b : batches)
+            r.keep_n_write(b, nullptr);
+        for (size_t i = 0; i < r.size(); ++i)
+            ++counts[r.idx_current()[i]];
+    }
+    std::remove(file);
+
+    std::vector<double> w(n);
+    for (size_t t = 0; t < n; ++t)
+        w[t] = std::pow(double(t) + 1., alpha);
+
+    const double T = double(trials);
+    double chi2 = 0.;
+    double cdf_c = 0.;
+    double cdf_p = 0.;
+    double ks = 0.;
+    for (size_t t = 0; t < n; ++t)
+    {
+        double p = es_inclusion(w, t, k);
+        double e = T * p;
+        double d = counts[t] - e;
+        chi2 += d * d / (e * (1. - p));
+        cdf_c += counts[t] / (T * k);
+        cdf_p += p / k;
+        ks = std::max(ks, std::fabs(cdf_c - cdf_p));
+    }
+    const double df = double(n);
+    const double a = 2. / (9. * df);
+    const double chi2_crit = df * std::pow(1. - a + 3.719 * std::sqrt(a), 3.);
+    const double ks_crit = 1.949 / std::sqrt(T);
+
+    bool ok = (chi2 <= chi2_crit) && (ks <= ks_crit);
+    std::cout << (ok ? "Inclusion matches" : "Inclusion departs from")
+        << " Efraimidis-Spirakis:  chi2 " << chi2 << " (critical " << chi2_crit
+        << ");  KS " << ks << " (critical " << ks_crit << ")" << std::endl;
+    return ok;
+}
+
+
+
+int main(int argc, char ** argv)
+{
+    double alpha = 1.0;
+    unsigned seed = 0;
+    size_t capacity = 0;
+
+    int iarg = 1;
+    while (iarg < argc)
+    {
+        std::string arg{argv[iarg]};
+        ++iarg;
+        if (arg.compare("--alpha") == 0)
+        {
+            alpha = atof(argv[iarg]);
+        } else if (arg.compare("--cap") == 0)
+        {
+            capacity = atol(argv[iarg]);
+        } else if (arg.compare("-s") == 0)
+        {
+            seed = atoi(argv[iarg]);
+        } else
+        {
+            print_usage(argv[0], alpha, seed);
+            return -1;
+        }
+        iarg++;
+    }
+
+    if (capacity < 1 || alpha < 0.)
+    {
+        print_usage(argv[0], alpha, seed);
+        return -1;
+    }
+
+    if (seed == 0)
+    {
+        seed = global_randomize();
+    } else
+    {
+        global_seed(seed);
+    }
+    std::cout << "Random seed set to " << seed << std::endl;
+
+    const char * file = "ooc_reservoir.store";
+    const size_t n_max = capacity * 5;
+    std::unique_ptr<payload_t[]> batch{new payload_t[n_max]};
+
+    {
+        ooc_weighted_reservoir reservoir;
+        if (reservoir.create(file, capacity, alpha, sizeof(payload_t)) < 0)
+        {
+            std::cout << "failed to create " << file << std::endl;
+            return 1;
+        }
+
+        for (int repeat = 0; repeat < 5; ++repeat)
+        {
+            size_t n = pick_a_number(0.1, 1.0) * n_max;
+            for (size_t i = 0; i < n; ++i)
+            {
+                batch[i].grand_index = reservoir.grand_total() + i;
+            }
+            reservoir.keep_n_write(n, batch.get());
+            std::cout << "Wrote " << reservoir.n_written() << " of " << n
+                << " data points; size " << reservoir.size()
+                << ", grand total " << reservoir.grand_total() << std::endl;
+            if (!check(reservoir))
+                return 1;
+        }
+    }
+
+    // Reopen, which rebuilds the in-memory index, and continue.
+    ooc_weighted_reservoir reservoir;
+    if (reservoir.open(file) < 0)
+    {
+        std::cout << "failed to open " << file << std::endl;
+        return 1;
+    }
+    if (!check(reservoir))
+        return 1;
+
+    size_t n = n_max;
+    for (size_t i = 0; i < n; ++i)
+    {
+        batch[i].grand_index = reservoir.grand_total() + i;
+    }
+    reservoir.keep_n_write(n, batch.get());
+    std::cout << "After reopening, wrote " << reservoir.n_written() << " of " << n
+        << " data points; size " << reservoir.size()
+        << ", grand total " << reservoir.grand_total() << std::endl;
+    if (!check(reservoir))
+        return 1;
+
+    reservoir.close();
+
+    // A header that claims more than the file holds, or more slots
+    // than 32 bits index, is refused.
+    {
+        std::FILE * f = std::fopen(file, "r+b");
+        uint64_t cap = 0;
+        std::fseek(f, 8, SEEK_SET);
+        std::fread(&cap, sizeof(cap), 1, f);
+        for (uint64_t bad : {cap + 1, uint64_t(UINT32_MAX) + 1})
+        {
+            std::fseek(f, 8, SEEK_SET);
+            std::fwrite(&bad, sizeof(bad), 1, f);
+            std::fflush(f);
+            ooc_weighted_reservoir corrupt;
+            if (corrupt.open(file) == 0)
+            {
+                std::cout << "opened a store whose header claims capacity "
+                    << bad << std::endl;
+                return 1;
+            }
+        }
+        std::fclose(f);
+    }
+
+    std::remove(file);
+
+    if (!check_inclusion(alpha, file))
+        return 1;
+
+    return 0;
+}
@@ -1,9 +1,16 @@
-#include "random.h"
+#include "reservoir.h"
+#include "reservoir_core.h"
 
 #include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cmath>
 #include <ctime>
 #include <iostream>
 #include <memory>
+#include <numeric>
+#include <thread>
+#include <vector>
 
 
 typedef unsigned int s_t;
@@ -17,12 +24,308 @@ double time_diff(clock_t t0, clock_t t1)
 
 
 
+// Follow the reservoir with a user array holding the grand index of
+// each data point, rearranged by 'move_plan'; it must agree with
+// 'idx_current'.
+bool follow_plan(
+        weighted_reservoir const & reservoir,
+        std::vector<max_size_t> & data,
+        max_size_t old_total)
+{
+    std::vector<max_size_t> batch(reservoir.grand_total() - old_total);
+    std::iota(batch.begin(), batch.end(), old_total);
+    if (data.size() < reservoir.capacity())
+        data.resize(reservoir.capacity());
+            // Not reduced after 'shrink_to', whose plan moves data
+            // points from beyond the new capacity.
+    apply_plan(reservoir.move_plan(), data.data(), batch.data());
+    if (!std::equal(data.begin(), data.begin() + reservoir.size(), reservoir.idx_current()))
+    {
+        std::cout << "move plan does not agree with idx_current" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+
+
+// Every data point in the reservoir must be found at its location by
+// 'slot_of', and every other grand index must not be found.
+bool check_slot_index(weighted_reservoir const & reservoir)
+{
+    std::vector<size_t> slot(reservoir.grand_total(), size_t(-1));
+    for (size_t i = 0; i < reservoir.size(); ++i)
+    {
+        slot[reservoir.idx_current()[i]] = i;
+    }
+    for (max_size_t g = 0; g < reservoir.grand_total() + 10; ++g)
+    {
+        size_t expected = (g < slot.size()) ? slot[g] : size_t(-1);
+        if (reservoir.slot_of(g) != expected)
+        {
+            std::cout << "slot_of(" << g << ") is " << reservoir.slot_of(g)
+                << ", expected " << expected << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+
+
+// The per-thread URNGs: the first thread gets the global seed itself,
+// numbered workers get the same streams from run to run whatever the
+// order they start in, and the bulk fillers stay in range and are
+// reproducible.
+bool check_thread_urngs(const unsigned seed)
+{
+    global_seed(seed);
+    std::default_random_engine e{seed};
+    std::uniform_int_distribution<int> d{0, 1000000};
+    if (pick_a_number(0, 1000000) != d(e))
+    {
+        std::cout << "thread 0 does not draw from the global seed" << std::endl;
+        return false;
+    }
+
+    const unsigned n_threads = 4;
+    const size_t n = 1000;
+    auto run = [&](std::vector<std::vector<double>> & out, bool reverse)
+    {
+        global_seed(seed);
+        std::vector<std::thread> pool;
+        for (unsigned k = 0; k < n_threads; ++k)
+        {
+            unsigned i = reverse ? n_threads - k : k + 1;
+            pool.emplace_back([&out, i, n]()
+                    {
+                        global_seed_thread(i);
+                        out[i - 1].resize(n);
+                        pick_numbers(out[i - 1].data(), n, 0., 1.);
+                    });
+        }
+        for (auto & t : pool)
+            t.join();
+    };
+    std::vector<std::vector<double>> first(n_threads), second(n_threads);
+    run(first, false);
+    run(second, true);
+    for (unsigned i = 0; i < n_threads; ++i)
+    {
+        if (first[i] != second[i] || (i > 0 && first[i] == first[i - 1]))
+        {
+            std::cout << "thread " << i + 1 << " does not draw a stream of its own" << std::endl;
+            return false;
+        }
+    }
+
+    std::vector<int> ints(100000);
+    global_seed(seed);
+    pick_numbers(ints.data(), ints.size(), -3, 3);
+    std::vector<int> again(ints.size());
+    global_seed(seed);
+    pick_numbers(again.data(), again.size(), -3, 3);
+    std::vector<size_t> counts(7);
+    for (int x : ints)
+    {
+        if (x < -3 || x > 3)
+        {
+            std::cout << "pick_numbers out of range: " << x << std::endl;
+            return false;
+        }
+        ++counts[x + 3];
+    }
+    for (size_t c : counts)
+    {
+        if (std::abs(double(c) - ints.size() / 7.) > 5. * std::sqrt(ints.size() / 7.))
+        {
+            std::cout << "pick_numbers not uniform" << std::endl;
+            return false;
+        }
+    }
+    if (ints != again)
+    {
+        std::cout << "pick_numbers not reproducible" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+
+
+// The templates of reservoir_core.h, in a loop of the caller's own:
+// with 32-bit indices and the uniforms given, the same sample as
+// 'weighted_reservoir'; with 'float' keys and an engine of its own, a
+// full sample of distinct data points.
+template<typename Index, typename Key, typename URNG>
+Index core_loop(
+        const Index capacity, const double alpha, URNG & urng,
+        std::vector<int> const & sizes, std::vector<double> const & uniforms,
+        std::vector<max_size_t> & times, Key & threshold)
+{
+    typedef reservoir_candidate<Index, max_size_t, Key> candidate_t;
+    times.assign(capacity, 0);
+    std::vector<Key> u(capacity);
+    std::vector<candidate_t> quad(3 * size_t(capacity));
+    std::vector<Index> admitted(capacity);
+    std::vector<Key> given;
+    Index size = 0;
+    max_size_t total = 0;
+    max_size_t ref_L = 0;
+    size_t next = 0;
+    threshold = Key(0);
+    for (int n : sizes)
+    {
+        Key const * un = nullptr;
+        if (!uniforms.empty())
+        {
+            given.assign(uniforms.begin() + next, uniforms.begin() + next + n);
+            un = given.data();
+            next += n;
+        }
+        if (size + Index(n) <= capacity)
+        {
+            size += direct_inject(times.data(), u.data(), size, total, Index(n),
+                    Key(alpha), ref_L, threshold, admitted.data(), un, urng);
+        } else
+        {
+            Index m = sample_inject(times.data(), u.data(), size, total, Index(n),
+                    capacity, Key(alpha), ref_L, quad.data(), Index(quad.size()),
+                    threshold, un, urng);
+            for (Index i = 0; i < m; ++i)
+            {
+                times[i] = std::get<1>(quad[i]);
+                u[i] = std::get<2>(quad[i]);
+            }
+            size = m;
+        }
+        total += n;
+    }
+    times.resize(size);
+    std::sort(times.begin(), times.end());
+    return size;
+}
+
+
+bool check_core(const size_t capacity, const double alpha, const unsigned seed)
+{
+    const int n_calls = 100;
+    std::vector<int> sizes(n_calls);
+    global_seed(seed);
+    pick_numbers(sizes.data(), n_calls, 1, int(3 * capacity));
+    std::vector<double> uniforms(std::accumulate(sizes.begin(), sizes.end(), size_t(0)));
+    pick_numbers(uniforms.data(), uniforms.size(), 0., 1.);
+
+    weighted_reservoir reservoir(capacity, alpha);
+    size_t next = 0;
+    for (int n : sizes)
+    {
+        reservoir.keep_n_append(n, uniforms.data() + next);
+        next += n;
+    }
+    std::vector<max_size_t> expected(reservoir.idx_current(),
+            reservoir.idx_current() + reservoir.size());
+    std::sort(expected.begin(), expected.end());
+
+    std::vector<max_size_t> times;
+    double threshold;
+    std::default_random_engine unused;
+    core_loop<uint32_t, double>(uint32_t(capacity), alpha, unused, sizes, uniforms,
+            times, threshold);
+    if (times != expected || threshold != reservoir.threshold())
+    {
+        std::cout << "reservoir_core with 32-bit indices differs from weighted_reservoir" << std::endl;
+        return false;
+    }
+
+    std::mt19937 urng{seed};
+    float threshold_f;
+    uint32_t n = core_loop<uint32_t, float>(uint32_t(capacity), alpha, urng, sizes,
+            std::vector<double>(), times, threshold_f);
+    if (n != capacity || std::adjacent_find(times.begin(), times.end()) != times.end()
+            || times.back() >= reservoir.grand_total())
+    {
+        std::cout << "reservoir_core with float keys holds a bad sample" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+
+
+
+// With 'RESERVOIR_STATS' compiled in (test_reservoir_stats), every data
+// point offered is counted, and those accepted less those evicted are
+// the ones in the reservoir, whichever call changed it.
+bool check_stats(const size_t capacity, const double alpha, const unsigned seed)
+{
+    if (!weighted_reservoir::stats_enabled())
+        return true;
+
+    weighted_reservoir reservoir(capacity, alpha);
+    global_seed(seed);
+    auto consistent = [&reservoir](char const * call)
+    {
+        auto st = reservoir.stats();
+        if (st.n_offered != reservoir.grand_total()
+                || st.n_accepted - st.n_evicted != reservoir.size())
+        {
+            std::cout << "stats: after " << call << ", offered " << st.n_offered
+                << " of grand total " << reservoir.grand_total() << ", accepted "
+                << st.n_accepted << " less evicted " << st.n_evicted
+                << " for size " << reservoir.size() << std::endl;
+            return false;
+        }
+        return true;
+    };
+
+    for (int repeat = 0; repeat < 20; ++repeat)
+    {
+        size_t n = pick_a_number(0.01, 2.) * capacity + 1;
+        if (repeat % 2)
+        {
+            reservoir.keep_n_append(n);
+            if (!consistent("keep_n_append"))
+                return false;
+        } else
+        {
+            reservoir.remove_n_inject(n);
+            if (!consistent("remove_n_inject"))
+                return false;
+        }
+        if (repeat % 5 == 4)
+        {
+            reservoir.shrink_to((capacity + 1) / 2);
+            if (!consistent("shrink_to"))
+                return false;
+            reservoir.grow_to(capacity);
+            if (!consistent("grow_to"))
+                return false;
+        }
+        if (repeat % 7 == 6)
+        {
+            max_size_t t = reservoir.idx_current()[0];
+            reservoir.retract(t);
+            if (!consistent("retract"))
+                return false;
+        }
+    }
+    std::cout << "Stats agree with the reservoir over " << reservoir.grand_total()
+        << " data points" << std::endl;
+    return true;
+}
+
+
+
+
+
 void print_usage(std::string const & cmd, const double alpha, const unsigned s, const int v)
 {
     std::cout
         << "usage: " << cmd << std::endl
         << "         --alpha alpha (default " << alpha << ")" << std::endl
         << "         --cap  capacity  (required)" << std::endl
+        << "         --memory  new or huge  (default new; memory resource of the reservoir)" << std::endl
         << "         -s  seed  (default " << s << ", for random)" << std::endl
         << "         -v  verbosity  (default " << v << ")" << std::endl;
 }
@@ -35,6 +338,7 @@ int main(int argc, char ** argv)
     unsigned seed = 0;
     int verbose = 1;
     int capacity = 0;
+    std::string memory = "new";
 
 
     int iarg = 1;
@@ -50,6 +354,9 @@ int main(int argc, char ** argv)
         {
             capacity = atoi(argv[iarg]);
             assert(capacity > 0);
+        } else if (arg.compare("--memory") == 0)
+        {
+            memory = argv[iarg];
         } else if (arg.compare("-s") == 0)
         {
             seed = atoi(argv[iarg]);
@@ -64,7 +371,7 @@ int main(int argc, char ** argv)
         iarg++;
     }
 
-    if (capacity < 1)
+    if (capacity < 1 || (memory != "new" && memory != "huge"))
     {
         print_usage(argv[0], alpha, seed, verbose);
         return -1;
@@ -80,11 +387,14 @@ int main(int argc, char ** argv)
 
     std::cout << "Random seed set to " << seed << std::endl;
 
-    weighted_reservoir reservoir(capacity, alpha);
+    weighted_reservoir reservoir(capacity, alpha,
+            memory == "huge" ? hugepage_reservoir_resource() : default_reservoir_resource());
 
 
     std::cout << "Reservoir initiated with capacity " << capacity << std::endl;
 
+    reservoir.enable_slot_index();
+
     const int n_max = capacity * 5;
 
     clock_t t0, t1;
@@ -96,16 +406,27 @@ int main(int argc, char ** argv)
     }
 
 
+    std::vector<max_size_t> data;
+
     for (int repeat = 0; repeat < 5; ++repeat)
     {
         s_t n_provided = pick_a_number(0.1, 1.0) * n_max;
         auto old_size = reservoir.size();
+        auto old_total = reservoir.grand_total();
 
         t0 = clock();
         reservoir.keep_n_append(n_provided);
         t1 = clock();
         run_time = time_diff(t0, t1);
 
+        if (!std::is_sorted(reservoir.idx_kept(), reservoir.idx_kept() + reservoir.n_kept()))
+        {
+            std::cout << "idx_kept is not in increasing order" << std::endl;
+            return 1;
+        }
+        if (!follow_plan(reservoir, data, old_total) || !check_slot_index(reservoir))
+            return 1;
+
         if (verbose > 0)
         {
             std::cout << "Took " << run_time << " seconds to add "
@@ -153,6 +474,227 @@ int main(int argc, char ** argv)
         }
     }
 
+    // Shrink to half the capacity and grow back, then sample on.
+    {
+        auto old_size = reservoir.size();
+        auto old_times = std::vector<max_size_t>(
+                reservoir.idx_current(), reservoir.idx_current() + old_size);
+        reservoir.shrink_to((capacity + 1) / 2);
+        if (reservoir.capacity() != size_t(capacity + 1) / 2
+                || reservoir.size() != std::min(old_size, reservoir.capacity())
+                || reservoir.n_kept() != reservoir.size() || reservoir.n_appended() != 0)
+        {
+            std::cout << "shrink_to: wrong capacity, size or keep view" << std::endl;
+            return 1;
+        }
+        for (size_t i = 0; i < reservoir.n_kept(); ++i)
+        {
+            if (old_times[reservoir.idx_kept()[i]] != reservoir.idx_current()[i])
+            {
+                std::cout << "shrink_to: keep view does not agree with idx_current" << std::endl;
+                return 1;
+            }
+        }
+        if (!follow_plan(reservoir, data, reservoir.grand_total()) || !check_slot_index(reservoir))
+            return 1;
+
+        reservoir.grow_to(capacity);
+        if (reservoir.capacity() != size_t(capacity) || reservoir.n_kept() != reservoir.size()
+                || reservoir.move_plan().n_relocations + reservoir.move_plan().n_insertions != 0)
+        {
+            std::cout << "grow_to: wrong capacity or views" << std::endl;
+            return 1;
+        }
+        if (!check_slot_index(reservoir))
+            return 1;
+
+        for (int repeat = 0; repeat < 3; ++repeat)
+        {
+            auto old_total = reservoir.grand_total();
+            reservoir.keep_n_append(std::max<s_t>(1, pick_a_number(0.01, 0.5) * capacity));
+            if (!follow_plan(reservoir, data, old_total) || !check_slot_index(reservoir))
+                return 1;
+        }
+
+        if (verbose > 0)
+        {
+            std::cout << "Shrank to " << (capacity + 1) / 2 << " and grew back to "
+                << capacity << "; size now " << reservoir.size() << std::endl;
+        }
+    }
+
+    // Retract every other data point in the reservoir, plus some that
+    // are not in it, one twice; then sample on.
+    {
+        auto old_size = reservoir.size();
+        auto old_times = std::vector<max_size_t>(
+                reservoir.idx_current(), reservoir.idx_current() + old_size);
+        std::vector<max_size_t> gone;
+        for (size_t i = 0; i < old_size; i += 2)
+            gone.push_back(old_times[i]);
+        std::vector<max_size_t> request(gone);
+        request.push_back(gone.front());
+        request.push_back(reservoir.grand_total());
+        for (max_size_t g = 0; g < 10 && g < reservoir.grand_total(); ++g)
+        {
+            if (std::find(old_times.begin(), old_times.end(), g) == old_times.end())
+                request.push_back(g);
+        }
+
+        size_t n_gone = reservoir.retract(request.size(), request.data());
+        if (n_gone != gone.size() || reservoir.size() != old_size - gone.size()
+                || reservoir.n_kept() != reservoir.size() || reservoir.n_appended() != 0
+                || reservoir.n_removed() != 0)
+        {
+            std::cout << "retract: wrong count, size or keep view" << std::endl;
+            return 1;
+        }
+        for (size_t i = 0; i < reservoir.n_kept(); ++i)
+        {
+            if (reservoir.idx_kept()[i] != 2 * i + 1
+                    || reservoir.idx_current()[i] != old_times[2 * i + 1])
+            {
+                std::cout << "retract: keep view does not list the survivors in order" << std::endl;
+                return 1;
+            }
+        }
+        std::vector<max_size_t> left(reservoir.idx_current(), reservoir.idx_current() + reservoir.size());
+        std::vector<max_size_t> expected;
+        for (size_t i = 1; i < old_size; i += 2)
+            expected.push_back(old_times[i]);
+        std::sort(left.begin(), left.end());
+        std::sort(expected.begin(), expected.end());
+        if (left != expected)
+        {
+            std::cout << "retract: survivors are not the data points left" << std::endl;
+            return 1;
+        }
+        if (!follow_plan(reservoir, data, reservoir.grand_total()) || !check_slot_index(reservoir))
+            return 1;
+
+        for (int repeat = 0; repeat < 3; ++repeat)
+        {
+            auto old_total = reservoir.grand_total();
+            reservoir.remove_n_inject(std::max<s_t>(1, pick_a_number(0.01, 0.5) * capacity));
+            if (!follow_plan(reservoir, data, old_total) || !check_slot_index(reservoir))
+                return 1;
+        }
+
+        if (verbose > 0)
+        {
+            std::cout << "Retracted " << n_gone << " of " << request.size()
+                << "; size now " << reservoir.size() << std::endl;
+        }
+    }
+
+    // A large batch in steps of bounded time, followed step by step;
+    // for alpha = 0, the same sample as one call.
+    {
+        weighted_reservoir stepped(capacity, alpha);
+        weighted_reservoir whole(capacity, alpha);
+        stepped.enable_slot_index();
+        std::vector<max_size_t> stepped_data;
+
+        global_seed(seed + 1);
+        stepped.keep_n_append(2 * capacity);
+        global_seed(seed + 1);
+        whole.keep_n_append(2 * capacity);
+        if (!follow_plan(stepped, stepped_data, 0))
+            return 1;
+
+        const size_t n = 20 * capacity;
+        auto batch_start = stepped.grand_total();
+        int n_steps = 0;
+        double longest = 0.;
+
+        global_seed(seed + 2);
+        stepped.begin_batch(n, false);
+        bool done = false;
+        while (!done)
+        {
+            t0 = clock();
+            done = stepped.step_for(1e-4);
+            t1 = clock();
+            longest = std::max(longest, time_diff(t0, t1));
+            ++n_steps;
+            if (!follow_plan(stepped, stepped_data, batch_start) || !check_slot_index(stepped))
+                return 1;
+        }
+        if (stepped.grand_total() != batch_start + n || stepped.batch_remaining() != 0)
+        {
+            std::cout << "step_for: batch not fully taken" << std::endl;
+            return 1;
+        }
+
+        global_seed(seed + 2);
+        whole.remove_n_inject(n);
+        std::vector<max_size_t> a(stepped.idx_current(), stepped.idx_current() + stepped.size());
+        std::vector<max_size_t> b(whole.idx_current(), whole.idx_current() + whole.size());
+        std::sort(a.begin(), a.end());
+        std::sort(b.begin(), b.end());
+        if (alpha == 0. && a != b)
+        {
+            std::cout << "step_for: sample differs from that of one call" << std::endl;
+            return 1;
+        }
+
+        if (verbose > 0)
+        {
+            std::cout << "Took a batch of " << n << " in " << n_steps
+                << " steps, the longest " << longest << " seconds" << std::endl;
+        }
+    }
+
+    if (!check_thread_urngs(seed))
+        return 1;
+
+    if (!check_core(capacity, alpha, seed))
+        return 1;
+
+    if (!check_stats(capacity, alpha, seed))
+        return 1;
+
+    // A bulk load on several threads leaves a full reservoir that a
+    // user array can follow, and that later calls go on from.
+    {
+        weighted_reservoir bulk(capacity, alpha);
+        weighted_reservoir serial(capacity, alpha);
+        bulk.enable_slot_index();
+        std::vector<max_size_t> bulk_data;
+        const size_t n = 50 * capacity;
+
+        auto w0 = std::chrono::steady_clock::now();
+        bulk.bulk_append(n, 4);
+        auto w1 = std::chrono::steady_clock::now();
+        serial.keep_n_append(n);
+        auto w2 = std::chrono::steady_clock::now();
+        double bulk_time = std::chrono::duration<double>(w1 - w0).count();
+        double serial_time = std::chrono::duration<double>(w2 - w1).count();
+
+        if (bulk.size() != size_t(capacity) || bulk.grand_total() != n
+                || bulk.n_kept() != 0 || bulk.n_appended() != size_t(capacity)
+                || !(bulk.threshold() > 0.))
+        {
+            std::cout << "bulk_append: unexpected state" << std::endl;
+            return 1;
+        }
+        if (!follow_plan(bulk, bulk_data, 0) || !check_slot_index(bulk))
+            return 1;
+        for (int repeat = 0; repeat < 3; ++repeat)
+        {
+            auto old_total = bulk.grand_total();
+            bulk.keep_n_append(capacity);
+            if (!follow_plan(bulk, bulk_data, old_total) || !check_slot_index(bulk))
+                return 1;
+        }
+
+        if (verbose > 0)
+        {
+            std::cout << "Loaded " << n << " in bulk on 4 threads in " << bulk_time
+                << " seconds, with one keep_n_append in " << serial_time << std::endl;
+        }
+    }
+
     reservoir.clear();
 
     global_seed(seed);
@@ -170,12 +712,16 @@ int main(int argc, char ** argv)
         s_t n_provided = pick_a_number(0.1, 1.) * n_max;
 
         auto old_size = reservoir.size();
+        auto old_total = reservoir.grand_total();
 
         t0 = clock();
         reservoir.remove_n_inject(n_provided);
         t1 = clock();
         run_time = time_diff(t0, t1);
 
+        if (!follow_plan(reservoir, data, old_total) || !check_slot_index(reservoir))
+            return 1;
+
         if (verbose > 0)
         {
             std::cout << "Took " << run_time << " seconds to add "
@@ -230,6 +776,20 @@ int main(int argc, char ** argv)
     }
 
 
+    if (verbose > 0 && weighted_reservoir::stats_enabled())
+    {
+        auto st = reservoir.stats();
+        std::cout << "Stats: calls " << st.n_calls
+            << " (sampled " << st.n_sampled_calls << ");  offered " << st.n_offered
+            << ";  accepted " << st.n_accepted << ";  evicted " << st.n_evicted
+            << ";  ref_L moves " << st.n_ref_L_moves << std::endl
+            << "  ticks: keys " << st.ticks_keys << ";  select " << st.ticks_select
+            << ";  bookkeeping " << st.ticks_bookkeeping << std::endl
+            << "  allocations " << st.n_allocations << " ("
+            << st.bytes_allocated << " bytes)" << std::endl << std::endl;
+    }
+
+
     t0 = clock();
     reservoir.export_to_file("reservoir.h5");
     t1 = clock();
@@ -0,0 +1,216 @@
+#include "shm_reservoir.h"
+
+#include <algorithm>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+
+// A writer process samples batches into a shared-memory reservoir,
+// alternating 'keep_n_append' and 'remove_n_inject', while a reader
+// process takes snapshots concurrently.
+//
+// Each payload carries the grand index of its data point, so every
+// snapshot can be checked: the payload in each slot must match
+// 'idx_current', and the grand indices must be distinct and below
+// 'grand_total'.
+struct payload_t
+{
+    max_size_t grand_index;
+    char filler[24];
+};
+
+
+
+void print_usage(std::string const & cmd, const double alpha, const unsigned s)
+{
+    std::cout
+        << "usage: " << cmd << std::endl
+        << "         --alpha alpha (default " << alpha << ")" << std::endl
+        << "         --cap  capacity  (required)" << std::endl
+        << "         -s  seed  (default " << s << ", for random)" << std::endl;
+}
+
+
+
+// Return the number of inconsistent snapshots.
+int run_reader(char const * name, max_size_t final_total)
+{
+    shm_reservoir_reader reader;
+    if (reader.open(name) < 0)
+    {
+        std::cout << "reader: failed to open " << name << std::endl;
+        return 1;
+    }
+
+    std::vector<max_size_t> idx;
+    std::vector<max_size_t> pay;
+    max_size_t grand_total = 0;
+    size_t n_reads = 0;
+    int n_bad = 0;
+
+    while (grand_total < final_total)
+    {
+        bool ok = reader.read([&](shm_reservoir_view const & v)
+                {
+                    grand_total = v.grand_total;
+                    idx.assign(v.idx_current, v.idx_current + v.size);
+                    pay.resize(v.size);
+                    for (size_t i = 0; i < v.size; ++i)
+                    {
+                        pay[i] = reinterpret_cast<payload_t const *>(
+                                v.payload + i * v.payload_bytes)->grand_index;
+                    }
+                });
+        if (!ok)
+            continue;
+        ++n_reads;
+
+        bool good = (idx == pay);
+        good = good && std::all_of(idx.begin(), idx.end(),
+                [&](max_size_t t) { return t < grand_total; });
+        std::sort(idx.begin(), idx.end());
+        good = good && std::adjacent_find(idx.begin(), idx.end()) == idx.end();
+        if (!good)
+            ++n_bad;
+    }
+
+    std::cout << "reader: " << n_reads << " snapshots, " << n_bad << " inconsistent" << std::endl;
+    return n_bad;
+}
+
+
+
+int main(int argc, char ** argv)
+{
+    double alpha = 1.0;
+    unsigned seed = 0;
+    size_t capacity = 0;
+
+    int iarg = 1;
+    while (iarg < argc)
+    {
+        std::string arg{argv[iarg]};
+        ++iarg;
+        if (arg.compare("--alpha") == 0)
+        {
+            alpha = atof(argv[iarg]);
+        } else if (arg.compare("--cap") == 0)
+        {
+            capacity = atol(argv[iarg]);
+        } else if (arg.compare("-s") == 0)
+        {
+            seed = atoi(argv[iarg]);
+        } else
+        {
+            print_usage(argv[0], alpha, seed);
+            return -1;
+        }
+        iarg++;
+    }
+
+    if (capacity < 1 || alpha < 0.)
+    {
+        print_usage(argv[0], alpha, seed);
+        return -1;
+    }
+
+    if (seed == 0)
+    {
+        seed = global_randomize();
+    } else
+    {
+        global_seed(seed);
+    }
+    std::cout << "Random seed set to " << seed << std::endl;
+
+    std::string name = "/test_shm_reservoir." + std::to_string(::getpid());
+    const size_t n_max = capacity * 2;
+    std::vector<size_t> sizes(500);
+    max_size_t final_total = 0;
+    for (auto & n : sizes)
+    {
+        n = std::max<size_t>(1, pick_a_number(0.01, 1.0) * n_max);
+        final_total += n;
+    }
+
+    shm_reservoir_writer writer;
+    if (writer.create(name.c_str(), capacity, alpha, sizeof(payload_t)) < 0)
+    {
+        std::cout << "failed to create " << name << std::endl;
+        return 1;
+    }
+
+    pid_t pid = ::fork();
+    if (pid == 0)
+    {
+        ::_exit(run_reader(name.c_str(), final_total) == 0 ? 0 : 1);
+    }
+
+    std::unique_ptr<payload_t[]> batch{new payload_t[n_max]};
+    for (size_t k = 0; k < sizes.size(); ++k)
+    {
+        size_t n = sizes[k];
+        for (size_t i = 0; i < n; ++i)
+        {
+            batch[i].grand_index = writer.reservoir().grand_total() + i;
+        }
+        if (k % 2 == 0)
+            writer.keep_n_append(n, batch.get());
+        else
+            writer.remove_n_inject(n, batch.get());
+    }
+    std::cout << "writer: " << sizes.size() << " batches, grand total "
+        << writer.reservoir().grand_total() << std::endl;
+
+    int status = 0;
+    ::waitpid(pid, &status, 0);
+
+    // The segment is laid out for its capacity: resizing is refused and
+    // changes nothing, and the writer goes on as before.
+    std::vector<max_size_t> before(writer.reservoir().idx_current(),
+            writer.reservoir().idx_current() + writer.reservoir().size());
+    bool resized = writer.reservoir().shrink_to((capacity + 1) / 2)
+        || writer.reservoir().grow_to(2 * capacity);
+    std::vector<max_size_t> after(writer.reservoir().idx_current(),
+            writer.reservoir().idx_current() + writer.reservoir().size());
+    if (resized || writer.reservoir().capacity() != capacity || after != before)
+    {
+        std::cout << "resizing a shared-memory reservoir was not refused" << std::endl;
+        writer.unlink();
+        return 1;
+    }
+    for (size_t i = 0; i < n_max; ++i)
+    {
+        batch[i].grand_index = writer.reservoir().grand_total() + i;
+    }
+    writer.keep_n_append(n_max, batch.get());
+    shm_reservoir_reader reader;
+    bool ok = false;
+    bool consistent = reader.open(name.c_str()) == 0
+        && reader.read([&](shm_reservoir_view const & v)
+            {
+                ok = v.capacity == capacity && v.size == capacity;
+                for (size_t i = 0; ok && i < v.size; ++i)
+                {
+                    ok = v.idx_current[i] == reinterpret_cast<payload_t const *>(
+                            v.payload + i * v.payload_bytes)->grand_index;
+                }
+            });
+    writer.unlink();
+    if (!consistent || !ok)
+    {
+        std::cout << "writer or reader off after a refused resize" << std::endl;
+        return 1;
+    }
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        std::cout << "FAILED" << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,180 @@
+#include "reservoir_snapshot.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <vector>
+
+
+// A writer thread ingests batches with 'remove_n_inject' and publishes
+// a snapshot after each, while reader threads acquire snapshots
+// concurrently, some of which they hold across several publishes.
+//
+// Each payload carries the grand index of its data point, so every
+// snapshot can be checked: the payload in each slot must match
+// 'idx_current', the grand indices must be distinct and below
+// 'grand_total', and versions seen by a reader must not decrease.
+struct payload_t
+{
+    max_size_t grand_index;
+    char filler[24];
+};
+
+
+
+void print_usage(std::string const & cmd, const double alpha, const unsigned s)
+{
+    std::cout
+        << "usage: " << cmd << std::endl
+        << "         --alpha alpha (default " << alpha << ")" << std::endl
+        << "         --cap  capacity  (required)" << std::endl
+        << "         --readers  number of reader threads  (default 4)" << std::endl
+        << "         -s  seed  (default " << s << ", for random)" << std::endl;
+}
+
+
+
+bool check(reservoir_snapshot const & s)
+{
+    std::vector<max_size_t> idx(s.idx_current(), s.idx_current() + s.size());
+    for (size_t i = 0; i < s.size(); ++i)
+    {
+        auto p = static_cast<payload_t const *>(s.payload(i));
+        if (p->grand_index != idx[i] || idx[i] >= s.grand_total())
+            return false;
+    }
+    std::sort(idx.begin(), idx.end());
+    return std::adjacent_find(idx.begin(), idx.end()) == idx.end();
+}
+
+
+
+int main(int argc, char ** argv)
+{
+    double alpha = 1.0;
+    unsigned seed = 0;
+    size_t capacity = 0;
+    int n_readers = 4;
+
+    int iarg = 1;
+    while (iarg < argc)
+    {
+        std::string arg{argv[iarg]};
+        ++iarg;
+        if (arg.compare("--alpha") == 0)
+        {
+            alpha = atof(argv[iarg]);
+        } else if (arg.compare("--cap") == 0)
+        {
+            capacity = atol(argv[iarg]);
+        } else if (arg.compare("--readers") == 0)
+        {
+            n_readers = atoi(argv[iarg]);
+        } else if (arg.compare("-s") == 0)
+        {
+            seed = atoi(argv[iarg]);
+        } else
+        {
+            print_usage(argv[0], alpha, seed);
+            return -1;
+        }
+        iarg++;
+    }
+
+    if (capacity < 1 || alpha < 0. || n_readers < 1)
+    {
+        print_usage(argv[0], alpha, seed);
+        return -1;
+    }
+
+    if (seed == 0)
+    {
+        seed = global_randomize();
+    } else
+    {
+        global_seed(seed);
+    }
+    std::cout << "Random seed set to " << seed << std::endl;
+
+    reservoir_snapshot_publisher publisher;
+    std::atomic<bool> done{false};
+    std::atomic<int> n_bad{0};
+    std::atomic<size_t> n_reads{0};
+
+    std::vector<std::thread> readers;
+    for (int k = 0; k < n_readers; ++k)
+    {
+        readers.emplace_back([&, k]()
+                {
+                    auto reader = publisher.register_reader();
+                    if (!reader.valid())
+                    {
+                        ++n_bad;
+                        return;
+                    }
+                    uint64_t last_version = 0;
+                    reservoir_snapshot held;
+                    size_t i = 0;
+                    while (!done.load())
+                    {
+                        auto s = reader.acquire();
+                        if (s.version() < last_version || !check(s))
+                            ++n_bad;
+                        last_version = s.version();
+                        ++i;
+                        if (i % (16 * (k + 1)) == 0)
+                        {
+                            // Hold this one for a while.
+                            held = std::move(s);
+                        }
+                        if (held.valid() && !check(held))
+                            ++n_bad;
+                    }
+                    n_reads += i;
+                });
+    }
+
+    weighted_reservoir reservoir(capacity, alpha);
+    std::unique_ptr<payload_t[]> payload{new payload_t[capacity]};
+    const size_t n_max = capacity * 2;
+    std::unique_ptr<payload_t[]> batch{new payload_t[n_max]};
+    const int n_batches = 2000;
+
+    for (int k = 0; k < n_batches; ++k)
+    {
+        size_t n = std::max<size_t>(1, pick_a_number(0.01, 1.0) * n_max);
+        for (size_t i = 0; i < n; ++i)
+        {
+            batch[i].grand_index = reservoir.grand_total() + i;
+        }
+
+        auto n_before = reservoir.size();
+        reservoir.remove_n_inject(n);
+        for (size_t j = 0; j < reservoir.n_injected(); ++j)
+        {
+            size_t slot = (j < reservoir.n_removed())
+                ? reservoir.idx_removed()[j] : n_before + (j - reservoir.n_removed());
+            payload[slot] = batch[reservoir.idx_injected()[j]];
+        }
+
+        publisher.publish(reservoir, payload.get(), sizeof(payload_t));
+    }
+
+    done.store(true);
+    for (auto & t : readers)
+        t.join();
+
+    std::cout << "writer: " << publisher.version() << " versions in "
+        << publisher.n_buffers() << " buffers;  readers: " << n_reads.load()
+        << " snapshots, " << n_bad.load() << " inconsistent" << std::endl;
+
+    if (n_bad.load() > 0)
+    {
+        std::cout << "FAILED" << std::endl;
+        return 1;
+    }
+    return 0;
+}
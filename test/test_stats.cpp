@@ -0,0 +1,593 @@
+#include "reservoir.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+
+// Statistical-accuracy gate for 'weighted_reservoir'.
+//
+// A small stream of 'N' data points is fed, in a fixed sequence of
+// batches, into a fresh reservoir of small capacity 'k', over many
+// independent trials. The empirical inclusion probability of each
+// grand index at the end is compared with its theoretical value by
+//
+//   - a chi-square test over all grand indices, and
+//   - a Kolmogorov-Smirnov test on the distribution of included grand
+//     indices;
+//
+// both at significance level 1e-4 (chi-square) or 1e-3 (KS).
+//
+// Theoretical inclusion probabilities are known in closed form for
+// alpha = 0 (k / N, however the stream is batched), and, for
+// alpha > 0, when the whole stream arrives in one batch into an empty
+// reservoir, in which case sampling is Efraimidis-Spirakis with weights
+// '(t / N)^alpha'; that probability is computed by numerical
+// integration below.
+//
+// Scenarios cover 'keep_n_append', 'remove_n_inject', and round trips
+// through 'export_to_file'/'import_from_file' and
+// 'export_reservoirs'/'import_reservoirs' mid-stream.
+// With 'shrink_to' and 'grow_to' mid-stream, inclusion for alpha = 0
+// still depends only on the ranks of the keys, hence stays uniform;
+// the stream after the resize is long enough that the reservoir is
+// almost surely full at the end.
+// A first batch loaded by 'bulk_append' must be indistinguishable from
+// one taken by 'keep_n_append', alone or followed by more batches.
+// In addition, 'keep_n_append' and 'remove_n_inject' must choose the
+// same data points when given the same random stream.
+//
+// The Horvitz-Thompson estimates ('estimate_*') are checked for bias
+// against the known totals over the stream, in the same settings where
+// inclusion probabilities are known exactly, right after the
+// reservoir has been shrunk and grown, while it fills up again, and
+// after data points have been retracted, against the totals over the
+// surviving stream.
+//
+// Exit status is nonzero if any check fails. Every change to the
+// sampling path should pass this before it ships.
+
+
+
+enum class roundtrip_t { none, file, bulk, resize, retract, parallel };
+    // 'resize' is not a round trip to disk, but 'shrink_to' half the
+    // capacity and 'grow_to' it again at the same point of the stream;
+    // 'retract' takes back every third data point offered so far;
+    // 'parallel' loads the first batch by 'bulk_append' on 3 threads.
+
+
+struct scenario_t
+{
+    std::string name;
+    double alpha;
+    size_t capacity;
+    std::vector<size_t> batches;
+    bool keep;        // 'keep_n_append' if true, else 'remove_n_inject'
+    roundtrip_t roundtrip;
+        // Export and re-import, or resize, after the first half of the
+        // batches.
+    max_size_t trials;
+};
+
+
+
+size_t stream_length(scenario_t const & s)
+{
+    size_t n = 0;
+    for (auto b : s.batches)
+        n += b;
+    return n;
+}
+
+
+
+void ingest(weighted_reservoir & r, size_t n, bool keep)
+{
+    if (keep)
+        r.keep_n_append(n);
+    else
+        r.remove_n_inject(n);
+}
+
+
+
+void count_current(weighted_reservoir const & r, std::vector<max_size_t> & counts)
+{
+    auto idx = r.idx_current();
+    for (size_t i = 0; i < r.size(); ++i)
+    {
+        ++counts[idx[i]];
+    }
+}
+
+
+
+std::vector<max_size_t> run_scenario(scenario_t const & s)
+{
+    std::vector<max_size_t> counts(stream_length(s), 0);
+    size_t half = s.batches.size() / 2;
+    char const * file = "test_stats.h5";
+
+    if (s.roundtrip == roundtrip_t::bulk)
+    {
+        // Trials run in groups that are exported and imported together.
+        const max_size_t group = 1000;
+        for (max_size_t t = 0; t < s.trials; t += group)
+        {
+            max_size_t g = std::min(group, s.trials - t);
+            std::vector<weighted_reservoir> rs;
+            for (max_size_t i = 0; i < g; ++i)
+            {
+                rs.emplace_back(s.capacity, s.alpha);
+                for (size_t b = 0; b < half; ++b)
+                    ingest(rs.back(), s.batches[b], s.keep);
+            }
+            std::vector<weighted_reservoir> again;
+            if (export_reservoirs(file, rs) < 0 || import_reservoirs(file, again) < 0)
+            {
+                std::cout << "bulk export/import failed" << std::endl;
+                std::exit(1);
+            }
+            for (auto & r : again)
+            {
+                for (size_t b = half; b < s.batches.size(); ++b)
+                    ingest(r, s.batches[b], s.keep);
+                count_current(r, counts);
+            }
+        }
+        std::remove(file);
+        return counts;
+    }
+
+    for (max_size_t t = 0; t < s.trials; ++t)
+    {
+        weighted_reservoir r(s.capacity, s.alpha);
+        if (s.roundtrip == roundtrip_t::file)
+        {
+            for (size_t b = 0; b < half; ++b)
+                ingest(r, s.batches[b], s.keep);
+            weighted_reservoir again;
+            if (r.export_to_file(file) < 0 || again.import_from_file(file) < 0)
+            {
+                std::cout << "export/import failed" << std::endl;
+                std::exit(1);
+            }
+            for (size_t b = half; b < s.batches.size(); ++b)
+                ingest(again, s.batches[b], s.keep);
+            count_current(again, counts);
+        } else if (s.roundtrip == roundtrip_t::resize)
+        {
+            for (size_t b = 0; b < half; ++b)
+                ingest(r, s.batches[b], s.keep);
+            r.shrink_to((s.capacity + 1) / 2);
+            r.grow_to(s.capacity);
+            for (size_t b = half; b < s.batches.size(); ++b)
+                ingest(r, s.batches[b], s.keep);
+            count_current(r, counts);
+        } else if (s.roundtrip == roundtrip_t::parallel)
+        {
+            r.bulk_append(s.batches[0], 3);
+            for (size_t b = 1; b < s.batches.size(); ++b)
+                ingest(r, s.batches[b], s.keep);
+            count_current(r, counts);
+        } else
+        {
+            for (auto b : s.batches)
+                ingest(r, b, s.keep);
+            count_current(r, counts);
+        }
+    }
+    if (s.roundtrip == roundtrip_t::file)
+        std::remove(file);
+    return counts;
+}
+
+
+
+// Probability that weight index 'i' is among the 'k' largest keys
+// 'w_j / u_j', u_j iid uniform(0, 1).
+//
+// With 'y = w_i / key_i', which is uniform(0, 1),
+//
+//   P(i chosen) = \int_0^1 P(#{j != i: key_j > w_i / y} < k) dy,
+//
+// where 'P(key_j > w_i / y) = min(1, w_j y / w_i)' independently
+// over 'j'; the count is Poisson-binomial, evaluated by recursion.
+double es_inclusion(std::vector<double> const & w, size_t i, size_t k)
+{
+    if (w[i] <= 0.)
+        return 0.;
+
+    const int n_steps = 2000;
+    std::vector<double> dp(k);
+
+    auto integrand = [&](double y) -> double
+    {
+        std::fill(dp.begin(), dp.end(), 0.);
+        dp[0] = 1.;
+        for (size_t j = 0; j < w.size(); ++j)
+        {
+            if (j == i)
+                continue;
+            double p = std::min(1., w[j] * y / w[i]);
+            for (size_t c = k - 1; c > 0; --c)
+                dp[c] = dp[c] * (1. - p) + dp[c - 1] * p;
+            dp[0] *= 1. - p;
+        }
+        double s = 0.;
+        for (auto x : dp)
+            s += x;
+        return s;
+    };
+
+    // Composite Simpson's rule.
+    double h = 1. / n_steps;
+    double s = integrand(0.) + integrand(1.);
+    for (int m = 1; m < n_steps; ++m)
+    {
+        s += integrand(m * h) * ((m % 2) ? 4. : 2.);
+    }
+    return s * h / 3.;
+}
+
+
+
+std::vector<double> theoretical(scenario_t const & s)
+{
+    size_t n = stream_length(s);
+    std::vector<double> p(n);
+
+    if (s.alpha == 0.)
+    {
+        std::fill(p.begin(), p.end(), std::min(1., double(s.capacity) / n));
+        return p;
+    }
+
+    assert(s.batches.size() == 1);
+    std::vector<double> w(n);
+    for (size_t t = 0; t < n; ++t)
+    {
+        w[t] = std::pow(double(t) / n, s.alpha);
+    }
+    for (size_t t = 0; t < n; ++t)
+    {
+        p[t] = es_inclusion(w, t, s.capacity);
+    }
+    return p;
+}
+
+
+
+// Upper quantile of chi-square with 'df' degrees of freedom at the
+// standard normal quantile 'z' (Wilson-Hilferty).
+double chi2_critical(double df, double z)
+{
+    double a = 2. / (9. * df);
+    return df * std::pow(1. - a + z * std::sqrt(a), 3.);
+}
+
+
+
+bool check_scenario(scenario_t const & s, int verbose)
+{
+    auto counts = run_scenario(s);
+    auto p = theoretical(s);
+    const double T = double(s.trials);
+
+    double chi2 = 0.;
+    int df = 0;
+    double max_z = 0.;
+    for (size_t i = 0; i < p.size(); ++i)
+    {
+        if (p[i] <= 0. || p[i] >= 1.)
+        {
+            if (double(counts[i]) != p[i] * T)
+            {
+                std::cout << "  grand index " << i << " has inclusion probability "
+                    << p[i] << " but was chosen " << counts[i] << " times" << std::endl;
+                return false;
+            }
+            continue;
+        }
+        double e = T * p[i];
+        double d = counts[i] - e;
+        double z2 = d * d / (e * (1. - p[i]));
+        chi2 += z2;
+        max_z = std::max(max_z, std::sqrt(z2));
+        ++df;
+    }
+    double chi2_crit = (df > 0) ? chi2_critical(df, 3.719) : 0.;
+        // z = 3.719 <=> upper tail 1e-4.
+
+    // KS on the CDF of included grand indices. The T * k included
+    // indices are negatively correlated within a trial, so taking
+    // 'T' as the sample size is conservative.
+    double total_c = 0.;
+    double total_p = 0.;
+    for (size_t i = 0; i < p.size(); ++i)
+    {
+        total_c += counts[i];
+        total_p += p[i];
+    }
+    double cdf_c = 0.;
+    double cdf_p = 0.;
+    double ks = 0.;
+    for (size_t i = 0; i < p.size(); ++i)
+    {
+        cdf_c += counts[i] / total_c;
+        cdf_p += p[i] / total_p;
+        ks = std::max(ks, std::fabs(cdf_c - cdf_p));
+    }
+    double ks_crit = 1.949 / std::sqrt(T);
+        // Upper tail 1e-3.
+
+    bool ok = (chi2 <= chi2_crit) && (ks <= ks_crit);
+
+    std::cout << (ok ? "PASS  " : "FAIL  ") << s.name
+        << ":  chi2 " << chi2 << " (df " << df << ", critical " << chi2_crit << ")"
+        << ";  max |z| " << max_z
+        << ";  KS " << ks << " (critical " << ks_crit << ")" << std::endl;
+
+    if (verbose > 0 || !ok)
+    {
+        for (size_t i = 0; i < p.size(); ++i)
+        {
+            std::cout << "    " << i << ":  expected " << p[i]
+                << ",  observed " << counts[i] / T << std::endl;
+        }
+    }
+    return ok;
+}
+
+
+
+// Given the same random stream, both modes must choose the same data
+// points; only their arrangement in the reservoir differs.
+bool check_modes_agree(double alpha, size_t capacity, std::vector<size_t> const & batches, int n_seeds)
+{
+    for (int seed = 1; seed <= n_seeds; ++seed)
+    {
+        std::vector<max_size_t> chosen[2];
+        for (int m = 0; m < 2; ++m)
+        {
+            global_seed(seed);
+            weighted_reservoir r(capacity, alpha);
+            for (auto b : batches)
+            {
+                ingest(r, b, m == 0);
+                chosen[m].assign(r.idx_current(), r.idx_current() + r.size());
+                std::sort(chosen[m].begin(), chosen[m].end());
+            }
+        }
+        if (chosen[0] != chosen[1])
+        {
+            std::cout << "FAIL  keep_n_append and remove_n_inject disagree (alpha "
+                << alpha << ", seed " << seed << ")" << std::endl;
+            return false;
+        }
+    }
+    std::cout << "PASS  keep_n_append and remove_n_inject agree (alpha " << alpha
+        << ", " << n_seeds << " seeds)" << std::endl;
+    return true;
+}
+
+
+
+// Estimates of the number of data points, the sum of their grand
+// indices, and the number of even grand indices, all of which are known
+// exactly. For 'alpha > 0' grand index 0 has weight 0 and is never
+// sampled, hence is not counted; retracted data points are not counted
+// either. Each must be unbiased, and the mean of each variance
+// estimate must match the variance observed over the trials.
+// Incrementally maintained weights must give the same estimates as
+// weights rebuilt from scratch.
+bool check_estimates(
+        std::string const & name,
+        double alpha,
+        size_t capacity,
+        std::vector<size_t> const & batches,
+        bool keep,
+        roundtrip_t roundtrip,
+        max_size_t trials)
+{
+    const size_t n = stream_length({name, alpha, capacity, batches, keep, roundtrip, 0});
+    size_t n_half = 0;
+    for (size_t b = 0; b < batches.size() / 2; ++b)
+        n_half += batches[b];
+    std::vector<max_size_t> retracted;
+    if (roundtrip == roundtrip_t::retract)
+    {
+        for (max_size_t t = 0; t < n_half; t += 3)
+            retracted.push_back(t);
+    }
+
+    double truth[3] = {0., 0., 0.};
+    for (max_size_t t = 0; t < n; ++t)
+    {
+        if ((alpha > 0. && t == 0)
+                || std::find(retracted.begin(), retracted.end(), t) != retracted.end())
+            continue;
+        truth[0] += 1.;
+        truth[1] += double(t);
+        truth[2] += double(t % 2 == 0);
+    }
+    char const * what[3] = {"count", "sum", "masked count"};
+
+    double mean[3] = {0., 0., 0.};
+    double sq[3] = {0., 0., 0.};
+    double var[3] = {0., 0., 0.};
+    std::vector<double> values(capacity);
+    std::vector<unsigned char> mask(capacity);
+    size_t n_mismatch = 0;
+
+    for (max_size_t t = 0; t < trials; ++t)
+    {
+        weighted_reservoir r(capacity, alpha);
+        r.enable_estimates();
+        for (size_t b = 0; b < batches.size(); ++b)
+        {
+            if (roundtrip == roundtrip_t::resize && b == batches.size() / 2)
+            {
+                r.shrink_to((capacity + 1) / 2);
+                r.grow_to(capacity);
+            }
+            if (roundtrip == roundtrip_t::retract && b == batches.size() / 2)
+                r.retract(retracted.size(), retracted.data());
+            ingest(r, batches[b], keep);
+        }
+
+        auto idx = r.idx_current();
+        for (size_t i = 0; i < r.size(); ++i)
+        {
+            values[i] = double(idx[i]);
+            mask[i] = (idx[i] % 2 == 0);
+        }
+        reservoir_estimate e[3] = {
+            r.estimate_count(),
+            r.estimate_sum(values.data()),
+            r.estimate_count(mask.data())};
+        for (int q = 0; q < 3; ++q)
+        {
+            mean[q] += e[q].value;
+            sq[q] += e[q].value * e[q].value;
+            var[q] += e[q].variance;
+        }
+
+        r.enable_estimates();
+            // Rebuilds the weights.
+        if (std::fabs(r.estimate_sum(values.data()).value - e[1].value) > 1e-9 * truth[1])
+            ++n_mismatch;
+    }
+
+    bool ok = (n_mismatch == 0);
+    std::ostringstream out;
+    if (!ok)
+        out << "  " << n_mismatch << " trials with stale weights;";
+    const double T = double(trials);
+    for (int q = 0; q < 3; ++q)
+    {
+        double m = mean[q] / T;
+        double v = sq[q] / T - m * m;
+        double z = (m - truth[q]) / std::sqrt(v / T);
+        double v_ratio = (var[q] / T) / v;
+        bool good = std::fabs(z) < 4.5 && std::fabs(v_ratio - 1.) < 0.1;
+            // |z| < 4.5 <=> two-sided tail 7e-6.
+        ok = ok && good;
+        out << "  " << what[q] << " " << m << " (true " << truth[q]
+            << ", z " << z << ", variance ratio " << v_ratio << ")"
+            << (good ? "" : " <-") << ";";
+    }
+    std::cout << (ok ? "PASS  " : "FAIL  ") << name << ", estimates:"
+        << out.str() << std::endl;
+    return ok;
+}
+
+
+
+void print_usage(std::string const & cmd, max_size_t trials, unsigned s, int v)
+{
+    std::cout
+        << "usage: " << cmd << std::endl
+        << "         -t  trials  (default " << trials << ")" << std::endl
+        << "         -s  seed  (default " << s << ", for random)" << std::endl
+        << "         -v  verbosity  (default " << v << ")" << std::endl;
+}
+
+
+
+int main(int argc, char ** argv)
+{
+    max_size_t trials = 1000000;
+    unsigned seed = 0;
+    int verbose = 0;
+
+    int iarg = 1;
+    while (iarg < argc)
+    {
+        std::string arg{argv[iarg]};
+        ++iarg;
+        if (arg.compare("-t") == 0)
+        {
+            trials = atol(argv[iarg]);
+        } else if (arg.compare("-s") == 0)
+        {
+            seed = atoi(argv[iarg]);
+        } else if (arg.compare("-v") == 0)
+        {
+            verbose = atoi(argv[iarg]);
+        } else
+        {
+            print_usage(argv[0], trials, seed, verbose);
+            return -1;
+        }
+        iarg++;
+    }
+
+    if (trials < 1000)
+    {
+        print_usage(argv[0], trials, seed, verbose);
+        return -1;
+    }
+
+    if (seed == 0)
+    {
+        seed = global_randomize();
+    } else
+    {
+        global_seed(seed);
+    }
+    std::cout << "Random seed set to " << seed << std::endl;
+
+    // Batches mix the direct-injection path (reservoir not yet full)
+    // with the sampling path, including a batch larger than three
+    // times the capacity.
+    const size_t k = 5;
+    const std::vector<size_t> batches{3, 4, 1, 9, 2, 17, 4};
+    const max_size_t file_trials = std::max<max_size_t>(1000, trials / 50);
+    const std::vector<size_t> resize_batches{3, 4, 1, 9, 2, 17, 4, 40, 40};
+
+    std::vector<scenario_t> scenarios{
+        {"alpha 0, keep_n_append", 0., k, batches, true, roundtrip_t::none, trials},
+        {"alpha 0, remove_n_inject", 0., k, batches, false, roundtrip_t::none, trials},
+        {"alpha 0, keep_n_append, export/import", 0., k, batches, true, roundtrip_t::file, file_trials},
+        {"alpha 0, remove_n_inject, export/import", 0., k, batches, false, roundtrip_t::file, file_trials},
+        {"alpha 0, keep_n_append, bulk export/import", 0., k, batches, true, roundtrip_t::bulk, trials / 10},
+        {"alpha 0, keep_n_append, shrink/grow", 0., k, resize_batches, true, roundtrip_t::resize, trials},
+        {"alpha 0, remove_n_inject, shrink/grow", 0., k, resize_batches, false, roundtrip_t::resize, trials},
+        {"alpha 0.5, keep_n_append, one batch", 0.5, k, {20}, true, roundtrip_t::none, trials},
+        {"alpha 1, keep_n_append, one batch", 1., k, {20}, true, roundtrip_t::none, trials},
+        {"alpha 1, remove_n_inject, one batch", 1., k, {20}, false, roundtrip_t::none, trials},
+        {"alpha 2, keep_n_append, one batch", 2., k, {12}, true, roundtrip_t::none, trials},
+        {"alpha 0, bulk_append, keep_n_append", 0., k, {20, 4, 9, 2}, true, roundtrip_t::parallel, trials / 10},
+        {"alpha 1, bulk_append, one batch", 1., k, {20}, true, roundtrip_t::parallel, trials / 10},
+        {"alpha 2, bulk_append, one batch", 2., k, {12}, true, roundtrip_t::parallel, trials / 10},
+    };
+
+    bool ok = true;
+    for (auto const & s : scenarios)
+    {
+        ok = check_scenario(s, verbose) && ok;
+    }
+
+    const max_size_t est_trials = std::max<max_size_t>(1000, trials / 10);
+    ok = check_estimates("alpha 0, keep_n_append", 0., k, batches, true, roundtrip_t::none, est_trials) && ok;
+    ok = check_estimates("alpha 0, remove_n_inject", 0., k, batches, false, roundtrip_t::none, est_trials) && ok;
+    ok = check_estimates("alpha 0, keep_n_append, shrink/grow", 0., k, {20, 6}, true, roundtrip_t::resize, est_trials) && ok;
+    ok = check_estimates("alpha 0, remove_n_inject, shrink/grow", 0., k, {20, 6}, false, roundtrip_t::resize, est_trials) && ok;
+    ok = check_estimates("alpha 0, keep_n_append, retract", 0., k, {20, 6}, true, roundtrip_t::retract, est_trials) && ok;
+    ok = check_estimates("alpha 0, remove_n_inject, retract", 0., k, {9, 20, 3}, false, roundtrip_t::retract, est_trials) && ok;
+    ok = check_estimates("alpha 1, keep_n_append, one batch", 1., k, {20}, true, roundtrip_t::none, est_trials) && ok;
+    ok = check_estimates("alpha 2, remove_n_inject, one batch", 2., k, {12}, false, roundtrip_t::none, est_trials) && ok;
+
+    ok = check_modes_agree(0., k, batches, 200) && ok;
+    ok = check_modes_agree(1., k, batches, 200) && ok;
+    ok = check_modes_agree(1.5, 50, {30, 70, 10, 400, 5}, 50) && ok;
+
+    std::cout << (ok ? "All checks passed." : "Some checks FAILED.") << std::endl;
+    return ok ? 0 : 1;
+}
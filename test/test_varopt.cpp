@@ -0,0 +1,252 @@
+#include "varopt_reservoir.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <vector>
+
+
+
+void print_usage(std::string const & cmd, const double alpha, const unsigned s)
+{
+    std::cout
+        << "usage: " << cmd << std::endl
+        << "         --alpha alpha (default " << alpha << ")" << std::endl
+        << "         --cap  capacity  (required)" << std::endl
+        << "         -s  seed  (default " << s << ", for random)" << std::endl;
+}
+
+
+
+// The user array, maintained by following the move plan, must match the
+// reservoir, and the adjusted weights must add up to the total weight.
+bool check(varopt_reservoir const & r, std::vector<max_size_t> const & data, double total_weight)
+{
+    double sum = 0.;
+    for (size_t i = 0; i < r.size(); ++i)
+    {
+        if (data[i] != r.idx_current()[i] || r.idx_current()[i] >= r.grand_total())
+        {
+            std::cout << "data in slot " << i << " does not match its data point" << std::endl;
+            return false;
+        }
+        sum += r.adjusted_weight(i);
+    }
+    if (std::abs(sum - total_weight) > 1e-9 * total_weight)
+    {
+        std::cout << "adjusted weights add up to " << sum << ", total weight "
+            << total_weight << std::endl;
+        return false;
+    }
+    return true;
+}
+
+
+
+// Bias and spread of the estimated number of even grand indices in a
+// stream of 'N', over 'trials' reservoirs of capacity 'k'. Fed in three
+// batches, alternating the two modes.
+template<typename R, typename F>
+void count_even(size_t k, size_t N, int trials, F make, double & mean, double & var)
+{
+    std::vector<unsigned char> mask(k);
+    double s1 = 0.;
+    double s2 = 0.;
+    for (int trial = 0; trial < trials; ++trial)
+    {
+        R r = make();
+        r.keep_n_append(N / 3);
+        r.remove_n_inject(N / 3);
+        r.keep_n_append(N - 2 * (N / 3));
+        for (size_t i = 0; i < r.size(); ++i)
+            mask[i] = (r.idx_current()[i] % 2 == 0);
+        double x = r.estimate_count(mask.data()).value;
+        s1 += x;
+        s2 += x * x;
+    }
+    mean = s1 / trials;
+    var = s2 / trials - mean * mean;
+}
+
+
+
+int main(int argc, char ** argv)
+{
+    double alpha = 1.0;
+    unsigned seed = 0;
+    size_t capacity = 0;
+
+    int iarg = 1;
+    while (iarg < argc)
+    {
+        std::string arg{argv[iarg]};
+        ++iarg;
+        if (arg.compare("--alpha") == 0)
+        {
+            alpha = atof(argv[iarg]);
+        } else if (arg.compare("--cap") == 0)
+        {
+            capacity = atol(argv[iarg]);
+        } else if (arg.compare("-s") == 0)
+        {
+            seed = atoi(argv[iarg]);
+        } else
+        {
+            print_usage(argv[0], alpha, seed);
+            return -1;
+        }
+        iarg++;
+    }
+
+    if (capacity < 1 || alpha < 0.)
+    {
+        print_usage(argv[0], alpha, seed);
+        return -1;
+    }
+
+    if (seed == 0)
+    {
+        seed = global_randomize();
+    } else
+    {
+        global_seed(seed);
+    }
+    std::cout << "Random seed set to " << seed << std::endl;
+
+
+    // Views and exact total weight, in both modes.
+    const size_t n_max = capacity * 5;
+    std::vector<max_size_t> batch(n_max);
+    std::vector<max_size_t> data(capacity);
+    double total_weight = 0.;
+
+    varopt_reservoir reservoir(capacity, alpha);
+    for (int repeat = 0; repeat < 20; ++repeat)
+    {
+        size_t n = pick_a_number(0.01, 1.0) * n_max + 1;
+        for (size_t i = 0; i < n; ++i)
+        {
+            batch[i] = reservoir.grand_total() + i;
+            total_weight += std::pow(double(batch[i] + 1), alpha);
+        }
+        if (repeat % 2)
+            reservoir.keep_n_append(n);
+        else
+            reservoir.remove_n_inject(n);
+        apply_plan(reservoir.move_plan(), data.data(), batch.data());
+        if (!check(reservoir, data, total_weight))
+            return 1;
+    }
+
+    // Small bursts into the full reservoir; the views tell where each
+    // data point came from.
+    for (int repeat = 0; repeat < 200; ++repeat)
+    {
+        size_t n = pick_a_number(1, 10);
+        std::vector<max_size_t> old = data;
+        for (size_t i = 0; i < n; ++i)
+        {
+            batch[i] = reservoir.grand_total() + i;
+            total_weight += std::pow(double(batch[i] + 1), alpha);
+        }
+        bool keep = (repeat % 2 == 0);
+        if (keep)
+            reservoir.keep_n_append(n);
+        else
+            reservoir.remove_n_inject(n);
+        apply_plan(reservoir.move_plan(), data.data(), batch.data());
+        if (!check(reservoir, data, total_weight))
+            return 1;
+        bool ok = true;
+        if (keep)
+        {
+            ok = reservoir.n_kept() + reservoir.n_appended() == reservoir.size();
+            for (size_t j = 0; ok && j < reservoir.n_kept(); ++j)
+                ok = data[j] == old[reservoir.idx_kept()[j]];
+            for (size_t j = 0; ok && j < reservoir.n_appended(); ++j)
+                ok = data[reservoir.n_kept() + j] == batch[reservoir.idx_appended()[j]];
+        } else
+        {
+            ok = reservoir.n_removed() == reservoir.n_injected();
+            for (size_t j = 0; ok && j < reservoir.n_injected(); ++j)
+                ok = data[reservoir.idx_removed()[j]] == batch[reservoir.idx_injected()[j]];
+        }
+        if (!ok)
+        {
+            std::cout << "views do not match the move plan after a burst of " << n << std::endl;
+            return 1;
+        }
+    }
+    std::cout << "Size " << reservoir.size() << ", grand total " << reservoir.grand_total()
+        << ", threshold " << reservoir.threshold() << std::endl;
+
+
+    // Round trip through a file, then both go on alike.
+    const char * file = "varopt.h5";
+    if (reservoir.export_to_file(file) < 0)
+    {
+        std::cout << "failed to export to " << file << std::endl;
+        return 1;
+    }
+    varopt_reservoir copy;
+    if (copy.import_from_file(file) < 0)
+    {
+        std::cout << "failed to import from " << file << std::endl;
+        return 1;
+    }
+    std::remove(file);
+    for (int repeat = 0; repeat < 5; ++repeat)
+    {
+        size_t n = pick_a_number(0.01, 1.0) * n_max + 1;
+        global_seed(seed + repeat);
+        reservoir.keep_n_append(n);
+        global_seed(seed + repeat);
+        copy.keep_n_append(n);
+        if (copy.size() != reservoir.size() || copy.threshold() != reservoir.threshold()
+                || !std::equal(copy.idx_current(), copy.idx_current() + copy.size(),
+                    reservoir.idx_current()))
+        {
+            std::cout << "imported reservoir departs from the original" << std::endl;
+            return 1;
+        }
+    }
+    std::cout << "Round trip through " << file << " preserved the state" << std::endl;
+
+
+    // Unbiased, and with less variance than priority sampling of the
+    // same size. The comparison is made for 'alpha = 0' only: for
+    // 'alpha > 0' over several batches, the landmark of
+    // 'weighted_reservoir' moves and its estimates are approximate.
+    const size_t k = 20;
+    const size_t N = 400;
+    const int trials = 4000;
+    double m1, v1, m2, v2;
+    count_even<varopt_reservoir>(k, N, trials,
+            [alpha]() { return varopt_reservoir(k, alpha); }, m1, v1);
+    count_even<weighted_reservoir>(k, N, trials,
+            [alpha]()
+            {
+                weighted_reservoir r(k, alpha);
+                r.enable_estimates();
+                return r;
+            }, m2, v2);
+
+    double truth = N / 2;
+    double z = (m1 - truth) / std::sqrt(v1 / trials);
+    std::cout << "Even count over " << N << " with k = " << k << ": varopt "
+        << m1 << " (sd " << std::sqrt(v1) << ", z " << z << "), priority "
+        << m2 << " (sd " << std::sqrt(v2) << ")" << std::endl;
+    if (std::abs(z) > 4.5)
+    {
+        std::cout << "varopt estimate biased" << std::endl;
+        return 1;
+    }
+    if (alpha == 0. && !(v1 < v2))
+    {
+        std::cout << "varopt not better than priority sampling" << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
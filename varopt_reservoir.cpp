@@ -0,0 +1,716 @@
+#include "varopt_reservoir.h"
+
+#include "hdf5.h"
+#include "hdf5util.h"
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <tuple>
+
+
+
+// Order of '_large': 'std::push_heap' and friends keep the largest
+// first, so compare by '>' for the lightest first.
+static inline bool heavier(
+        std::pair<double, size_t> const & x,
+        std::pair<double, size_t> const & y)
+{
+    return x.first > y.first;
+}
+
+
+
+
+varopt_reservoir::varopt_reservoir()
+{
+}
+
+
+
+varopt_reservoir::varopt_reservoir(const size_t cap, const double alph)
+{
+    assert(cap > 0);
+    assert(alph >= 0.);
+    _capacity = cap;
+    _alpha = alph;
+    _times.resize(cap + 1);
+    _weights.resize(cap + 1);
+    _large.reserve(cap + 1);
+    _small.reserve(cap + 1);
+    _moving.reserve(cap + 1);
+    _relabel.resize(cap + 1);
+}
+
+
+
+void varopt_reservoir::clear()
+{
+    _size = 0;
+    _grand_total = 0;
+    _threshold = 0.;
+    _large.clear();
+    _small.clear();
+    _kept_or_removed = 0;
+    _idx_kept_or_removed.clear();
+    _n_identity = 0;
+    _idx_appended_or_injected.clear();
+    _moves.clear();
+    _n_relocations = 0;
+}
+
+
+
+bool varopt_reservoir::empty() const
+{
+    return _size == 0 && _grand_total == 0;
+}
+
+
+double varopt_reservoir::alpha() const
+{
+    return _alpha;
+}
+
+
+size_t varopt_reservoir::capacity() const
+{
+    return _capacity;
+}
+
+
+max_size_t varopt_reservoir::grand_total() const
+{
+    return _grand_total;
+}
+
+
+size_t varopt_reservoir::size() const
+{
+    return _size;
+}
+
+
+max_size_t const * varopt_reservoir::idx_current() const
+{
+    return _times.data();
+}
+
+
+double varopt_reservoir::threshold() const
+{
+    return _threshold;
+}
+
+
+double varopt_reservoir::weight(const size_t slot) const
+{
+    assert(slot < _size);
+    return _weights[slot];
+}
+
+
+double varopt_reservoir::adjusted_weight(const size_t slot) const
+{
+    assert(slot < _size);
+    return std::max(_weights[slot], _threshold);
+}
+
+
+double varopt_reservoir::inclusion_probability(const size_t slot) const
+{
+    assert(slot < _size);
+    if (_threshold == 0.)
+        return 1.;
+    return std::min(1., _weights[slot] / _threshold);
+}
+
+
+
+
+// Offer data point 't' of weight 'w'; 'u' is its uniform, used only if
+// the reservoir is full.
+void varopt_reservoir::offer(const max_size_t t, const double w, const double u)
+{
+    assert(w > 0.);
+
+    if (_size < _capacity)
+    {
+        _times[_size] = t;
+        _weights[_size] = w;
+        _large.push_back(std::make_pair(w, _size));
+        std::push_heap(_large.begin(), _large.end(), heavier);
+        _placed.push_back(_size);
+        ++_size;
+        return;
+    }
+
+    const size_t spare = _capacity;
+    _times[spare] = t;
+    _weights[spare] = w;
+
+    // Data points to move from the heap to the rest: the lightest, as
+    // long as each is not heavier than the threshold that would result
+    // from moving it. The new data point is considered as part of the
+    // heap without being pushed, so that it need not be found there
+    // if it ends up in another slot.
+    _moving.clear();
+    double W = _threshold * _small.size();
+        // Total adjusted weight of the rest.
+    bool new_large = (w > _threshold);
+    if (!new_large)
+    {
+        _moving.push_back(spare);
+        W += w;
+    }
+    for (;;)
+    {
+        bool from_heap;
+        double w_min;
+        if (new_large && (_large.empty() || w < _large.front().first))
+        {
+            from_heap = false;
+            w_min = w;
+        } else if (!_large.empty())
+        {
+            from_heap = true;
+            w_min = _large.front().first;
+        } else
+        {
+            break;
+        }
+
+        if (W < (double(_small.size() + _moving.size()) - 1.) * w_min)
+            break;
+
+        if (from_heap)
+        {
+            std::pop_heap(_large.begin(), _large.end(), heavier);
+            _moving.push_back(_large.back().second);
+            _large.pop_back();
+        } else
+        {
+            new_large = false;
+            _moving.push_back(spare);
+        }
+        W += w_min;
+    }
+
+    const double tau = W / double(_small.size() + _moving.size() - 1);
+
+    // Evict one of the light data points, with probability
+    // '1 - w / tau' for those moving and '1 - threshold / tau' for the
+    // rest; these add up to 1. One uniform decides both the data point
+    // and, if among the rest, which one.
+    const size_t none = size_t(-1);
+    size_t evicted = none;
+    double r = u;
+    for (size_t i = 0; i < _moving.size(); ++i)
+    {
+        double p = 1. - _weights[_moving[i]] / tau;
+        if (r < p)
+        {
+            evicted = _moving[i];
+            _moving[i] = _moving.back();
+            _moving.pop_back();
+            break;
+        }
+        r -= p;
+    }
+    if (evicted == none)
+    {
+        double q = 1. - _threshold / tau;
+        if (!_small.empty() && (q > 0. || _moving.empty()))
+        {
+            size_t j = (q > 0.) ? std::min(size_t(r / q), _small.size() - 1) : 0;
+            evicted = _small[j];
+            _small[j] = _small.back();
+            _small.pop_back();
+        } else
+        {
+            // Only by rounding.
+            evicted = _moving.back();
+            _moving.pop_back();
+        }
+    }
+
+    if (evicted != spare)
+    {
+        _times[evicted] = t;
+        _weights[evicted] = w;
+        _placed.push_back(evicted);
+        for (auto & s : _moving)
+        {
+            if (s == spare)
+                s = evicted;
+        }
+        if (new_large)
+        {
+            _large.push_back(std::make_pair(w, evicted));
+            std::push_heap(_large.begin(), _large.end(), heavier);
+        }
+    }
+
+    _small.insert(_small.end(), _moving.begin(), _moving.end());
+    _threshold = tau;
+}
+
+
+
+void varopt_reservoir::ingest(const size_t n_provided, double const * weights)
+{
+    assert(_capacity > 0);
+    assert(n_provided > 0);
+    assert(_grand_total + n_provided > _grand_total);
+        // Guard against overfow of 'max_size_t'.
+
+    std::uniform_real_distribution<double> urd{0.0, 1.0};
+    auto & urng = global_urng();
+
+    _placed.clear();
+    for (size_t i = 0; i < n_provided; ++i)
+    {
+        max_size_t t = _grand_total + i;
+        double w = weights ? weights[i] : std::pow(double(t + 1), _alpha);
+        double u = (_size < _capacity) ? 0. : urd(urng);
+        this->offer(t, w, u);
+    }
+    _grand_total += n_provided;
+
+    // A slot may have taken several new data points in turn; it holds
+    // the last.
+    std::sort(_placed.begin(), _placed.end());
+    _placed.erase(std::unique(_placed.begin(), _placed.end()), _placed.end());
+}
+
+
+
+
+void varopt_reservoir::keep_n_append(const size_t n_provided, double const * weights)
+{
+    const size_t old_size = _size;
+    const max_size_t old_total = _grand_total;
+
+    this->ingest(n_provided, weights);
+
+    // Slots holding new data points, '_placed', have been vacated by
+    // pre-existing ones, or are beyond 'old_size'. Compact the
+    // pre-existing data points left to the front, in increasing order
+    // of their old locations, and put the new ones after them in
+    // increasing order of index; then relabel the heap and the rest.
+    // Slots before the first vacated one are left alone, so the work
+    // is in the slots from there on and in the new data points.
+    const size_t n_vacated =
+        std::lower_bound(_placed.begin(), _placed.end(), old_size) - _placed.begin();
+    const size_t first = (n_vacated > 0) ? _placed.front() : old_size;
+
+    _added.clear();
+    for (size_t s : _placed)
+    {
+        _added.push_back(std::make_tuple(_times[s], _weights[s], s));
+    }
+    std::sort(_added.begin(), _added.end());
+
+    _idx_kept_or_removed.resize(old_size - n_vacated);
+    _n_identity = std::min(_n_identity, _idx_kept_or_removed.size());
+    for (size_t i = _n_identity; i < first; ++i)
+    {
+        _idx_kept_or_removed[i] = i;
+    }
+    _n_identity = first;
+    _idx_appended_or_injected.clear();
+    _moves.clear();
+
+    size_t nn = first;
+    for (size_t i = first; i < old_size; ++i)
+    {
+        if (_times[i] < old_total)
+        {
+            if (nn != i)
+            {
+                _times[nn] = _times[i];
+                _weights[nn] = _weights[i];
+                _moves.push_back(reservoir_move{i, nn});
+            }
+            _relabel[i] = nn;
+            _idx_kept_or_removed[nn] = i;
+            ++nn;
+        }
+    }
+    _n_relocations = _moves.size();
+
+    bool relabelled = (_n_relocations > 0);
+    for (auto const & a : _added)
+    {
+        size_t idx = size_t(std::get<0>(a) - old_total);
+        size_t s = std::get<2>(a);
+        _times[nn] = std::get<0>(a);
+        _weights[nn] = std::get<1>(a);
+        _relabel[s] = nn;
+        relabelled = relabelled || (s != nn);
+        _idx_appended_or_injected.push_back(idx);
+        _moves.push_back(reservoir_move{idx, nn});
+        ++nn;
+    }
+    assert(nn == _size);
+
+    if (relabelled)
+    {
+        for (auto & e : _large)
+        {
+            if (e.second >= first)
+                e.second = _relabel[e.second];
+        }
+            // Weights are unchanged, hence so is the heap order.
+        for (auto & s : _small)
+        {
+            if (s >= first)
+                s = _relabel[s];
+        }
+    }
+
+    _kept_or_removed = 1;
+}
+
+
+
+void varopt_reservoir::remove_n_inject(const size_t n_provided, double const * weights)
+{
+    const size_t old_size = _size;
+    const max_size_t old_total = _grand_total;
+
+    this->ingest(n_provided, weights);
+
+    // The sampling is in place already: a slot below 'old_size' that
+    // holds a new data point has had its pre-existing one removed.
+    _idx_kept_or_removed.clear();
+    _n_identity = 0;
+    _idx_appended_or_injected.clear();
+    _moves.clear();
+    for (size_t i : _placed)
+    {
+        size_t idx = size_t(_times[i] - old_total);
+        if (i < old_size)
+            _idx_kept_or_removed.push_back(i);
+        _idx_appended_or_injected.push_back(idx);
+        _moves.push_back(reservoir_move{idx, i});
+    }
+    _n_relocations = 0;
+
+    _kept_or_removed = 2;
+}
+
+
+
+
+size_t varopt_reservoir::n_kept() const
+{
+    return (_kept_or_removed == 1) ? _idx_kept_or_removed.size() : 0;
+}
+
+
+size_t const * varopt_reservoir::idx_kept() const
+{
+    return (_kept_or_removed == 1) ? _idx_kept_or_removed.data() : nullptr;
+}
+
+
+size_t varopt_reservoir::n_appended() const
+{
+    return (_kept_or_removed == 1) ? _idx_appended_or_injected.size() : 0;
+}
+
+
+size_t const * varopt_reservoir::idx_appended() const
+{
+    return (_kept_or_removed == 1) ? _idx_appended_or_injected.data() : nullptr;
+}
+
+
+size_t varopt_reservoir::n_removed() const
+{
+    return (_kept_or_removed == 2) ? _idx_kept_or_removed.size() : 0;
+}
+
+
+size_t const * varopt_reservoir::idx_removed() const
+{
+    return (_kept_or_removed == 2) ? _idx_kept_or_removed.data() : nullptr;
+}
+
+
+size_t varopt_reservoir::n_injected() const
+{
+    return (_kept_or_removed == 2) ? _idx_appended_or_injected.size() : 0;
+}
+
+
+size_t const * varopt_reservoir::idx_injected() const
+{
+    return (_kept_or_removed == 2) ? _idx_appended_or_injected.data() : nullptr;
+}
+
+
+reservoir_move_plan varopt_reservoir::move_plan() const
+{
+    reservoir_move_plan plan;
+    plan.moves = _moves.data();
+    plan.n_relocations = _n_relocations;
+    plan.n_insertions = _moves.size() - _n_relocations;
+    return plan;
+}
+
+
+
+
+// Horvitz-Thompson sum over the sample, with '1 / p = max(1, tau / w)';
+// 'x = 1' for counts.
+template<bool has_values, bool has_mask>
+static reservoir_estimate varopt_ht_sum(
+        size_t n,
+        double const * w,
+        double tau,
+        double const * values,
+        unsigned char const * mask)
+{
+    double sum = 0.;
+    double var = 0.;
+    for (size_t i = 0; i < n; ++i)
+    {
+        double inv_p = std::max(1., tau / w[i]);
+        double x = has_values ? values[i] : 1.;
+        if (has_mask)
+            x *= double(mask[i] != 0);
+        double y = x * inv_p;
+        sum += y;
+        var += y * (y - x);
+    }
+    return reservoir_estimate{sum, var};
+}
+
+
+
+reservoir_estimate varopt_reservoir::estimate_sum(
+        double const * values,
+        unsigned char const * mask) const
+{
+    assert(values != nullptr || _size == 0);
+    if (mask != nullptr)
+        return varopt_ht_sum<true, true>(_size, _weights.data(), _threshold, values, mask);
+    else
+        return varopt_ht_sum<true, false>(_size, _weights.data(), _threshold, values, mask);
+}
+
+
+
+reservoir_estimate varopt_reservoir::estimate_count(
+        unsigned char const * mask) const
+{
+    if (mask != nullptr)
+        return varopt_ht_sum<false, true>(_size, _weights.data(), _threshold, nullptr, mask);
+    else
+        return varopt_ht_sum<false, false>(_size, _weights.data(), _threshold, nullptr, mask);
+}
+
+
+
+
+herr_t varopt_reservoir::export_to_file(hid_t loc_id) const
+{
+    assert(_capacity > 0);
+
+    hsize_t dims[1];
+    herr_t status;
+
+    dims[0] = 1;
+
+    status = h5make_dataset_number(loc_id, "alpha", 1, dims, &_alpha);
+    if (status < 0)
+        return status;
+
+    status = h5make_dataset_number(loc_id, "capacity", 1, dims, &_capacity);
+    if (status < 0)
+        return status;
+
+    status = h5make_dataset_number(loc_id, "current_size", 1, dims, &_size);
+    if (status < 0)
+        return status;
+
+    status = h5make_dataset_number(loc_id, "grand_total", 1, dims, &_grand_total);
+    if (status < 0)
+        return status;
+
+    status = h5make_dataset_number(loc_id, "threshold", 1, dims, &_threshold);
+    if (status < 0)
+        return status;
+
+    dims[0] = _capacity;
+    status = h5make_dataset_number(loc_id, "chosen_times", 1, dims, _times.data());
+    if (status < 0)
+        return status;
+    status = h5make_dataset_number(loc_id, "weights", 1, dims, _weights.data());
+    if (status < 0)
+        return status;
+
+    std::vector<size_t> order(_capacity, 0);
+    for (size_t i = 0; i < _large.size(); ++i)
+    {
+        order[i] = _large[i].second;
+    }
+    std::copy(_small.begin(), _small.end(), order.begin() + _large.size());
+    status = h5make_dataset_number(loc_id, "order", 1, dims, order.data());
+    if (status < 0)
+        return status;
+
+    size_t n_large = _large.size();
+    dims[0] = 1;
+    status = h5make_dataset_number(loc_id, "n_large", 1, dims, &n_large);
+    if (status < 0)
+        return status;
+
+    return 0;
+}
+
+
+
+herr_t varopt_reservoir::export_to_file(hid_t loc_id, char const * name) const
+{
+    if (name[0] == '.' && name[1] == '\0')
+    {
+        return this->export_to_file(loc_id);
+    } else
+    {
+        hid_t group_id = H5Gcreate(loc_id, name, H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+        if (group_id < 0)
+        {
+            return group_id;
+        }
+        auto status = this->export_to_file(group_id);
+        H5Gclose(group_id);
+        return status;
+    }
+}
+
+
+
+herr_t varopt_reservoir::export_to_file(char const * file) const
+{
+    hid_t file_id = H5Fcreate(file, H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT);
+    if (file_id < 0)
+    {
+        return file_id;
+    }
+    herr_t status = this->export_to_file(file_id);
+    H5Fclose(file_id);
+    return status;
+}
+
+
+
+
+herr_t varopt_reservoir::import_from_file(hid_t loc_id)
+{
+    assert(this->empty());
+
+    herr_t status;
+
+    status = h5read_dataset_number(loc_id, "alpha", &_alpha);
+    if (status < 0)
+        return status;
+
+    status = h5read_dataset_number(loc_id, "capacity", &_capacity);
+    if (status < 0)
+        return status;
+
+    status = h5read_dataset_number(loc_id, "current_size", &_size);
+    if (status < 0)
+        return status;
+
+    status = h5read_dataset_number(loc_id, "grand_total", &_grand_total);
+    if (status < 0)
+        return status;
+
+    status = h5read_dataset_number(loc_id, "threshold", &_threshold);
+    if (status < 0)
+        return status;
+
+    assert(_capacity > 0);
+        // This is guaranteed by 'export_to_file'.
+
+    _times.resize(_capacity + 1);
+    _weights.resize(_capacity + 1);
+    _relabel.resize(_capacity + 1);
+
+    status = h5read_dataset_number(loc_id, "chosen_times", _times.data());
+    if (status < 0)
+        return status;
+
+    status = h5read_dataset_number(loc_id, "weights", _weights.data());
+    if (status < 0)
+        return status;
+
+    std::vector<size_t> order(_capacity);
+    status = h5read_dataset_number(loc_id, "order", order.data());
+    if (status < 0)
+        return status;
+
+    size_t n_large;
+    status = h5read_dataset_number(loc_id, "n_large", &n_large);
+    if (status < 0)
+        return status;
+
+    _large.clear();
+    _small.clear();
+    for (size_t i = 0; i < _size; ++i)
+    {
+        if (i < n_large)
+            _large.push_back(std::make_pair(_weights[order[i]], order[i]));
+        else
+            _small.push_back(order[i]);
+    }
+        // Already a heap.
+
+    _kept_or_removed = 0;
+    _idx_kept_or_removed.clear();
+    _n_identity = 0;
+    _idx_appended_or_injected.clear();
+    _moves.clear();
+    _n_relocations = 0;
+
+    return 0;
+}
+
+
+
+herr_t varopt_reservoir::import_from_file(hid_t loc_id, char const * name)
+{
+    if (name[0] == '.' && name[1] == '\0')
+    {
+        return this->import_from_file(loc_id);
+    } else
+    {
+        hid_t group_id = H5Gopen(loc_id, name, H5P_DEFAULT);
+        if (group_id < 0)
+        {
+            return group_id;
+        }
+        auto status = this->import_from_file(group_id);
+        H5Gclose(group_id);
+        return status;
+    }
+}
+
+
+
+herr_t varopt_reservoir::import_from_file(char const * file)
+{
+    assert(this->empty());
+    hid_t file_id = H5Fopen(file, H5F_ACC_RDONLY, H5P_DEFAULT);
+    if (file_id < 0)
+    {
+        return file_id;
+    }
+    herr_t status = this->import_from_file(file_id);
+    H5Fclose(file_id);
+    return status;
+}
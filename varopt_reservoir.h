@@ -0,0 +1,199 @@
+#ifndef VAROPT_RESERVOIR_H
+#define VAROPT_RESERVOIR_H
+
+
+#include "reservoir.h"
+
+#include <cstddef>    // size_t
+#include <tuple>
+#include <utility>
+#include <vector>
+
+
+
+/*
+ * Variance-optimal weighted sampling (VarOpt_k) with a reservoir,
+ * an alternative to the priority sampling of 'weighted_reservoir'.
+ *
+ * Every data point has a positive weight 'w'. The sample holds 'k'
+ * data points and a threshold 'tau'; the adjusted weight of a data
+ * point in the sample is 'max(w, tau)'. The adjusted weights add up to
+ * the total weight of the stream exactly, and subset sums estimated
+ * from them have the least average variance of any scheme with a
+ * sample of 'k' (Cohen, Duffield, Kaplan, Lund, Thorup 2009).
+ *
+ * The sample is kept as the data points with 'w > tau' in a min-heap
+ * by weight, and the rest, whose adjusted weight is 'tau'. A new data
+ * point, once the reservoir is full, moves the lightest of the heap to
+ * the rest while they fall under the new threshold, then evicts one
+ * data point, drawn with probability '1 - max(w, tau) / tau_new'. Each
+ * data point enters and leaves the heap at most once: amortized
+ * O(log k) per data point, and one uniform.
+ *
+ * Weights are given per data point by the caller or, by default, are
+ * forward-decay weights '(t + 1)^alpha' for grand index 't', that is,
+ * with the landmark fixed before the first data point. Unlike in
+ * 'weighted_reservoir' the landmark does not follow the oldest data
+ * point in the sample: adjusted weights accumulate over the stream,
+ * so weights must stay on one scale.
+ *
+ * The reservoir works in place, one slot evicted per data point after
+ * it is full, and reports each call through the same views as
+ * 'weighted_reservoir': 'idx_kept'/'idx_appended' after
+ * 'keep_n_append', 'idx_removed'/'idx_injected' after
+ * 'remove_n_inject', and 'move_plan' after either. These are built
+ * from the slots the call wrote to, so 'remove_n_inject' adds
+ * O(m log m) for 'm' data points accepted. 'keep_n_append' also
+ * compacts the slots from the first vacated one on, as
+ * 'weighted_reservoir' does.
+ *
+ * References:
+ *
+ * Edith Cohen, Nick Duffield, Haim Kaplan, Carsten Lund, Mikkel Thorup,
+ * Stream sampling for variance-optimal estimation of subset sums,
+ * SODA 2009, 1255--1264.
+ */
+class varopt_reservoir
+{
+    public:
+        varopt_reservoir(size_t cap, double alph);
+
+        varopt_reservoir();
+            // Use this form only when the reservoir is to be imported
+            // from a disk file; otherwise use the first form.
+
+        void clear();
+
+        bool empty() const;
+
+        double alpha() const;
+
+        size_t capacity() const;
+
+
+        void keep_n_append(
+                size_t n_provided,
+                double const * weights = nullptr
+                    // If not 'nullptr', the positive weights of the
+                    // 'n_provided' new data points; otherwise the
+                    // forward-decay weights.
+                );
+
+        // As in 'weighted_reservoir', after 'keep_n_append'.
+        size_t n_kept() const;
+        size_t const * idx_kept() const;
+        size_t n_appended() const;
+        size_t const * idx_appended() const;
+
+        void remove_n_inject(
+                size_t n_provided,
+                double const * weights = nullptr
+                    // As in 'keep_n_append'.
+                );
+
+        // As in 'weighted_reservoir', after 'remove_n_inject'.
+        size_t n_removed() const;
+        size_t const * idx_removed() const;
+        size_t n_injected() const;
+        size_t const * idx_injected() const;
+
+        reservoir_move_plan move_plan() const;
+            // As 'weighted_reservoir::move_plan'.
+
+
+        max_size_t grand_total() const;
+
+        size_t size() const;
+
+        max_size_t const * idx_current() const;
+            // Grand indices of the 'size()' data points in the
+            // reservoir.
+
+
+        double threshold() const;
+            // 'tau'; 0 until the reservoir has been full.
+
+        double weight(size_t slot) const;
+            // The weight the data point was offered with.
+
+        double adjusted_weight(size_t slot) const;
+            // 'max(w, tau)'; over the reservoir, these add up to the
+            // total weight of the stream.
+
+        double inclusion_probability(size_t slot) const;
+            // 'min(1, w / tau)'.
+
+        reservoir_estimate estimate_sum(
+                double const * values,
+                unsigned char const * mask = nullptr) const;
+        reservoir_estimate estimate_count(
+                unsigned char const * mask = nullptr) const;
+            // As in 'weighted_reservoir': Horvitz-Thompson estimates
+            // over the stream, from 'size()' values in the order of
+            // 'idx_current', optionally restricted by 'mask'. The
+            // variance estimate sums 'y (y - x)' over the sample, with
+            // 'y = x / p'.
+
+
+        herr_t export_to_file(char const * file_name) const;
+        herr_t export_to_file(hid_t loc_id, char const * obj_name) const;
+            // Writes 'alpha', 'capacity', 'current_size',
+            // 'grand_total', 'threshold', 'chosen_times', 'weights',
+            // and 'n_large' and 'order': the slots of the heap in heap
+            // order, then the rest, so that an imported reservoir goes
+            // on exactly as the original would.
+
+        herr_t import_from_file(char const * file_name);
+        herr_t import_from_file(hid_t loc_id, char const * obj_name);
+
+    private:
+        void ingest(size_t n_provided, double const * weights);
+        void offer(max_size_t t, double w, double u);
+
+        herr_t export_to_file(hid_t) const;
+        herr_t import_from_file(hid_t);
+
+        size_t _capacity = 0;
+        double _alpha = 0.;
+        size_t _size = 0;
+        max_size_t _grand_total = 0;
+        double _threshold = 0.;
+
+        std::vector<max_size_t> _times;
+        std::vector<double> _weights;
+            // 'capacity + 1' entries; the last is a spare slot for the
+            // data point being offered.
+
+        std::vector<std::pair<double, size_t>> _large;
+            // (weight, slot) of the data points with 'w > tau';
+            // a min-heap.
+        std::vector<size_t> _small;
+            // Slots of the rest.
+        std::vector<size_t> _moving;
+            // Per data point offered: slots leaving the heap, and the
+            // new data point if light; workspace.
+        std::vector<size_t> _placed;
+            // Slots that took a new data point in the current call, in
+            // increasing order once the call has offered all.
+        std::vector<std::tuple<max_size_t, double, size_t>> _added;
+            // (grand index, weight, slot) of the new data points in the
+            // reservoir; workspace of 'keep_n_append'.
+        std::vector<size_t> _relabel;
+            // 'capacity + 1' entries; new slot by old slot, workspace
+            // of 'keep_n_append'.
+
+        // Not part of the state; describe the last call.
+        int _kept_or_removed = 0;
+            // 1 after 'keep_n_append', 2 after 'remove_n_inject'.
+        std::vector<size_t> _idx_kept_or_removed;
+        size_t _n_identity = 0;
+            // After 'keep_n_append', leading entries of
+            // '_idx_kept_or_removed' known to equal their position.
+        std::vector<size_t> _idx_appended_or_injected;
+        std::vector<reservoir_move> _moves;
+        size_t _n_relocations = 0;
+};
+
+
+
+#endif  // VAROPT_RESERVOIR_H